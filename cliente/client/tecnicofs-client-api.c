@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "tecnicofs-client-api.h"
 #include <string.h>
 #include <stdlib.h>
@@ -5,223 +6,1110 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <linux/futex.h>
+
+/* descriptors received and not yet matched with their responses */
+#define MAX_RECEIVED_FDS 16
+
+/* times we poll the response ring before sleeping in a futex, if the
+ * server can run on another CPU meanwhile */
+#define SHM_SPINS 2000
 
 char client_name[MAX_INPUT_SIZE]; /* the client's name */
-int sockfd; /* the client socket's file descriptor */
+int sockfd = -1; /* the client socket's file descriptor */
+int textProtocol; /* whether the session uses the old text commands */
+int bound; /* whether the client socket has a name to unlink */
+int connected; /* whether the server knows the session */
+
+/* a submitted request, until its response is collected */
+typedef struct pending_req {
+  int ticket;   /* 0 if the slot is free */
+  int done;
+  int result;
+  void *data;    /* where the response's data goes */
+  size_t data_cap;
+  int passes_fd; /* whether a successful response passes a descriptor */
+  tfs_callback cb;
+  void *arg;
+  int deferred;  /* whether it's done and its callback is yet to run */
+} pending_req;
+
+pending_req pending[TFS_MAX_PENDING]; /* indexed by ticket % TFS_MAX_PENDING */
+int last_ticket; /* ticket (and request id) of the last request */
+int n_outstanding; /* requests submitted and not yet answered */
+int n_used; /* slots taken, answered or not */
+int n_deferred; /* requests whose callbacks wait for runDeferred */
+int receiving; /* whether some thread is receiving responses */
+char rbuf[4 * TFS_MAX_RESPONSE]; /* responses received only in part */
+size_t rlen;
+int fdq[MAX_RECEIVED_FDS]; /* descriptors received, in order, for the responses that pass one */
+int fdq_head, fdq_len;
+tfs_shm *shm; /* the rings, if the session goes through shared memory */
+int ring_inflight; /* requests put in the ring whose responses weren't taken */
+int shm_spins; /* SHM_SPINS, or 0 with a single CPU */
+pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER; /* guards all of the above */
+pthread_cond_t state_cond = PTHREAD_COND_INITIALIZER; /* signaled when a receive ends */
+pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER; /* keeps messages whole on the socket */
+static __thread int sending; /* set while this thread holds send_lock and receives */
+static __thread int running_deferred; /* set while this thread runs deferred callbacks */
+
+/* what a request carries, and where its response's data goes */
+typedef struct request_args {
+  uint8_t opcode;
+  uint8_t flags;
+  char *arg1;
+  size_t len1;
+  char *arg2;
+  size_t len2;
+  void *data;
+  size_t data_cap;
+  int fd; /* descriptor to pass with the request, or -1 */
+} request_args;
+
+static int receiveResponses(int block);
+static void runDeferred(int nested);
 socklen_t servlen, clilen; /* size of server and client sockets */
 struct sockaddr_un serv_addr, client_addr; /* address of server and client sockets */
 
-/** 
- * Sends a command corresponding to a create operation for the server to
- execute and receives its output.
+/*
+ * Sends a text command and receives its result (old protocol).
  * Input:
- * - filename: the file/directory to be created
- * - nodeType: either a file or a directory
- * Returns: SUCCESS or FAIL
+ * - op: the command letter
+ * - arg1: first argument
+ * - arg2: second argument, or NULL
+ * Returns: the result of the command or FAIL
  */
-int tfsCreate(char *filename, char nodeType) {
-  int res, i;
+static int sendText(char op, char *arg1, char *arg2) {
+  int res, len;
   char command[MAX_INPUT_SIZE];
 
-  /* "reconstructing" the original command */
-  command[0] = 'c';
-  command[1] = ' ';
-  for (i = 0; i < strlen(filename); i++) {
-    command[i+2] = filename[i];
+  if (arg2)
+    len = snprintf(command, sizeof(command), "%c %s %s", op, arg1, arg2);
+  else
+    len = snprintf(command, sizeof(command), "%c %s", op, arg1);
+  if (len >= sizeof(command)) {
+    fprintf(stderr, "client: command too long\n");
+    return FAIL;
   }
-  command[i+2] = ' ';
-  command[i+2+1] = nodeType;
-  command[i+2+2] = '\0';
-  
+
   /* send the command to the server, to be executed */
-  if (sendto(sockfd, command, strlen(command) + 1, 0,(struct sockaddr *)&serv_addr, servlen) < 0) {
-    perror("client: sendto error");
-    return -1;
+  if (send(sockfd, command, len + 1, MSG_NOSIGNAL) < 0) {
+    perror("client: send error");
+    return FAIL;
   }
 
   /* receive the response from the server, after it has executed the command */
-  if (recvfrom(sockfd, &res, sizeof(res), 0,0,0) < 0) {
-    perror("client: recvfrom error");
-    return -1;
+  if (recv(sockfd, &res, sizeof(res), MSG_WAITALL) != sizeof(res)) {
+    perror("client: recv error");
+    return FAIL;
   }
   return res;
 }
 
-/** 
- * Sends a command corresponding to a delete operation for the server to
- execute and receives its output.
+/*
+ * Takes a free slot of the pending table for a new request.
+ * Called with state_lock held.
+ * Returns: the ticket of the request, or one of TECNICOFS_ERROR_*
+ */
+static int allocTicket(request_args *a, tfs_callback cb, void *arg) {
+  int ticket;
+  pending_req *p;
+
+  if (sockfd < 0)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+
+  /* with every slot taken, wait for some request to finish */
+  while (n_used == TFS_MAX_PENDING) {
+    if (n_deferred > 0 && !sending) {
+      runDeferred(1);
+      continue;
+    }
+    if (n_outstanding == 0 || sockfd < 0)
+      return TECNICOFS_ERROR_OTHER; /* all hold results nobody collected */
+    receiveResponses(1);
+  }
+
+  /* skip tickets whose slot is still taken */
+  do {
+    if (++last_ticket <= 0)
+      last_ticket = 1;
+  } while (pending[last_ticket % TFS_MAX_PENDING].ticket);
+  ticket = last_ticket;
+  p = &pending[ticket % TFS_MAX_PENDING];
+
+  p->ticket = ticket;
+  p->done = 0;
+  p->data = a->data;
+  p->data_cap = a->data_cap;
+  p->passes_fd = a->opcode == TFS_OP_DUMP;
+  p->cb = cb;
+  p->arg = arg;
+  n_outstanding++;
+  n_used++;
+  return ticket;
+}
+
+/*
+ * Completes a pending request: keeps the result for tfsWait, or for
+ * runDeferred to pass to its callback. Callbacks never run where they
+ * happen, as one that submits a request would wait forever for
+ * send_lock or for its own receive to end. Called with state_lock held.
+ */
+static void completeRequest(pending_req *p, int result) {
+  n_outstanding--;
+  p->result = result;
+  p->done = 1;
+  if (p->cb) {
+    p->deferred = 1;
+    n_deferred++;
+  }
+}
+
+/*
+ * Runs the callbacks of the completed requests. Callbacks that submit
+ * requests complete more; the outermost call runs those too, rather
+ * than recursing, unless every slot is taken.
+ * Called with state_lock held; callbacks run without it.
  * Input:
- * - path: the file/directory to be deleted
- * Returns: SUCCESS or FAIL
+ * - nested: whether to run them even inside a callback
  */
-int tfsDelete(char *path) {
-  int res, i;
-  char command[MAX_INPUT_SIZE];
+static void runDeferred(int nested) {
+  pending_req *p;
+  tfs_callback cb;
+  void *arg;
+  int ticket, result, outer = running_deferred;
 
-  /* "reconstructing" the original command */
-  command[0] = 'd';
-  command[1] = ' ';
-  for (i = 0; i < strlen(path); i++) {
-    command[i+2] = path[i];
+  if (sending || (outer && !nested))
+    return;
+  running_deferred = 1;
+  for (int i = 0; n_deferred > 0; i = (i + 1) % TFS_MAX_PENDING) {
+    p = &pending[i];
+    if (!p->deferred)
+      continue;
+    cb = p->cb;
+    arg = p->arg;
+    ticket = p->ticket;
+    result = p->result;
+    p->deferred = 0;
+    p->ticket = 0;
+    n_deferred--;
+    n_used--;
+    pthread_mutex_unlock(&state_lock);
+    cb(ticket, result, arg);
+    pthread_mutex_lock(&state_lock);
   }
-  command[i+2] = '\0';
+  running_deferred = outer;
+}
 
-  /* send the command to the server, to be executed */
-  if (sendto(sockfd, command, strlen(command) + 1, 0,(struct sockaddr *)&serv_addr, servlen) < 0) {
-    perror("client: sendto error");
-    return -1;
+/*
+ * Queues the descriptors passed in a received message. They come in the
+ * order of the responses that pass them; any that don't fit are closed.
+ * Called with state_lock held.
+ */
+static void queueFds(struct msghdr *msg) {
+  struct cmsghdr *cmsg;
+  int fd;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    for (size_t i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++) {
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      if (fdq_len < MAX_RECEIVED_FDS)
+        fdq[(fdq_head + fdq_len++) % MAX_RECEIVED_FDS] = fd;
+      else
+        close(fd);
+    }
   }
+}
 
-  /* receive the response from the server, after it has executed the command */
-  if (recvfrom(sockfd, &res, sizeof(res), 0,0,0) < 0) {
-    perror("client: recvfrom error");
-    return -1;
+/*
+ * Takes the next queued descriptor. Called with state_lock held.
+ * Returns: the descriptor, or TECNICOFS_ERROR_OTHER if it was lost
+ */
+static int dequeueFd() {
+  int fd;
+
+  if (fdq_len == 0)
+    return TECNICOFS_ERROR_OTHER;
+  fd = fdq[fdq_head];
+  fdq_head = (fdq_head + 1) % MAX_RECEIVED_FDS;
+  fdq_len--;
+  return fd;
+}
+
+static long futex(uint32_t *addr, int op, uint32_t val, struct timespec *timeout) {
+  return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+/*
+ * Waits until the response ring has a slot to take: polls for a while,
+ * then sleeps until the server wakes us up.
+ * Returns: SUCCESS, or FAIL if the server went away
+ */
+static int ringWait() {
+  struct timespec timeout = { 1, 0 };
+  tfs_ring *ring = &shm->responses;
+  uint32_t tail = ring->tail;
+
+  for (int spins = 0; ; spins++) {
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != tail)
+      return SUCCESS;
+    if (spins < shm_spins) {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#endif
+      continue;
+    }
+
+    /* the server checks waiting after publishing, so no wakeup is lost */
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail &&
+        futex(&ring->head, FUTEX_WAIT, tail, &timeout) < 0 && errno == ETIMEDOUT &&
+        kill(shm->server_pid, 0) < 0 && errno == ESRCH)
+      return FAIL;
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+    spins = 0;
   }
-  
-  return res;
 }
 
-/** 
- * Sends a command corresponding to a move operation for the server to
- execute and receives its output.
+/*
+ * Puts a request in the request ring. At most TFS_RING_SLOTS requests
+ * are in the rings at once, so neither ring can ever be full.
+ * Returns: SUCCESS
+ */
+static int ringSend(char *msg, size_t len) {
+  tfs_ring *ring = &shm->requests;
+  tfs_ring_slot *slot;
+
+  pthread_mutex_lock(&state_lock);
+  while (ring_inflight == TFS_RING_SLOTS)
+    receiveResponses(1);
+  ring_inflight++;
+  pthread_mutex_unlock(&state_lock);
+
+  pthread_mutex_lock(&send_lock);
+  slot = &ring->slots[ring->head % TFS_RING_SLOTS];
+  memcpy(slot->data, msg, len);
+  slot->len = len;
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST))
+    futex(&ring->head, FUTEX_WAKE, 1, NULL);
+  pthread_mutex_unlock(&send_lock);
+  return SUCCESS;
+}
+
+/*
+ * Completes the request a response answers. Called with state_lock held.
  * Input:
- * - from: the file/directory to be moved
- * - to: where it is going to be now 
- * Returns: SUCCESS or FAIL
+ * - res: the response's header
+ * - data: the res.data_len bytes that follow it
+ * Returns: 1 if a request was completed, 0 if nobody waits for it
  */
-int tfsMove(char *from, char *to) {
-  int res, i, j;
-  char command[MAX_INPUT_SIZE];
+static int completeResponse(tfs_response *res, char *data) {
+  pending_req *p = &pending[res->req_id % TFS_MAX_PENDING];
+  int result;
+
+  if (res->magic != TFS_PROTO_MAGIC || p->ticket != res->req_id || p->done)
+    return 0;
+  if (p->data)
+    memcpy(p->data, data, res->data_len < p->data_cap ? res->data_len : p->data_cap);
+  result = res->error ? res->error : res->result;
+  if (p->passes_fd && result >= 0)
+    result = dequeueFd();
+  completeRequest(p, result);
+  return 1;
+}
+
+/*
+ * Completes every outstanding request with a connection error, once
+ * the server can't answer them anymore. Called with state_lock held.
+ */
+static int failOutstanding() {
+  int completed = 0;
+
+  for (int i = 0; i < TFS_MAX_PENDING; i++) {
+    if (pending[i].ticket && !pending[i].done) {
+      completeRequest(&pending[i], TECNICOFS_ERROR_CONNECTION_ERROR);
+      completed++;
+    }
+  }
+  ring_inflight = 0;
+  return completed;
+}
 
-  /* "reconstructing" the original command */
-  command[0] = 'm';
-  command[1] = ' ';
-  for (i = 0; i < strlen(from); i++) {
-    command[i+2] = from[i];
+/*
+ * Receives the responses available and completes their requests. Only
+ * one thread receives at a time; the others wait for it to finish.
+ * Called with state_lock held.
+ * Input:
+ * - block: whether to wait for at least one response
+ * Returns: number of requests completed
+ */
+static int receiveResponses(int block) {
+  tfs_response res;
+  size_t off = 0, size;
+  ssize_t n;
+  int completed = 0;
+  char control[CMSG_SPACE(sizeof(int) * MAX_RECEIVED_FDS)];
+  struct iovec iov;
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+
+  if (receiving) {
+    if (block)
+      pthread_cond_wait(&state_cond, &state_lock);
+    return 0;
   }
-  command[i+2] = ' ';
-  for (j = 0; j < strlen(to) ; j++) {
-    command[i+2+1+j] = to[j];
+  receiving = 1;
+
+  if (shm) {
+    tfs_ring *ring = &shm->responses;
+    int ready = SUCCESS;
+
+    if (block) {
+      pthread_mutex_unlock(&state_lock);
+      ready = ringWait();
+      pthread_mutex_lock(&state_lock);
+    }
+    if (ready == FAIL) {
+      fprintf(stderr, "client: server went away\n");
+      completed = failOutstanding();
+    }
+    /* responses stay in their slots until we advance tail */
+    while (shm && ready == SUCCESS && __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail) {
+      tfs_ring_slot *slot = &ring->slots[ring->tail % TFS_RING_SLOTS];
+      memcpy(&res, slot->data, sizeof(tfs_response));
+      if (slot->len >= sizeof(tfs_response) + res.data_len)
+        completed += completeResponse(&res, slot->data + sizeof(tfs_response));
+      __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+      ring_inflight--;
+    }
+    goto out;
   }
-  command[i+2+1+j] = '\0';
 
-  /* send the command to the server, to be executed */
-  if (sendto(sockfd, command, strlen(command) + 1, 0,(struct sockaddr *)&serv_addr, servlen) < 0) {
-    perror("client: sendto error");
-    return -1;
+  iov.iov_base = rbuf + rlen;
+  iov.iov_len = sizeof(rbuf) - rlen;
+  pthread_mutex_unlock(&state_lock);
+  n = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC | (block ? 0 : MSG_DONTWAIT));
+  pthread_mutex_lock(&state_lock);
+  if (n > 0)
+    queueFds(&msg);
+
+  if (n <= 0 && (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))) {
+    /* nothing outstanding will be answered anymore */
+    perror("client: recv error");
+    completed = failOutstanding();
+  } else if (n > 0) {
+    rlen += n;
+    for (; rlen - off >= sizeof(tfs_response); off += size) {
+      memcpy(&res, rbuf + off, sizeof(tfs_response));
+      size = sizeof(tfs_response) + res.data_len;
+      if (rlen - off < size)
+        break;
+      /* a response nobody waits for anymore is dropped */
+      completed += completeResponse(&res, rbuf + off + sizeof(tfs_response));
+    }
+    rlen -= off;
+    memmove(rbuf, rbuf + off, rlen);
   }
 
-  /* receive the response from the server, after it has executed the command */
-  if (recvfrom(sockfd, &res, sizeof(res), 0,0,0) < 0) {
-    perror("client: recvfrom error");
-    return -1;
+out:
+  receiving = 0;
+  pthread_cond_broadcast(&state_cond);
+  runDeferred(0);
+  return completed;
+}
+
+/*
+ * Sends a whole message. While the socket is full, responses are
+ * received, so a server that waits for us to read doesn't stall us;
+ * their callbacks run once send_lock is released.
+ * Input:
+ * - msg, len: the message
+ * - fd: a descriptor to pass with it, or -1
+ * Returns: SUCCESS or FAIL
+ */
+static int sendMessage(char *msg, size_t len, int fd) {
+  struct pollfd pfd = { .fd = sockfd, .events = POLLIN | POLLOUT };
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov;
+  struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+  size_t off = 0;
+  ssize_t n;
+  int res = SUCCESS;
+
+  if (fd >= 0) {
+    struct cmsghdr *cmsg;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  pthread_mutex_lock(&send_lock);
+  while (off < len) {
+    iov.iov_base = msg + off;
+    iov.iov_len = len - off;
+    n = sendmsg(sockfd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n > 0) {
+      off += n;
+      mh.msg_control = NULL; /* the descriptor went with the first byte */
+      mh.msg_controllen = 0;
+      continue;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      perror("client: send error");
+      res = FAIL;
+      break;
+    }
+    poll(&pfd, 1, -1);
+    if (pfd.revents & POLLIN) {
+      sending = 1;
+      tfsPoll();
+      sending = 0;
+    }
   }
+  pthread_mutex_unlock(&send_lock);
+
+  pthread_mutex_lock(&state_lock);
+  runDeferred(0);
+  pthread_mutex_unlock(&state_lock);
   return res;
 }
 
-/** 
- * Sends a command corresponding to a lookup operation for the server to
- execute and receives its output.
+/*
+ * Applies a batch as one text command per operation, for servers
+ * spoken to in text. Called with send_lock held.
  * Input:
- * - path: the file/directory to look for
- * Returns: SUCCESS or FAIL
+ * - dir: the directory of the batch
+ * - payload: its tfs_batch_op entries and names
+ * - len: size of payload
+ * - results: filled with the result of each operation
+ * Returns: SUCCESS
  */
-int tfsLookup(char *path) {
-  int res, i;
-  char command[MAX_INPUT_SIZE];
+static int sendTextBatch(char *dir, char *payload, size_t len, int *results) {
+  tfs_batch_op op;
+  char name[MAX_FILE_NAME], path[MAX_INPUT_SIZE];
+  char type[2] = { 0, '\0' };
 
-  /* "reconstructing" the original command */
-  command[0] = 'l';
-  command[1] = ' ';
-  for (i = 0; i < strlen(path); i++) {
-    command[i+2] = path[i];
+  for (size_t off = 0; off < len; off += op.len, results++) {
+    memcpy(&op, payload + off, sizeof(op));
+    off += sizeof(op);
+    memcpy(name, payload + off, op.len);
+    name[op.len] = '\0';
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path)) {
+      *results = TECNICOFS_ERROR_OTHER;
+      continue;
+    }
+
+    type[0] = op.flags & TFS_FLAG_DIRECTORY ? 'd' : 'f';
+    *results = sendText(op.opcode, path, op.opcode == TFS_OP_CREATE ? type : NULL);
+    if (*results == FAIL)
+      *results = TECNICOFS_ERROR_OTHER;
   }
-  command[i+2] = '\0';
+  return SUCCESS;
+}
 
-  /* send the command to the server, to be executed */
-  if (sendto(sockfd, command, strlen(command) + 1, 0,(struct sockaddr *)&serv_addr, servlen) < 0) {
-    perror("client: sendto error");
-    return -1;
+/*
+ * Submits a request without waiting for its response.
+ * Input:
+ * - a: what the request carries
+ * - cb: called with the result once it arrives, or NULL to use tfsWait
+ * - arg: passed to cb
+ * Returns: the ticket of the request, or one of TECNICOFS_ERROR_*
+ */
+static int submitRequest(request_args *a, tfs_callback cb, void *arg) {
+  char msg[TFS_MAX_MESSAGE];
+  tfs_request req;
+  int ticket, res;
+
+  if (a->len1 >= MAX_FILE_NAME || sizeof(req) + a->len1 + a->len2 > sizeof(msg))
+    return TECNICOFS_ERROR_OTHER;
+
+  /* descriptors don't go through shared memory */
+  if (shm && a->opcode == TFS_OP_DUMP)
+    return TECNICOFS_ERROR_OTHER;
+
+  /* the text commands have no open files, nor dumps, and print plain */
+  if (textProtocol && (a->opcode == TFS_OP_OPEN || a->opcode == TFS_OP_CLOSE ||
+                       a->opcode == TFS_OP_READ || a->opcode == TFS_OP_WRITE ||
+                       a->opcode == TFS_OP_DUMP || (a->opcode == TFS_OP_PRINT && a->flags)))
+    return TECNICOFS_ERROR_OTHER;
+
+  pthread_mutex_lock(&state_lock);
+  ticket = allocTicket(a, cb, arg);
+  pthread_mutex_unlock(&state_lock);
+  if (ticket < 0)
+    return ticket;
+
+  /* text commands carry no id: answer them right away, one at a time */
+  if (textProtocol) {
+    char type[2] = { a->flags & TFS_FLAG_DIRECTORY ? 'd' : 'f', '\0' };
+    pthread_mutex_lock(&send_lock);
+    if (a->opcode == TFS_OP_BATCH)
+      res = sendTextBatch(a->arg1, a->arg2, a->len2, a->data);
+    else
+      res = sendText(a->opcode, a->arg1, a->opcode == TFS_OP_CREATE ? type : a->arg2);
+    pthread_mutex_unlock(&send_lock);
+    pthread_mutex_lock(&state_lock);
+    completeRequest(&pending[ticket % TFS_MAX_PENDING], res);
+    pthread_cond_broadcast(&state_cond);
+    runDeferred(0);
+    pthread_mutex_unlock(&state_lock);
+    return ticket;
   }
 
-  /* receive the response from the server, after it has executed the command */
-  if (recvfrom(sockfd, &res, sizeof(res), 0,0,0) < 0) {
-    perror("client: recvfrom error");
-    return -1;
+  req.magic = TFS_PROTO_MAGIC;
+  req.version = TFS_PROTO_VERSION;
+  req.opcode = a->opcode;
+  req.flags = a->flags;
+  req.req_id = ticket;
+  req.len1 = a->len1;
+  req.len2 = a->len2;
+  memcpy(msg, &req, sizeof(req));
+  memcpy(msg + sizeof(req), a->arg1, a->len1);
+  memcpy(msg + sizeof(req) + a->len1, a->arg2, a->len2);
+
+  if (shm)
+    res = ringSend(msg, sizeof(req) + a->len1 + a->len2);
+  else
+    res = sendMessage(msg, sizeof(req) + a->len1 + a->len2, a->fd);
+  if (res == FAIL) {
+    pthread_mutex_lock(&state_lock);
+    completeRequest(&pending[ticket % TFS_MAX_PENDING], TECNICOFS_ERROR_CONNECTION_ERROR);
+    pthread_cond_broadcast(&state_cond);
+    runDeferred(0);
+    pthread_mutex_unlock(&state_lock);
+  }
+  return ticket;
+}
+
+/*
+ * Completes the requests whose responses have already arrived, without
+ * blocking.
+ * Returns: number of requests completed
+ */
+int tfsPoll() {
+  int completed;
+
+  pthread_mutex_lock(&state_lock);
+  completed = sockfd >= 0 ? receiveResponses(0) : 0;
+  pthread_mutex_unlock(&state_lock);
+  return completed;
+}
+
+/*
+ * Waits for a request submitted without a callback.
+ * Input:
+ * - ticket: what the submission returned
+ * Returns: the result of the request, or one of TECNICOFS_ERROR_*
+ */
+int tfsWait(int ticket) {
+  pending_req *p;
+  int res;
+
+  if (ticket < 0)
+    return ticket;
+
+  pthread_mutex_lock(&state_lock);
+  p = &pending[ticket % TFS_MAX_PENDING];
+  if (p->ticket != ticket || p->cb) {
+    pthread_mutex_unlock(&state_lock);
+    return TECNICOFS_ERROR_OTHER;
   }
+  while (!p->done)
+    receiveResponses(1);
+  res = p->result;
+  p->ticket = 0;
+  n_used--;
+  pthread_mutex_unlock(&state_lock);
   return res;
 }
 
+/*
+ * Waits until every submitted request has completed.
+ */
+void tfsWaitAll() {
+  pthread_mutex_lock(&state_lock);
+  while (n_outstanding > 0)
+    receiveResponses(1);
+  runDeferred(0);
+  pthread_mutex_unlock(&state_lock);
+}
+
+/*
+ * Submits a request on paths.
+ */
+static int submitPaths(uint8_t opcode, uint8_t flags, char *path1, char *path2, tfs_callback cb, void *arg) {
+  request_args a = { opcode, flags, path1, strlen(path1), path2, path2 ? strlen(path2) : 0, NULL, 0, -1 };
+
+  if (a.len2 >= MAX_FILE_NAME)
+    return TECNICOFS_ERROR_OTHER;
+  return submitRequest(&a, cb, arg);
+}
+
+/*
+ * Submits a request on an open file.
+ * Input:
+ * - opcode: TFS_OP_CLOSE, TFS_OP_READ or TFS_OP_WRITE
+ * - fd: the file descriptor
+ * - offset: where to read or write, or TFS_OFFSET_CURRENT
+ * - buf: the data of a write, or where a read's data goes
+ * - count: bytes to read or write, at most TFS_MAX_IO
+ */
+static int submitIo(uint8_t opcode, int fd, long offset, char *buf, int count, tfs_callback cb, void *arg) {
+  tfs_io io = { fd, count, offset };
+  request_args a = { opcode, 0, (char *) &io, sizeof(io), NULL, 0, NULL, 0, -1 };
+
+  if (opcode == TFS_OP_WRITE) {
+    a.arg2 = buf;
+    a.len2 = count;
+  } else if (opcode == TFS_OP_READ) {
+    a.data = buf;
+    a.data_cap = count;
+  }
+  return submitRequest(&a, cb, arg);
+}
+
+int tfsCreateAsync(char *filename, char nodeType, tfs_callback cb, void *arg) {
+  return submitPaths(TFS_OP_CREATE, nodeType == 'd' ? TFS_FLAG_DIRECTORY : 0, filename, NULL, cb, arg);
+}
+
+int tfsDeleteAsync(char *path, tfs_callback cb, void *arg) {
+  return submitPaths(TFS_OP_DELETE, 0, path, NULL, cb, arg);
+}
+
+int tfsMoveAsync(char *from, char *to, tfs_callback cb, void *arg) {
+  return submitPaths(TFS_OP_MOVE, 0, from, to, cb, arg);
+}
+
+int tfsLookupAsync(char *path, tfs_callback cb, void *arg) {
+  return submitPaths(TFS_OP_LOOKUP, 0, path, NULL, cb, arg);
+}
+
+/*
+ * format is one of TFS_PRINT_*.
+ */
+int tfsPrintAsync(char *outputfile, int format, tfs_callback cb, void *arg) {
+  return submitPaths(TFS_OP_PRINT, format, outputfile, NULL, cb, arg);
+}
+
+/*
+ * The result of a dump is a descriptor of a sealed memory file holding
+ * the output of print, which the caller owns.
+ */
+int tfsDumpAsync(int format, tfs_callback cb, void *arg) {
+  request_args a = { TFS_OP_DUMP, format, "", 0, NULL, 0, NULL, 0, -1 };
+
+  return submitRequest(&a, cb, arg);
+}
+
+int tfsOpenAsync(char *filename, permission mode, tfs_callback cb, void *arg) {
+  return submitPaths(TFS_OP_OPEN, mode, filename, NULL, cb, arg);
+}
+
+int tfsCloseAsync(int fd, tfs_callback cb, void *arg) {
+  return submitIo(TFS_OP_CLOSE, fd, 0, NULL, 0, cb, arg);
+}
+
+/*
+ * Reads or writes up to TFS_MAX_IO bytes per request. buffer must stay
+ * valid until the request completes.
+ */
+int tfsReadAsync(int fd, char *buffer, int len, long offset, tfs_callback cb, void *arg) {
+  if (len < 0 || len > TFS_MAX_IO)
+    return TECNICOFS_ERROR_OTHER;
+  return submitIo(TFS_OP_READ, fd, offset, buffer, len, cb, arg);
+}
+
+int tfsWriteAsync(int fd, char *buffer, int len, long offset, tfs_callback cb, void *arg) {
+  if (len < 0 || len > TFS_MAX_IO)
+    return TECNICOFS_ERROR_OTHER;
+  return submitIo(TFS_OP_WRITE, fd, offset, buffer, len, cb, arg);
+}
+
+/** 
+ * Opens a file.
+ * Input:
+ * - filename: path of the file
+ * - mode: READ, WRITE or RW
+ * Returns: the file descriptor or an error
+ */
+int tfsOpen(char *filename, permission mode) {
+  return tfsWait(tfsOpenAsync(filename, mode, NULL, NULL));
+}
+
+/** 
+ * Closes a file.
+ * Input:
+ * - fd: the file descriptor
+ * Returns: SUCCESS or an error
+ */
+int tfsClose(int fd) {
+  return tfsWait(tfsCloseAsync(fd, NULL, NULL));
+}
+
+/*
+ * Reads or writes any number of bytes, TFS_MAX_IO per request.
+ * Returns: the bytes moved, or an error if nothing was
+ */
+static int transfer(int write, int fd, char *buffer, int len, long offset) {
+  int done = 0, res = 0;
+
+  while (done < len) {
+    int count = len - done < TFS_MAX_IO ? len - done : TFS_MAX_IO;
+    long at = offset == TFS_OFFSET_CURRENT ? offset : offset + done;
+
+    if (write)
+      res = tfsWait(tfsWriteAsync(fd, buffer + done, count, at, NULL, NULL));
+    else
+      res = tfsWait(tfsReadAsync(fd, buffer + done, count, at, NULL, NULL));
+    if (res < 0)
+      return done > 0 ? done : res;
+    done += res;
+    if (res < count) /* end of file */
+      break;
+  }
+  return done;
+}
+
+/** 
+ * Reads from an open file, at its offset, which advances.
+ * Input:
+ * - fd: the file descriptor
+ * - buffer: where to put the data
+ * - len: most bytes to read
+ * Returns: the bytes read (0 at the end of the file) or an error
+ */
+int tfsRead(int fd, char *buffer, int len) {
+  return transfer(0, fd, buffer, len, TFS_OFFSET_CURRENT);
+}
+
+/** 
+ * Writes to an open file, at its offset, which advances.
+ * Input:
+ * - fd: the file descriptor
+ * - buffer: the data
+ * - len: bytes to write
+ * Returns: the bytes written or an error
+ */
+int tfsWrite(int fd, char *buffer, int len) {
+  return transfer(1, fd, buffer, len, TFS_OFFSET_CURRENT);
+}
+
+/** 
+ * Reads from an open file at a given offset, leaving its offset alone.
+ * Returns: the bytes read or an error
+ */
+int tfsPread(int fd, char *buffer, int len, long offset) {
+  return offset < 0 ? TECNICOFS_ERROR_OTHER : transfer(0, fd, buffer, len, offset);
+}
+
+/** 
+ * Writes to an open file at a given offset, leaving its offset alone.
+ * Returns: the bytes written or an error
+ */
+int tfsPwrite(int fd, char *buffer, int len, long offset) {
+  return offset < 0 ? TECNICOFS_ERROR_OTHER : transfer(1, fd, buffer, len, offset);
+}
+
+/*
+ * Starts an empty batch of operations on children of a directory.
+ * Input:
+ * - b: the batch
+ * - dir: path of the directory ("" or "/" for the root)
+ * Returns: SUCCESS or FAIL if the path is too long
+ */
+int tfsBatchInit(tfs_batch *b, char *dir) {
+  if (strlen(dir) >= MAX_FILE_NAME)
+    return FAIL;
+  /* the server takes no empty paths */
+  strcpy(b->dir, dir[0] ? dir : "/");
+  b->n = 0;
+  b->len = 0;
+  return SUCCESS;
+}
+
+/*
+ * Adds an operation to a batch.
+ * Input:
+ * - b: the batch
+ * - op: 'c' (create), 'd' (delete) or 'l' (lookup)
+ * - name: name of the child, without slashes
+ * - nodeType: 'f' or 'd', for creates
+ * Returns: the index of the operation's result in b->results, or FAIL
+ *  if the batch is full
+ */
+int tfsBatchAdd(tfs_batch *b, char op, char *name, char nodeType) {
+  tfs_batch_op entry = { op, nodeType == 'd' ? TFS_FLAG_DIRECTORY : 0, strlen(name) };
+
+  if (b->n == TFS_MAX_BATCH || entry.len >= MAX_FILE_NAME ||
+      (op != TFS_OP_CREATE && op != TFS_OP_DELETE && op != TFS_OP_LOOKUP))
+    return FAIL;
+
+  memcpy(b->payload + b->len, &entry, sizeof(entry));
+  memcpy(b->payload + b->len + sizeof(entry), name, entry.len);
+  b->len += sizeof(entry) + entry.len;
+  return b->n++;
+}
+
+/*
+ * Submits a batch. Once it completes, b->results holds the result of
+ * each operation and the batch itself completes with SUCCESS, or with an
+ * error if the directory could not be used.
+ * Returns: the ticket of the request, or one of TECNICOFS_ERROR_*
+ */
+int tfsBatchAsync(tfs_batch *b, tfs_callback cb, void *arg) {
+  request_args a = { TFS_OP_BATCH, 0, b->dir, strlen(b->dir), b->payload, b->len, b->results, sizeof(b->results), -1 };
+
+  return submitRequest(&a, cb, arg);
+}
+
+/*
+ * Applies a batch and waits for it.
+ * Returns: SUCCESS or an error
+ */
+int tfsBatch(tfs_batch *b) {
+  return tfsWait(tfsBatchAsync(b, NULL, NULL));
+}
+
+/** 
+ * Asks the server to create a file or directory.
+ * Input:
+ * - filename: the file/directory to be created
+ * - nodeType: either a file or a directory
+ * Returns: SUCCESS or an error
+ */
+int tfsCreate(char *filename, char nodeType) {
+  return tfsWait(tfsCreateAsync(filename, nodeType, NULL, NULL));
+}
+
+/** 
+ * Asks the server to delete a file or directory.
+ * Input:
+ * - path: the file/directory to be deleted
+ * Returns: SUCCESS or an error
+ */
+int tfsDelete(char *path) {
+  return tfsWait(tfsDeleteAsync(path, NULL, NULL));
+}
+
 /** 
- * Sends a command corresponding to a print operation for the server to
- execute and receives its output.
+ * Asks the server to move a file or directory.
+ * Input:
+ * - from: the file/directory to be moved
+ * - to: where it is going to be now 
+ * Returns: SUCCESS or an error
+ */
+int tfsMove(char *from, char *to) {
+  return tfsWait(tfsMoveAsync(from, to, NULL, NULL));
+}
+
+/** 
+ * Asks the server to look for a path.
+ * Input:
+ * - path: the file/directory to look for
+ * Returns: its i-number or an error
+ */
+int tfsLookup(char *path) {
+  return tfsWait(tfsLookupAsync(path, NULL, NULL));
+}
+
+/** 
+ * Asks the server to print its tree to a file.
  * Input:
  * - outputfile: the path for the file we're writing on
- * Returns: SUCCESS or FAIL
+ * Returns: SUCCESS or an error
  */
 int tfsPrint(char *outputfile) {
-  int res, i;
-  char command[MAX_INPUT_SIZE];
+  return tfsWait(tfsPrintAsync(outputfile, TFS_PRINT_PLAIN, NULL, NULL));
+}
+
+/** 
+ * Asks the server to print its tree to a file, in a given format.
+ * Input:
+ * - outputfile: the path for the file we're writing on
+ * - format: one of TFS_PRINT_*
+ * Returns: SUCCESS or an error
+ */
+int tfsPrintFormat(char *outputfile, int format) {
+  return tfsWait(tfsPrintAsync(outputfile, format, NULL, NULL));
+}
+
+/** 
+ * Gets the FS state, as print writes it, without the server writing
+ * any file: it comes back as a sealed memory file.
+ * Input:
+ * - format: one of TFS_PRINT_*
+ * Returns: the descriptor of the memory file, to be closed by the
+ *  caller, or an error
+ */
+int tfsDump(int format) {
+  return tfsWait(tfsDumpAsync(format, NULL, NULL));
+}
+
+/** 
+ * Gets the FS state, as print writes it, mapped into memory.
+ * Input:
+ * - format: one of TFS_PRINT_*
+ * - size: set to the size of the dump
+ * Returns: the dump, to be released with munmap, or NULL
+ */
+char *tfsDumpMap(int format, size_t *size) {
+  struct stat st;
+  char *map = NULL;
+  int fd = tfsDump(format);
 
-  /* "reconstructing" the original command */
-  command[0] = 'p';
-  command[1] = ' ';
-  for (i = 0; i < strlen(outputfile); i++) {
-    command[i+2] = outputfile[i];
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+      map = NULL;
+    *size = st.st_size;
   }
-  command[i+2] = '\0';
+  close(fd);
+  return map;
+}
 
-  /* send the command to the server, to be executed */
-  if (sendto(sockfd, command, strlen(command) + 1, 0,(struct sockaddr *)&serv_addr, servlen) < 0) {
-    perror("client: sendto error");
-    return -1;
+/*
+ * Offers the server shared-memory rings for the session. If it takes
+ * them, requests and responses go through the rings from then on;
+ * otherwise the session keeps using the socket.
+ * Returns: SUCCESS if the rings are in use, or FAIL
+ */
+static int attachShm() {
+  tfs_shm *rings;
+  request_args a = { TFS_OP_ATTACH, 0, "", 0, NULL, 0, NULL, 0, -1 };
+  int res;
+
+  if ((a.fd = memfd_create("tecnicofs-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+    return FAIL;
+  /* sealed at its size, so the server's mapping can't lose its pages */
+  if (ftruncate(a.fd, sizeof(tfs_shm)) < 0 ||
+      fcntl(a.fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 ||
+      (rings = mmap(NULL, sizeof(tfs_shm), PROT_READ | PROT_WRITE, MAP_SHARED, a.fd, 0)) == MAP_FAILED) {
+    close(a.fd);
+    return FAIL;
   }
+  rings->client_pid = getpid();
+  shm_spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPINS : 0;
 
-  /* receive the response from the server, after it has executed the command */
-  if (recvfrom(sockfd, &res, sizeof(res), 0,0,0) < 0) {
-    perror("client: recvfrom error");
-    return -1;
+  res = tfsWait(submitRequest(&a, NULL, NULL));
+  close(a.fd); /* the mapping stays */
+  if (res != SUCCESS) {
+    munmap(rings, sizeof(tfs_shm));
+    return FAIL;
   }
-  return res;
+
+  pthread_mutex_lock(&state_lock);
+  shm = rings;
+  pthread_mutex_unlock(&state_lock);
+  return SUCCESS;
 }
 
 /** 
  * Assemble client socket and connect it to server socket
  * Input:
  * - sockPath: the path for the server socket
+ * - flags: TFS_MOUNT_* options of the session
  * Returns: SUCCESS or FAIL
  */
-int tfsMount(char * sockPath) {
-  
-  /* init unix datagram socket */
-  if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+int tfsMount(char * sockPath, int flags) {
+  int type = SOCK_DGRAM;
+
+  if (sockfd >= 0)
+    return TECNICOFS_ERROR_OPEN_SESSION;
+
+  textProtocol = flags & TFS_MOUNT_TEXT;
+  if (flags & TFS_MOUNT_STREAM)
+    type = SOCK_STREAM;
+  else if (flags & TFS_MOUNT_SEQPACKET)
+    type = SOCK_SEQPACKET;
+
+  /* init unix socket */
+  if ((sockfd = socket(AF_UNIX, type, 0)) < 0) {
     perror("client: can't open socket");
     return FAIL;
   }
   
-  /* give it its name */
-  unlink(client_name);
-  clilen = setSockAddrUn(client_name, &client_addr);
-  if (bind(sockfd, (struct sockaddr *)&client_addr, clilen) < 0) {
-    perror("client: bind error");
-    return FAIL;
+  /* datagram replies need a name to be sent to; connections don't */
+  if (type == SOCK_DGRAM) {
+    unlink(client_name);
+    clilen = setSockAddrUn(client_name, &client_addr);
+    if (bind(sockfd, (struct sockaddr *)&client_addr, clilen) < 0) {
+      perror("client: bind error");
+      tfsUnmount();
+      return FAIL;
+    }
+    bound = 1;
+    if (chmod(client_name, 00222) == -1) {
+      perror("client: can't change permissions of socket");
+      tfsUnmount();
+      return FAIL;
+    } 
   }
-  if (chmod(client_name, 00222) == -1) {
-    perror("client: can't change permissions of socket");
-    return FAIL;
-  } 
 
   /* know who the server is (associate name with the server socket) */
   servlen = setSockAddrUn(sockPath, &serv_addr);
+  if (connect(sockfd, (struct sockaddr *)&serv_addr, servlen) < 0) {
+    perror("client: connect error");
+    tfsUnmount();
+    return FAIL;
+  }
+  connected = 1;
+
+  if ((flags & TFS_MOUNT_SHM) && !textProtocol)
+    attachShm();
   return SUCCESS;
 }
 
 /** 
- * Disassembles the client socket.
+ * Disassembles the client socket. The server closes the files the
+ * session left open.
  */
 int tfsUnmount() {
+  request_args a = { TFS_OP_UNMOUNT, 0, "", 0, NULL, 0, NULL, 0, -1 };
+
+  /* after everything else, as datagrams may be applied out of order */
+  if (connected && !textProtocol) {
+    tfsWaitAll();
+    tfsWait(submitRequest(&a, NULL, NULL));
+  }
+  connected = 0;
+
+  pthread_mutex_lock(&state_lock);
+  if (shm) {
+    /* the server's thread sees this and lets go of the rings */
+    __atomic_store_n(&shm->closed, 1, __ATOMIC_SEQ_CST);
+    futex(&shm->requests.head, FUTEX_WAKE, 1, NULL);
+    munmap(shm, sizeof(tfs_shm));
+    shm = NULL;
+    ring_inflight = 0;
+  }
   close(sockfd);
-  unlink(client_name);
+  sockfd = -1;
+  memset(pending, 0, sizeof(pending));
+  n_outstanding = 0;
+  n_used = 0;
+  n_deferred = 0;
+  rlen = 0;
+  while (fdq_len > 0)
+    close(dequeueFd());
+  pthread_mutex_unlock(&state_lock);
+  if (bound)
+    unlink(client_name);
+  bound = 0;
   return 0;
 }
 
@@ -234,7 +1122,7 @@ void setClientName() {
 
   /* associating a standard name with the process id allows for multiple clients */
   for (int i = strlen(CLIESOCKET); i < MAX_INPUT_SIZE && pid > 0; i++) {
-    client_name[i] = pid % 10;
+    client_name[i] = '0' + pid % 10;
     pid = pid / 10;
   }
 }
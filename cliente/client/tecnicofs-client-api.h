@@ -12,13 +12,68 @@
 #define FAIL -1
 
 
+/* requests that may be outstanding at once */
+#define TFS_MAX_PENDING 1024
+
+/*
+ * Called once the response of an asynchronous request arrives, from
+ * whichever thread received it, with no library lock held: it may
+ * submit more requests.
+ */
+typedef void (*tfs_callback)(int ticket, int result, void *arg);
+
+/*
+ * Asynchronous requests return a ticket (or a TECNICOFS_ERROR_* code).
+ * Without a callback, the result is collected with tfsWait(ticket).
+ */
+int tfsCreateAsync(char *path, char nodeType, tfs_callback cb, void *arg);
+int tfsDeleteAsync(char *path, tfs_callback cb, void *arg);
+int tfsLookupAsync(char *path, tfs_callback cb, void *arg);
+int tfsMoveAsync(char *from, char *to, tfs_callback cb, void *arg);
+int tfsPrintAsync(char *outputfile, int format, tfs_callback cb, void *arg);
+int tfsDumpAsync(int format, tfs_callback cb, void *arg);
+int tfsOpenAsync(char *filename, permission mode, tfs_callback cb, void *arg);
+int tfsCloseAsync(int fd, tfs_callback cb, void *arg);
+int tfsReadAsync(int fd, char *buffer, int len, long offset, tfs_callback cb, void *arg);
+int tfsWriteAsync(int fd, char *buffer, int len, long offset, tfs_callback cb, void *arg);
+
+/*
+ * A batch of create/delete/lookup operations on children of one
+ * directory, applied by the server in one request.
+ */
+typedef struct tfs_batch {
+  char dir[MAX_FILE_NAME];
+  int n;       /* operations added */
+  size_t len;  /* bytes of payload used */
+  char payload[TFS_MAX_BATCH_PAYLOAD];
+  int results[TFS_MAX_BATCH]; /* SUCCESS, an i-number or an error, per operation */
+} tfs_batch;
+
+int tfsBatchInit(tfs_batch *b, char *dir);
+int tfsBatchAdd(tfs_batch *b, char op, char *name, char nodeType);
+int tfsBatchAsync(tfs_batch *b, tfs_callback cb, void *arg);
+int tfsBatch(tfs_batch *b);
+
+int tfsPoll();
+int tfsWait(int ticket);
+void tfsWaitAll();
+
 int tfsCreate(char *path, char nodeType);
 int tfsDelete(char *path);
 int tfsLookup(char *path);
 int tfsMove(char *from, char *to);
 int tfsPrint(char *outputfile);
+int tfsPrintFormat(char *outputfile, int format);
+int tfsDump(int format);
+char *tfsDumpMap(int format, size_t *size);
+int tfsOpen(char *filename, permission mode);
+int tfsClose(int fd);
+int tfsRead(int fd, char *buffer, int len);
+int tfsWrite(int fd, char *buffer, int len);
+int tfsPread(int fd, char *buffer, int len, long offset);
+int tfsPwrite(int fd, char *buffer, int len, long offset);
 
-int tfsMount(char* serverName);
+int tfsMount(char* serverName, int flags);
 int tfsUnmount();
 
 void setClientName();
@@ -1,26 +1,71 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include "tecnicofs-client-api.h"
 #include "../tecnicofs-api-constants.h"
 
 FILE* inputFile;
 char* serverName;
+int mountFlags = 0;
+int printLocally = 0; /* whether print writes the dump here instead of on the server */
+int printFormat = TFS_PRINT_PLAIN; /* output format of print (-f) */
 
 
 static void displayUsage (const char* appName) {
-    printf("Usage: %s inputfile server_socket_name\n", appName);
+    printf("Usage: %s inputfile server_socket_name [-p text|binary] [-s dgram|stream|seqpacket] [-d] [-m] [-f plain|json|manifest]\n", appName);
     exit(EXIT_FAILURE);
 }
 
 static void parseArgs (long argc, char* const argv[]) {
-    if (argc != 3) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:s:dmf:")) != -1) {
+        switch (opt) {
+            case 'p':
+                if (!strcmp(optarg, "text"))
+                    mountFlags |= TFS_MOUNT_TEXT;
+                else if (strcmp(optarg, "binary"))
+                    displayUsage(argv[0]);
+                break;
+            case 'd':
+                printLocally = 1;
+                break;
+            case 'f':
+                if (!strcmp(optarg, "plain"))
+                    printFormat = TFS_PRINT_PLAIN;
+                else if (!strcmp(optarg, "json"))
+                    printFormat = TFS_PRINT_JSON;
+                else if (!strcmp(optarg, "manifest"))
+                    printFormat = TFS_PRINT_MANIFEST;
+                else
+                    displayUsage(argv[0]);
+                break;
+            case 'm':
+                mountFlags |= TFS_MOUNT_SHM;
+                break;
+            case 's':
+                if (!strcmp(optarg, "stream"))
+                    mountFlags |= TFS_MOUNT_STREAM;
+                else if (!strcmp(optarg, "seqpacket"))
+                    mountFlags |= TFS_MOUNT_SEQPACKET;
+                else if (strcmp(optarg, "dgram"))
+                    displayUsage(argv[0]);
+                break;
+            default:
+                displayUsage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2) {
         fprintf(stderr, "Invalid format:\n");
         displayUsage(argv[0]);
     }
+    argv += optind - 1;
 
     serverName = argv[2];
 
@@ -37,6 +82,29 @@ void errorParse(){
     exit(EXIT_FAILURE);
 }
 
+/*
+ * Gets the FS state from the server and writes it to a local file.
+ * Returns: SUCCESS or FAIL
+ */
+int printDump(char *outputfile) {
+    size_t size = 0;
+    char *dump = tfsDumpMap(printFormat, &size);
+    FILE *f;
+    int res = SUCCESS;
+
+    if (!dump || !(f = fopen(outputfile, "w"))) {
+        if (dump)
+            munmap(dump, size);
+        return FAIL;
+    }
+    if (fwrite(dump, 1, size, f) != size)
+        res = FAIL;
+    if (fclose(f))
+        res = FAIL;
+    munmap(dump, size);
+    return res;
+}
+
 void *processInput() {
     char line[MAX_INPUT_SIZE];
 
@@ -106,7 +174,7 @@ void *processInput() {
             case 'p':
                 if(numTokens != 2)
                     errorParse();
-                res = tfsPrint(arg1);
+                res = printLocally ? printDump(arg1) : tfsPrintFormat(arg1, printFormat);
                 if (!res)
                     printf("Printed with success to %s\n", arg1);
                 else
@@ -128,7 +196,7 @@ int main(int argc, char* argv[]) {
 
     setClientName();
 
-    if (tfsMount(serverName) == SUCCESS)
+    if (tfsMount(serverName, mountFlags) == SUCCESS)
       printf("Mounted! (socket = %s)\n", serverName);
     else {
       fprintf(stderr, "Unable to mount socket: %s\n", serverName);
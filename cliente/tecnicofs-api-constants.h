@@ -2,6 +2,8 @@
 #ifndef TECNICOFS_API_CONSTANTS_H
 #define TECNICOFS_API_CONSTANTS_H
 
+#include <stdint.h>
+
 #define MAX_FILE_NAME 100
 #define MAX_INPUT_SIZE 100
 
@@ -32,4 +34,158 @@ typedef enum type { T_FILE, T_DIRECTORY, T_NONE } type;
 /* Generic error */
 #define TECNICOFS_ERROR_OTHER -11
 
+/*
+ * Binary wire protocol.
+ * A request is a tfs_request header followed by len1 bytes of the first
+ * path and len2 bytes of the second one (move only), without terminators.
+ * The server answers with a tfs_response carrying the same req_id.
+ * Text commands ("c a f") are still accepted: the server tells them apart
+ * by the first byte, which is never TFS_PROTO_MAGIC in a text command.
+ */
+#define TFS_PROTO_MAGIC 0xF5
+#define TFS_PROTO_VERSION 1
+
+/* opcodes, the same letters used by the text commands */
+#define TFS_OP_CREATE 'c'
+#define TFS_OP_DELETE 'd'
+#define TFS_OP_LOOKUP 'l'
+#define TFS_OP_MOVE 'm'
+#define TFS_OP_PRINT 'p'
+#define TFS_OP_BATCH 'b'
+#define TFS_OP_OPEN 'o'
+#define TFS_OP_CLOSE 'x'
+#define TFS_OP_READ 'r'
+#define TFS_OP_WRITE 'w'
+/* print into a sealed memfd, passed back with SCM_RIGHTS (no text form) */
+#define TFS_OP_DUMP 'D'
+/* the client is done: the server closes the files it left open (no text form) */
+#define TFS_OP_UNMOUNT 'U'
+
+/* request flags: node type of a create */
+#define TFS_FLAG_DIRECTORY 0x01
+
+/* request flags of a print or dump: the output format */
+#define TFS_PRINT_PLAIN 0     /* a path per line (the only one in text) */
+#define TFS_PRINT_JSON 1      /* nested {"name", "type", "children"} objects */
+#define TFS_PRINT_MANIFEST 2  /* binary, see tfs_manifest_entry */
+
+/*
+ * A binary manifest is a tfs_manifest_header, then an entry per node in
+ * preorder (the root first, at depth 0), each followed by name_len bytes
+ * of its name; an entry with nodeType T_NONE ends it.
+ */
+#define TFS_MANIFEST_MAGIC 0x4D534654  /* "TFSM" */
+#define TFS_MANIFEST_VERSION 1
+
+typedef struct tfs_manifest_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+} tfs_manifest_header;
+
+typedef struct tfs_manifest_entry {
+    uint8_t nodeType;
+    uint8_t reserved;
+    uint16_t name_len;
+    uint32_t depth;
+} tfs_manifest_entry;
+
+typedef struct tfs_request {
+    uint8_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint8_t flags;
+    uint32_t req_id;
+    uint16_t len1;
+    uint16_t len2;
+} tfs_request;
+
+typedef struct tfs_response {
+    uint8_t magic;
+    uint8_t version;
+    uint16_t data_len;  /* bytes following the header */
+    uint32_t req_id;
+    int32_t result;   /* what the operation returned */
+    int32_t error;    /* 0 or one of TECNICOFS_ERROR_* */
+} tfs_response;
+
+/* largest request: header plus two paths */
+#define TFS_MAX_REQUEST (sizeof(tfs_request) + 2 * MAX_FILE_NAME)
+
+/*
+ * Reads, writes and closes name an open file with a tfs_io as their first
+ * argument (len1 == sizeof(tfs_io)); a write's data is the second one.
+ * Opens carry the path and the permission wanted in flags. A read's
+ * data follows its response.
+ */
+typedef struct tfs_io {
+    int32_t fd;
+    int32_t count;
+    int64_t offset;  /* or TFS_OFFSET_CURRENT */
+} tfs_io;
+
+/* offset of reads and writes that use and advance the open file's offset */
+#define TFS_OFFSET_CURRENT -1
+/* most bytes one read or write request moves */
+#define TFS_MAX_IO 4096
+
+/*
+ * A batch applies several create/delete/lookup operations to children of
+ * one directory, which the server resolves only once. The len1 bytes of
+ * the directory's path are followed by len2 bytes of operations, each a
+ * tfs_batch_op followed by len bytes of the child's name. The response
+ * carries one result per operation.
+ */
+typedef struct tfs_batch_op {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t len;
+} tfs_batch_op;
+
+#define TFS_MAX_BATCH 64
+#define TFS_MAX_BATCH_PAYLOAD (TFS_MAX_BATCH * (sizeof(tfs_batch_op) + MAX_FILE_NAME))
+
+/* largest message in either direction */
+#define TFS_MAX_MESSAGE (sizeof(tfs_request) + MAX_FILE_NAME + TFS_MAX_BATCH_PAYLOAD)
+#define TFS_MAX_RESPONSE (sizeof(tfs_response) + TFS_MAX_IO)
+
+/* client mount flags */
+#define TFS_MOUNT_TEXT 0x01 /* talk to the server in the old text format */
+#define TFS_MOUNT_STREAM 0x02 /* one SOCK_STREAM connection per session */
+#define TFS_MOUNT_SEQPACKET 0x04 /* one SOCK_SEQPACKET connection per session */
+#define TFS_MOUNT_SHM 0x08 /* requests and responses through shared-memory rings */
+
+/*
+ * Shared-memory transport. The client creates a tfs_shm in a memfd and
+ * passes it with a TFS_OP_ATTACH request (SCM_RIGHTS); from then on its
+ * requests and responses go through the two rings instead of the socket.
+ * Each ring has one producer and one consumer, which own head and tail
+ * respectively. A consumer that finds its ring empty sets waiting and
+ * sleeps in a futex on head, which the producer wakes after publishing.
+ */
+#define TFS_OP_ATTACH 'A'
+
+#define TFS_RING_SLOTS 32 /* a power of two */
+#define TFS_RING_SLOT_SIZE (TFS_MAX_MESSAGE > TFS_MAX_RESPONSE ? TFS_MAX_MESSAGE : TFS_MAX_RESPONSE)
+
+typedef struct tfs_ring_slot {
+    uint32_t len;
+    char data[TFS_RING_SLOT_SIZE];
+} tfs_ring_slot;
+
+typedef struct tfs_ring {
+    uint32_t head __attribute__((aligned(64)));  /* slots published */
+    uint32_t tail __attribute__((aligned(64)));  /* slots consumed */
+    uint32_t waiting;                            /* the consumer sleeps on head */
+    tfs_ring_slot slots[TFS_RING_SLOTS] __attribute__((aligned(64)));
+} tfs_ring;
+
+typedef struct tfs_shm {
+    uint32_t closed;      /* set by the client when it unmounts */
+    int32_t client_pid;   /* to notice a client that went away */
+    int32_t server_pid;   /* to notice a server that went away */
+    tfs_ring requests;    /* produced by the client */
+    tfs_ring responses;   /* produced by the server */
+} tfs_shm;
+
 #endif /* TECNICOFS_API_CONSTANTS_H */
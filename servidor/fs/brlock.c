@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include "brlock.h"
+#include "reclaim.h"
+#include "state.h"
+
+/* reader slots of every lock, one per online CPU */
+static int n_slots;
+static pthread_once_t slots_once = PTHREAD_ONCE_INIT;
+
+/* slot of the calling thread (assigned on first use) */
+static __thread int my_slot = -1;
+static int next_slot = 0;
+
+/* its address tells the calling thread apart as a writer */
+static __thread char me;
+
+
+/*
+ * Counts the online CPUs, once.
+ */
+static void count_slots() {
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	n_slots = (ncpu < 1) ? 1 : (ncpu > INODE_MAX_SHARDS) ? INODE_MAX_SHARDS : ncpu;
+}
+
+/*
+ * Returns the reader slot of the calling thread in a lock.
+ */
+static brlock_slot *slot_of(brlock *l) {
+	if (my_slot == -1)
+		my_slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % n_slots;
+	return &l->slots[my_slot];
+}
+
+
+/*
+ * Creates an unlocked big-reader lock.
+ * Input:
+ *  - reclaimable: whether it may be killed and retired. Such a lock is
+ *    then only reached inside a read section (see reclaim.h), which
+ *    every locking function ends
+ * Returns: the lock, or NULL if there is no memory for it
+ */
+brlock *brlock_create(int reclaimable) {
+	void *mem;
+	brlock *l;
+
+	pthread_once(&slots_once, count_slots);
+	if (posix_memalign(&mem, sizeof(brlock_slot), sizeof(brlock) + sizeof(brlock_slot) * n_slots))
+		return NULL;
+	l = mem;
+	l->writer = 0;
+	l->reclaimable = reclaimable;
+	l->dead = 0;
+	l->waiting = 0;
+	l->owner = NULL;
+	if (pthread_mutex_init(&l->writers, NULL)) {
+		free(l);
+		return NULL;
+	}
+	for (int i = 0; i < n_slots; i++) {
+		l->slots[i].readers = 0;
+		l->slots[i].pins = 0;
+	}
+	return l;
+}
+
+/*
+ * Destroys a lock nobody holds.
+ */
+void brlock_destroy(brlock *l) {
+	if (!l)
+		return;
+	pthread_mutex_destroy(&l->writers);
+	free(l);
+}
+
+
+/*
+ * Ends the caller's read section, for a lock that may be retired (see
+ * brlock_create).
+ */
+static void section_end(brlock *l) {
+	if (l->reclaimable)
+		reclaim_read_exit();
+}
+
+/*
+ * Counts the caller as waiting for the lock, before it blocks: a lock
+ * is only retired once nobody waits for it (see brlock_kill), so the
+ * read section can end then.
+ * Returns: SUCCESS, or FAIL if the lock was killed (not counted then)
+ */
+static int wait_begin(brlock *l) {
+	int dead;
+
+	/* pairs with the fence in brlock_kill: it waits for us, or we see it */
+	__atomic_add_fetch(&l->waiting, 1, __ATOMIC_SEQ_CST);
+	if ((dead = __atomic_load_n(&l->dead, __ATOMIC_SEQ_CST)))
+		__atomic_sub_fetch(&l->waiting, 1, __ATOMIC_RELEASE);
+	section_end(l);
+	return dead ? FAIL : SUCCESS;
+}
+
+/*
+ * Stops counting the caller as waiting for the lock.
+ */
+static void wait_end(brlock *l) {
+	__atomic_sub_fetch(&l->waiting, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Locks for reading: a single add to the thread's own slot, unless a
+ * writer holds the lock or waits for it.
+ * Returns: SUCCESS, or FAIL if the lock was killed meanwhile
+ */
+int brlock_read_lock(brlock *l) {
+	brlock_slot *s = slot_of(l);
+	int waiting = 0, dead;
+
+	for (;;) {
+		__atomic_add_fetch(&s->readers, 1, __ATOMIC_RELAXED);
+		/* pairs with the fence in brlock_write_lock: one of us sees the other */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&l->writer, __ATOMIC_ACQUIRE))
+			break;
+
+		/* back off, and wait for the writer to be done */
+		__atomic_sub_fetch(&s->readers, 1, __ATOMIC_RELEASE);
+		if (!waiting && wait_begin(l) == FAIL)
+			return FAIL;
+		waiting = 1;
+		pthread_mutex_lock(&l->writers);
+		dead = __atomic_load_n(&l->dead, __ATOMIC_ACQUIRE);
+		pthread_mutex_unlock(&l->writers);
+		if (dead) {
+			wait_end(l);
+			return FAIL;
+		}
+	}
+
+	if (waiting)
+		wait_end(l);
+	else
+		section_end(l);
+	return SUCCESS;
+}
+
+/*
+ * Tries to lock for reading.
+ * Returns: SUCCESS, or FAIL if a writer holds the lock or waits for it
+ */
+int brlock_read_trylock(brlock *l) {
+	brlock_slot *s = slot_of(l);
+
+	int res = SUCCESS;
+
+	__atomic_add_fetch(&s->readers, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&l->writer, __ATOMIC_ACQUIRE)) {
+		__atomic_sub_fetch(&s->readers, 1, __ATOMIC_RELEASE);
+		res = FAIL;
+	}
+	section_end(l);
+	return res;
+}
+
+/*
+ * Unlocks a lock held for reading.
+ */
+void brlock_read_unlock(brlock *l) {
+	__atomic_sub_fetch(&slot_of(l)->readers, 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Waits for the readers inside to leave. New ones are turned away.
+ * Input:
+ *  - l: the lock, with the writer flag raised
+ *  - wait: whether to wait or give up at once
+ * Returns: SUCCESS, or FAIL if it gave up
+ */
+static int drain_readers(brlock *l, int wait) {
+	/* pairs with the fence in brlock_read_lock */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (int i = 0; i < n_slots; i++) {
+		while (__atomic_load_n(&l->slots[i].readers, __ATOMIC_ACQUIRE)) {
+			if (!wait)
+				return FAIL;
+			sched_yield();
+		}
+	}
+	return SUCCESS;
+}
+
+/*
+ * Locks for writing: waits for the other writers, then for every
+ * reader slot to drain.
+ * Returns: SUCCESS, or FAIL if the lock was killed meanwhile
+ */
+int brlock_write_lock(brlock *l) {
+	if (wait_begin(l) == FAIL)
+		return FAIL;
+	pthread_mutex_lock(&l->writers);
+	if (__atomic_load_n(&l->dead, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_unlock(&l->writers);
+		wait_end(l);
+		return FAIL;
+	}
+	/* alive and held: nobody can kill it now */
+	wait_end(l);
+	__atomic_store_n(&l->writer, 1, __ATOMIC_RELAXED);
+	drain_readers(l, 1);
+	__atomic_store_n(&l->owner, &me, __ATOMIC_RELAXED);
+	return SUCCESS;
+}
+
+/*
+ * Tries to lock for writing.
+ * Returns: SUCCESS, or FAIL if the lock is held
+ */
+int brlock_write_trylock(brlock *l) {
+	if (pthread_mutex_trylock(&l->writers)) {
+		section_end(l);
+		return FAIL;
+	}
+	section_end(l);
+	if (__atomic_load_n(&l->dead, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_unlock(&l->writers);
+		return FAIL;
+	}
+	__atomic_store_n(&l->writer, 1, __ATOMIC_RELAXED);
+	if (drain_readers(l, 0) == FAIL) {
+		__atomic_store_n(&l->writer, 0, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&l->writers);
+		return FAIL;
+	}
+	__atomic_store_n(&l->owner, &me, __ATOMIC_RELAXED);
+	return SUCCESS;
+}
+
+/*
+ * Unlocks a lock held for writing, and lets the readers turned away in.
+ */
+void brlock_write_unlock(brlock *l) {
+	__atomic_store_n(&l->owner, NULL, __ATOMIC_RELAXED);
+	__atomic_store_n(&l->writer, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&l->writers);
+}
+
+/*
+ * Unlocks a lock held either way: only the writer holding it finds
+ * itself as the owner.
+ */
+void brlock_unlock(brlock *l) {
+	if (__atomic_load_n(&l->owner, __ATOMIC_RELAXED) == &me)
+		brlock_write_unlock(l);
+	else
+		brlock_read_unlock(l);
+}
+
+
+/*
+ * Kills a reclaimable lock held for writing, once its i-node uses
+ * another one. The writer flag stays up, so new readers are turned away
+ * too; whoever is turned away gets FAIL and must look for the i-node's
+ * lock again. Waits until nobody waits for it anymore, after which only
+ * read sections can still reach it (see brlock_retire).
+ */
+void brlock_kill(brlock *l) {
+	__atomic_store_n(&l->owner, NULL, __ATOMIC_RELAXED);
+	__atomic_store_n(&l->dead, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&l->writers);
+	while (__atomic_load_n(&l->waiting, __ATOMIC_SEQ_CST))
+		sched_yield();
+}
+
+/*
+ * Frees a killed lock once the read sections that could still reach it
+ * are over. Its mutex is unlocked and, being a default one, holds
+ * nothing to destroy.
+ */
+void brlock_retire(brlock *l) {
+	reclaim_retire(l);
+}
+
+
+/*
+ * Counts a pin in or out, in the calling thread's slot.
+ * Input:
+ *  - l: the lock
+ *  - delta: 1 to pin, -1 to unpin
+ */
+void brlock_pin(brlock *l, int delta) {
+	__atomic_add_fetch(&slot_of(l)->pins, delta, __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns the pins counted in all the slots.
+ */
+long brlock_pins(brlock *l) {
+	long pins = 0;
+
+	for (int i = 0; i < n_slots; i++)
+		pins += __atomic_load_n(&l->slots[i].pins, __ATOMIC_ACQUIRE);
+	return pins;
+}
@@ -0,0 +1,50 @@
+#ifndef BRLOCK_H
+#define BRLOCK_H
+
+#include <pthread.h>
+
+/*
+ * Big-reader lock: a reader-writer lock for i-nodes that nearly every
+ * operation reads on its way down (the root and its top-level
+ * directories), so that readers don't all update the same counter.
+ * Each reader counts itself in a slot of its own thread (one per online
+ * CPU, on its own cache line); a writer raises a flag that turns new
+ * readers away and then waits for every slot to drain. Readers are
+ * cheap and writers pay for it, so it suits i-nodes far more often
+ * walked through than changed. Like the writer-preferring rwlocks, a
+ * thread must not take it for reading twice.
+ * The slots also count pins (see inode_pin), for the same reason.
+ * A lock an i-node stops using is killed, which turns away whoever still
+ * waits for it, and then retired (see brlock_create).
+ */
+
+typedef struct brlock_slot {
+	long readers;
+	long pins;
+} __attribute__((aligned(64))) brlock_slot;
+
+typedef struct brlock {
+	int writer;              /* set while a writer holds or waits for the lock */
+	int reclaimable;         /* may be killed and retired */
+	int dead;                /* set once killed (see brlock_kill) */
+	int waiting;             /* threads waiting for it, kept from retiring it */
+	void *owner;             /* the writer holding it, to tell unlocks apart */
+	pthread_mutex_t writers; /* serializes writers; readers turned away wait on it */
+	brlock_slot slots[];
+} brlock;
+
+brlock *brlock_create(int reclaimable);
+void brlock_destroy(brlock *l);
+int brlock_read_lock(brlock *l);
+int brlock_read_trylock(brlock *l);
+void brlock_read_unlock(brlock *l);
+int brlock_write_lock(brlock *l);
+int brlock_write_trylock(brlock *l);
+void brlock_write_unlock(brlock *l);
+void brlock_unlock(brlock *l);
+void brlock_kill(brlock *l);
+void brlock_retire(brlock *l);
+void brlock_pin(brlock *l, int delta);
+long brlock_pins(brlock *l);
+
+#endif /* BRLOCK_H */
@@ -0,0 +1,405 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+#include "state.h"
+#include "wal.h"
+
+/*
+ * An image is this header, then n_inodes records (one per i-number),
+ * then the directory tables, each at an offset aligned to CKPT_ALIGN.
+ * Tables are stored as they are in memory, so an image can only be
+ * loaded by a server built with the same layout (entry_size, table_size).
+ */
+typedef struct ckpt_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t entry_size;
+	uint32_t table_size;
+	uint64_t size;          /* bytes in the image */
+	uint64_t log_position;  /* log records before it are in the image */
+	int32_t n_inodes;
+	uint32_t reserved;
+} ckpt_header;
+
+typedef struct ckpt_inode {
+	int32_t nodeType;
+	int32_t n_entries;      /* of a directory */
+	int32_t n_live;
+	uint32_t reserved;
+	uint64_t table;         /* offset of a directory's table in the image */
+} ckpt_inode;
+
+#define CKPT_MAGIC 0x43534654  /* "TFSC" */
+#define CKPT_VERSION 1
+#define CKPT_ALIGN 8
+#define CKPT_ROUND(n) (((n) + CKPT_ALIGN - 1) & ~((size_t) CKPT_ALIGN - 1))
+
+static char *image_path;
+static char *image;             /* the image loaded at startup, while mapped */
+static size_t image_size;
+static unsigned long saved_position;
+
+/* state of checkpoint_save while walking a snapshot of the tree */
+typedef struct ckpt_writer {
+	unsigned long pos;      /* of the log, when the snapshot was taken */
+	ckpt_inode *recs;       /* tables at offsets from the first table until written */
+	int n_inodes, cap_inodes;
+	char *tables;
+	size_t size, cap;       /* bytes of tables, and room for them */
+	int error;              /* whether memory ran out */
+} ckpt_writer;
+
+
+/*
+ * Sets where images are kept.
+ * Input:
+ *  - path: the image file
+ * Returns: SUCCESS or FAIL
+ */
+int checkpoint_open(char *path) {
+	if (!(image_path = strdup(path))) {
+		fprintf(stderr, "Error: No memory allocated for the checkpoint.\n");
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Unmaps the image loaded at startup. Called once no directory uses its
+ * tables anymore.
+ */
+void checkpoint_close() {
+	if (image)
+		munmap(image, image_size);
+	image = NULL;
+	free(image_path);
+	image_path = NULL;
+}
+
+
+/*
+ * Checks that the entries and index of a directory table of an image
+ * can be used: lookups end, and every child is a valid i-node.
+ * Input:
+ *  - t: the table
+ *  - r: the record of its directory
+ *  - recs: the records of the image
+ *  - n_inodes: how many
+ *  - parents: how many directories name each i-node so far, updated
+ * Returns: SUCCESS or FAIL
+ */
+static int table_check(DirTable *t, ckpt_inode *r, ckpt_inode *recs, int n_inodes, unsigned char *parents) {
+	int *index = (int *) &t->entries[t->cap_entries];
+	int n_live = 0, empty = 0;
+
+	for (int pos = 0; pos < r->n_entries; pos++) {
+		DirEntry *e = &t->entries[pos];
+
+		if (e->inumber == FREE_INODE)
+			continue;
+		if (e->inumber <= FS_ROOT || e->inumber >= n_inodes || recs[e->inumber].nodeType == T_NONE ||
+		    e->len < 1 || e->len >= MAX_FILE_NAME || e->name[e->len] != '\0' || parents[e->inumber]++)
+			return FAIL;
+		n_live++;
+	}
+
+	/* linear probing stops at an empty slot, so there must be one */
+	for (int slot = 0; slot < t->index_size; slot++) {
+		if (index[slot] == DIR_INDEX_EMPTY)
+			empty++;
+		else if (index[slot] != DIR_INDEX_REMOVED && (index[slot] < 0 || index[slot] >= r->n_entries))
+			return FAIL;
+	}
+	return (n_live == r->n_live && empty > 0) ? SUCCESS : FAIL;
+}
+
+/*
+ * Checks that the records of an image describe a usable tree, so a
+ * damaged image is refused rather than crashing the server later. Each
+ * i-node but the root is named by at most one directory, so walking the
+ * tree from the root ends.
+ * Returns: SUCCESS or FAIL
+ */
+static int image_check(ckpt_header *hdr) {
+	ckpt_inode *recs = (ckpt_inode *) (image + sizeof(ckpt_header));
+	size_t tables = sizeof(ckpt_header) + (size_t) hdr->n_inodes * sizeof(ckpt_inode);
+	unsigned char *parents;
+	int res = SUCCESS;
+
+	if (hdr->magic != CKPT_MAGIC || hdr->version != CKPT_VERSION ||
+	    hdr->entry_size != sizeof(DirEntry) || hdr->table_size != sizeof(DirTable) ||
+	    hdr->size != image_size || hdr->n_inodes < 1 || tables > image_size ||
+	    recs[FS_ROOT].nodeType != T_DIRECTORY)
+		return FAIL;
+
+	if (!(parents = calloc(hdr->n_inodes, 1))) {
+		fprintf(stderr, "Error: No memory allocated for the checkpoint.\n");
+		return FAIL;
+	}
+
+	for (int i = 0; i < hdr->n_inodes && res == SUCCESS; i++) {
+		ckpt_inode *r = &recs[i];
+
+		if (r->nodeType == T_NONE || r->nodeType == T_FILE)
+			continue;
+		if (r->nodeType != T_DIRECTORY || r->table < tables || r->table % CKPT_ALIGN ||
+		    r->table > image_size - sizeof(DirTable)) {
+			res = FAIL;
+			break;
+		}
+
+		DirTable *t = (DirTable *) (image + r->table);
+		if (t->cap_entries < 1 || t->cap_entries > INT_MAX / 2 || (t->cap_entries & (t->cap_entries - 1)) ||
+		    t->index_size != 2 * t->cap_entries || r->table + DIR_TABLE_SIZE(t->cap_entries) > image_size ||
+		    r->n_live < 0 || r->n_live > r->n_entries || r->n_entries > t->cap_entries)
+			res = FAIL;
+		else
+			res = table_check(t, r, recs, hdr->n_inodes, parents);
+	}
+	free(parents);
+	return res;
+}
+
+/*
+ * Gives the type and data of one i-node of the image (an inode_loader).
+ */
+static type load_inode(int inumber, union Data *data, void *arg) {
+	ckpt_inode *r = &((ckpt_inode *) (image + sizeof(ckpt_header)))[inumber];
+
+	if (r->nodeType == T_DIRECTORY &&
+	    !(data->dir = directory_map((DirTable *) (image + r->table), r->n_entries, r->n_live))) {
+		fprintf(stderr, "Error: No memory allocated for the checkpoint.\n");
+		exit(EXIT_FAILURE);
+	}
+	return r->nodeType;
+}
+
+/*
+ * Restores the tree of the image, if there is one, into an empty i-node
+ * table. The image is mapped copy-on-write: pages are only read from the
+ * file as directories are used, and changes never reach it.
+ * Input:
+ *  - log_position: where the log records not in the image start
+ * Returns:
+ *  - 1: if the tree was restored
+ *  - 0: if there is no image
+ *  - FAIL: if the image can't be used
+ */
+int checkpoint_load(unsigned long *log_position) {
+	struct stat st;
+	int fd;
+
+	*log_position = 0;
+	if (!image_path)
+		return 0;
+	if ((fd = open(image_path, O_RDONLY | O_CLOEXEC)) < 0) {
+		if (errno == ENOENT)
+			return 0;
+		perror("Error: unable to open the checkpoint");
+		return FAIL;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(ckpt_header)) {
+		fprintf(stderr, "Error: %s is not a checkpoint\n", image_path);
+		close(fd);
+		return FAIL;
+	}
+
+	image_size = st.st_size;
+	image = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED) {
+		image = NULL;
+		perror("Error: unable to map the checkpoint");
+		return FAIL;
+	}
+
+	ckpt_header *hdr = (ckpt_header *) image;
+	if (image_check(hdr) == FAIL) {
+		fprintf(stderr, "Error: %s is not a usable checkpoint\n", image_path);
+		return FAIL;
+	}
+	if (inode_table_restore(hdr->n_inodes, load_inode, NULL) == FAIL) {
+		fprintf(stderr, "Error: the checkpoint doesn't fit the i-node table\n");
+		return FAIL;
+	}
+	*log_position = saved_position = hdr->log_position;
+	return 1;
+}
+
+
+/*
+ * Notes where the log ends when a checkpoint's snapshot is taken.
+ */
+static void note_position(void *arg) {
+	((ckpt_writer *) arg)->pos = wal_position();
+}
+
+/*
+ * Returns the record of an i-node in an image being written, making
+ * room for it (records in between are T_NONE).
+ */
+static ckpt_inode *writer_record(ckpt_writer *w, int inumber) {
+	if (inumber >= w->cap_inodes) {
+		int cap = w->cap_inodes ? w->cap_inodes : 1024;
+		while (cap <= inumber)
+			cap *= 2;
+		ckpt_inode *recs = realloc(w->recs, sizeof(ckpt_inode) * cap);
+		if (!recs)
+			return NULL;
+		memset(recs + w->cap_inodes, 0, sizeof(ckpt_inode) * (cap - w->cap_inodes));
+		for (int i = w->cap_inodes; i < cap; i++)
+			recs[i].nodeType = T_NONE;
+		w->recs = recs;
+		w->cap_inodes = cap;
+	}
+	if (inumber >= w->n_inodes)
+		w->n_inodes = inumber + 1;
+	return &w->recs[inumber];
+}
+
+/*
+ * Adds a directory of the snapshot, and the types of its children, to
+ * an image being written (a snapshot_visitor). Its table is built anew,
+ * without holes, in zeroed memory, so images hold nothing but the tree.
+ */
+static void write_directory(int inumber, DirSnapshot *children, void *arg) {
+	ckpt_writer *w = arg;
+	int n = children ? children->n : 0, cap = DIR_INITIAL_ENTRIES;
+	ckpt_inode *r;
+
+	while (cap < n)
+		cap *= 2;
+	size_t bytes = CKPT_ROUND(DIR_TABLE_SIZE(cap));
+	if (w->error || !(r = writer_record(w, inumber)))
+		goto fail;
+	if (w->size + bytes > w->cap) {
+		size_t room = w->cap ? w->cap : 1 << 16;
+		while (room < w->size + bytes)
+			room *= 2;
+		char *tables = realloc(w->tables, room);
+		if (!tables)
+			goto fail;
+		w->tables = tables;
+		w->cap = room;
+	}
+	r->nodeType = T_DIRECTORY;
+	r->n_entries = r->n_live = n;
+	r->table = w->size;
+
+	memset(w->tables + w->size, 0, bytes);
+	DirTable *t = directory_table_init(w->tables + w->size, cap);
+	for (int i = 0; i < n; i++) {
+		SnapEntry *se = &children->entries[i];
+
+		directory_table_put(t, i, se->name, se->inumber);
+		if (se->nodeType == T_FILE) {
+			if (!(r = writer_record(w, se->inumber)))
+				goto fail;
+			r->nodeType = T_FILE;
+		}
+	}
+	t->index = NULL;  /* directory_map points it into the mapping */
+	w->size += bytes;
+	return;
+
+fail:
+	w->error = 1;
+}
+
+/*
+ * Writes all of a buffer to a file.
+ * Returns: SUCCESS or FAIL
+ */
+static int write_image(int fd, char *data, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return FAIL;
+		data += n;
+		len -= n;
+	}
+	return SUCCESS;
+}
+
+/*
+ * Takes a checkpoint. The tree gate is only locked for writing to take
+ * a snapshot of the tree (see inode_snapshot_begin) and the log position
+ * it matches; the image is then built from the snapshot while changes
+ * go on, and written to a temporary file renamed over the previous image
+ * once synced. Then the log is compacted.
+ * Nothing is done if nothing was logged since the last checkpoint.
+ * Returns: SUCCESS or FAIL
+ */
+int checkpoint_save() {
+	static const char zeros[CKPT_ALIGN];
+	ckpt_writer w = { 0 };
+	ckpt_header hdr = { 0 };
+	char tmp[PATH_MAX];
+	size_t base;
+	int fd, res = FAIL;
+
+	if (!image_path || snprintf(tmp, sizeof(tmp), "%s.tmp", image_path) >= sizeof(tmp))
+		return FAIL;
+
+	unsigned long epoch = inode_snapshot_begin(note_position, &w);
+	if (wal_enabled() && w.pos == saved_position && access(image_path, F_OK) == 0) {
+		inode_snapshot_end();
+		return SUCCESS;
+	}
+	inode_snapshot_walk(epoch, write_directory, &w);
+	inode_snapshot_end();
+	if (w.error) {
+		fprintf(stderr, "Error: No memory allocated for the checkpoint.\n");
+		goto out;
+	}
+
+	/* the tables follow the records */
+	base = CKPT_ROUND(sizeof(ckpt_header) + (size_t) w.n_inodes * sizeof(ckpt_inode));
+	for (int i = 0; i < w.n_inodes; i++)
+		if (w.recs[i].nodeType == T_DIRECTORY)
+			w.recs[i].table += base;
+
+	hdr.magic = CKPT_MAGIC;
+	hdr.version = CKPT_VERSION;
+	hdr.entry_size = sizeof(DirEntry);
+	hdr.table_size = sizeof(DirTable);
+	hdr.size = base + w.size;
+	hdr.log_position = w.pos;
+	hdr.n_inodes = w.n_inodes;
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+		perror("Error: unable to write the checkpoint");
+		goto out;
+	}
+	if (write_image(fd, (char *) &hdr, sizeof(hdr)) == FAIL ||
+	    write_image(fd, (char *) w.recs, (size_t) w.n_inodes * sizeof(ckpt_inode)) == FAIL ||
+	    write_image(fd, (char *) zeros, base - sizeof(hdr) - (size_t) w.n_inodes * sizeof(ckpt_inode)) == FAIL ||
+	    write_image(fd, w.tables, w.size) == FAIL || fdatasync(fd) < 0 || rename(tmp, image_path) < 0) {
+		perror("Error: unable to write the checkpoint");
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	close(fd);
+	if (fsync_parent(image_path) == FAIL) {
+		perror("Error: unable to sync the checkpoint");
+		goto out;
+	}
+
+	saved_position = w.pos;
+	res = wal_truncate(w.pos);
+out:
+	free(w.recs);
+	free(w.tables);
+	return res;
+}
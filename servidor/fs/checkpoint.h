@@ -0,0 +1,19 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+/*
+ * Checkpoint images of the namespace. An image holds a record per
+ * i-number and a table for every directory laid out as in memory, so at
+ * startup it is mapped (privately) and its tables are used where they are,
+ * instead of replaying every operation ever logged. An image remembers
+ * the log position it covers; once it is durable the log is compacted
+ * and only the records after it are replayed (see wal.h).
+ * File contents are not kept, as they are not logged either.
+ */
+
+int checkpoint_open(char *path);
+void checkpoint_close();
+int checkpoint_load(unsigned long *log_position);
+int checkpoint_save();
+
+#endif /* CHECKPOINT_H */
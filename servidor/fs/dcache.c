@@ -0,0 +1,239 @@
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "dcache.h"
+#include "state.h"
+
+/*
+ * A cached path. len == 0 marks an empty way.
+ */
+typedef struct dcache_entry {
+	unsigned int hash;
+	int len;
+	int inumber;
+	unsigned long stamp;       /* see path_stamp */
+	char key[MAX_FILE_NAME];
+} dcache_entry;
+
+typedef struct dcache_bucket {
+	unsigned int seq;          /* odd while a writer changes the bucket */
+	int victim;                /* next way to replace */
+	pthread_mutex_t lock;      /* serializes writers */
+	dcache_entry ways[DCACHE_WAYS];
+} dcache_bucket;
+
+static dcache_bucket buckets[DCACHE_BUCKETS];
+
+/*
+ * Generations of paths, by hash, each in its own cache line: a change
+ * only writes the line of the path it touches, and hits only read them.
+ */
+typedef struct dcache_gen {
+	unsigned long gen;
+} __attribute__((aligned(64))) dcache_gen;
+
+static dcache_gen gens[DCACHE_GENS];
+
+
+
+/*
+ * Initializes the (empty) cache.
+ */
+void dcache_init() {
+	for (int b = 0; b < DCACHE_BUCKETS; b++) {
+		buckets[b].seq = 0;
+		buckets[b].victim = 0;
+		for (int w = 0; w < DCACHE_WAYS; w++)
+			buckets[b].ways[w].len = 0;
+		if (pthread_mutex_init(&buckets[b].lock, NULL)) {
+			fprintf(stderr, "Error: unable to initialize locks\n");
+		}
+	}
+	for (int g = 0; g < DCACHE_GENS; g++)
+		gens[g].gen = 0;
+}
+
+/*
+ * Releases the cache locks.
+ */
+void dcache_destroy() {
+	for (int b = 0; b < DCACHE_BUCKETS; b++)
+		pthread_mutex_destroy(&buckets[b].lock);
+}
+
+
+/*
+ * Hashes a key (32-bit FNV-1a).
+ * Input:
+ *  - key: the key
+ *  - len: its length
+ *  - slots: if not NULL, filled with the generation slots of the key's
+ *    prefixes and of the key itself, which hash on the way
+ *  - n_slots: set to how many, if slots isn't NULL
+ * Returns: the hash
+ */
+static unsigned int key_hash(char *key, int len, int *slots, int *n_slots) {
+	unsigned int h = 2166136261u;
+	int n = 0;
+
+	for (int i = 0; i < len; i++) {
+		if (slots && key[i] == '/')
+			slots[n++] = h & (DCACHE_GENS - 1);
+		h ^= (unsigned char) key[i];
+		h *= 16777619u;
+	}
+	if (slots) {
+		slots[n++] = h & (DCACHE_GENS - 1);
+		*n_slots = n;
+	}
+	return h;
+}
+
+
+/*
+ * Adds up the generations of a key and of its prefixes. They only grow,
+ * so the sum is the same later only if none of those paths changed.
+ * Input:
+ *  - slots: the generation slots, from key_hash
+ *  - n_slots: how many
+ * Returns: the stamp
+ */
+static unsigned long path_stamp(int *slots, int n_slots) {
+	unsigned long stamp = 0;
+
+	for (int i = 0; i < n_slots; i++)
+		stamp += __atomic_load_n(&gens[slots[i]].gen, __ATOMIC_ACQUIRE);
+	return stamp;
+}
+
+
+static void bucket_write_begin(dcache_bucket *b) {
+	pthread_mutex_lock(&b->lock);
+	__atomic_store_n(&b->seq, b->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void bucket_write_end(dcache_bucket *b) {
+	__atomic_store_n(&b->seq, b->seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&b->lock);
+}
+
+
+/*
+ * Builds the cache key of a path: its components joined by single slashes.
+ * Input:
+ *  - path: the path
+ *  - key: where to store the key (MAX_FILE_NAME bytes)
+ * Returns: length of the key, or FAIL if the path is too long
+ */
+int dcache_normalize(char *path, char *key) {
+	int len = 0;
+
+	for (char *p = path; *p; p++) {
+		if (*p == '/' && (len == 0 || key[len - 1] == '/'))
+			continue;
+		if (len == MAX_FILE_NAME - 1)
+			return FAIL;
+		key[len++] = *p;
+	}
+	if (len > 0 && key[len - 1] == '/')
+		len--;
+	key[len] = '\0';
+	return len;
+}
+
+
+/*
+ * Looks for a key in the cache. The generations are read after the
+ * entry, so they are at least those its lookup started with: the entry
+ * is good only if none grew since.
+ * Input:
+ *  - key: a normalized path
+ *  - inumber: where to store the cached result
+ *  - stamp: set to the stamp of the key now, to pass to dcache_insert
+ *    after resolving the path on a miss
+ * Returns: SUCCESS on a hit, FAIL on a miss
+ */
+int dcache_lookup(char *key, int *inumber, unsigned long *stamp) {
+	int len = strlen(key), slots[MAX_FILE_NAME], n_slots;
+	unsigned int hash = key_hash(key, len, slots, &n_slots);
+	dcache_bucket *b = &buckets[hash & (DCACHE_BUCKETS - 1)];
+	unsigned int seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+	unsigned long entry_stamp = 0;
+	int res = FAIL;
+
+	for (int w = 0; w < DCACHE_WAYS && len > 0 && !(seq & 1); w++) {
+		dcache_entry *e = &b->ways[w];
+		if (__atomic_load_n(&e->hash, __ATOMIC_RELAXED) == hash &&
+		    __atomic_load_n(&e->len, __ATOMIC_RELAXED) == len &&
+		    memcmp(e->key, key, len) == 0) {
+			*inumber = __atomic_load_n(&e->inumber, __ATOMIC_RELAXED);
+			entry_stamp = __atomic_load_n(&e->stamp, __ATOMIC_RELAXED);
+			res = SUCCESS;
+			break;
+		}
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&b->seq, __ATOMIC_RELAXED) != seq)
+		res = FAIL;
+
+	*stamp = path_stamp(slots, n_slots);
+	if (res == SUCCESS && entry_stamp != *stamp)
+		return FAIL;
+	return res;
+}
+
+
+/*
+ * Caches the result of a lookup. If the path, or one above it, changed
+ * since the stamp was taken, the entry is stale from the start and no
+ * lookup will take it.
+ * Input:
+ *  - key: a normalized path
+ *  - inumber: the result of looking it up
+ *  - stamp: from dcache_lookup, before the lookup started
+ */
+void dcache_insert(char *key, int inumber, unsigned long stamp) {
+	int len = strlen(key);
+	unsigned int hash = key_hash(key, len, NULL, NULL);
+	dcache_bucket *b = &buckets[hash & (DCACHE_BUCKETS - 1)];
+	int way = -1;
+
+	if (len == 0)
+		return;
+
+	bucket_write_begin(b);
+	for (int w = 0; w < DCACHE_WAYS && way == -1; w++) {
+		if (b->ways[w].len == len && b->ways[w].hash == hash && memcmp(b->ways[w].key, key, len) == 0)
+			way = w;
+	}
+	if (way == -1) {
+		way = b->victim;
+		b->victim = (b->victim + 1) % DCACHE_WAYS;
+	}
+	dcache_entry *e = &b->ways[way];
+	e->hash = hash;
+	e->len = len;
+	e->inumber = inumber;
+	e->stamp = stamp;
+	memcpy(e->key, key, len + 1);
+	bucket_write_end(b);
+}
+
+
+/*
+ * Forgets a path and every path below it, by bumping its generation.
+ * Called by operations that change what it resolves to, after the change
+ * and before they release their locks.
+ * Input:
+ *  - path: the path (not normalized)
+ */
+void dcache_invalidate(char *path) {
+	char key[MAX_FILE_NAME];
+	int len = dcache_normalize(path, key);
+
+	if (len <= 0)
+		return;
+	__atomic_add_fetch(&gens[key_hash(key, len, NULL, NULL) & (DCACHE_GENS - 1)].gen, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,30 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "../tecnicofs-api-constants.h"
+
+/*
+ * Path resolution cache: maps a full path to the result of looking it up
+ * (an i-number, or FAIL for paths that do not exist). It is a fixed-size,
+ * set-associative table; each bucket is written under a mutex and read
+ * lock-free under a sequence counter.
+ * Keys are normalized paths ("/a//b/" and "a/b" are both "a/b").
+ * Operations that change the namespace invalidate the path they touch,
+ * which bumps the generation of that path, kept in a slot by its hash.
+ * An entry records the generations of its key and of each prefix of it
+ * as its lookup started, and is only good while they stay the same: so
+ * invalidating a path also drops everything below it, and a lookup that
+ * started before cannot cache its (now stale) result afterwards.
+ */
+#define DCACHE_BUCKETS 4096  /* power of two */
+#define DCACHE_WAYS 4
+#define DCACHE_GENS 1024     /* power of two */
+
+void dcache_init();
+void dcache_destroy();
+int dcache_normalize(char *path, char *key);
+int dcache_lookup(char *key, int *inumber, unsigned long *stamp);
+void dcache_insert(char *key, int inumber, unsigned long stamp);
+void dcache_invalidate(char *path);
+
+#endif /* DCACHE_H */
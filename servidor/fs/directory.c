@@ -0,0 +1,360 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "directory.h"
+#include "reclaim.h"
+#include "slab.h"
+#include "state.h"
+
+/*
+ * Directories, and their tables while they have the first capacity (as
+ * most do), come from slab caches; bigger tables come from malloc.
+ */
+static slab_cache dir_cache = SLAB_CACHE_INIT(sizeof(Directory));
+static slab_cache table_cache = SLAB_CACHE_INIT(DIR_TABLE_SIZE(DIR_INITIAL_ENTRIES));
+
+/*
+ * Hashes an entry name (32-bit FNV-1a).
+ * Input:
+ *  - name: the entry name
+ *  - len: where to store the length of the name
+ * Returns: the hash of the name
+ */
+static unsigned int name_hash(char *name, int *len) {
+	unsigned int h = 2166136261u;
+	int i;
+
+	for (i = 0; name[i] != '\0'; i++) {
+		h ^= (unsigned char) name[i];
+		h *= 16777619u;
+	}
+	*len = i;
+	return h;
+}
+
+
+/*
+ * Publishes position pos of a table in its hash index.
+ * Input:
+ *  - t: the table
+ *  - pos: position of a live entry
+ */
+static void index_insert(DirTable *t, int pos) {
+	int mask = t->index_size - 1;
+	int slot = t->entries[pos].hash & mask;
+
+	while (t->index[slot] >= 0)
+		slot = (slot + 1) & mask;
+	/* the entry must be complete before lock-free readers can reach it */
+	__atomic_store_n(&t->index[slot], pos, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Retires a table no directory uses anymore.
+ * Input:
+ *  - t: the table (or NULL)
+ */
+static void table_retire(DirTable *t) {
+	if (!t || t->mapped)
+		return;
+	if (t->cap_entries == DIR_INITIAL_ENTRIES)
+		reclaim_retire_slab(t, &table_cache);
+	else
+		reclaim_retire(t);
+}
+
+
+/*
+ * Builds a new table for a directory with the live entries of the current
+ * one (in order, without holes) and retires the current one.
+ * Input:
+ *  - dir: the directory
+ *  - cap: capacity of the new table (power of two, >= dir->n_live)
+ * Returns: SUCCESS or FAIL
+ */
+static int table_rebuild(Directory *dir, int cap) {
+	DirTable *old = dir->table;
+	DirTable *t = (cap == DIR_INITIAL_ENTRIES) ? slab_alloc(&table_cache) : malloc(DIR_TABLE_SIZE(cap));
+	int n = 0;
+
+	if (!t)
+		return FAIL;
+	t->cap_entries = cap;
+	t->index_size = 2 * cap;
+	t->mapped = 0;
+	t->index = (int *) &t->entries[cap];
+	for (int i = 0; i < t->index_size; i++)
+		t->index[i] = DIR_INDEX_EMPTY;
+
+	for (int pos = 0; old && pos < dir->n_entries; pos++) {
+		if (old->entries[pos].inumber == FREE_INODE)
+			continue;
+		t->entries[n] = old->entries[pos];
+		index_insert(t, n++);
+	}
+
+	__atomic_store_n(&dir->table, t, __ATOMIC_RELEASE);
+	dir->n_entries = n;
+	table_retire(old);
+	return SUCCESS;
+}
+
+
+/*
+ * Finds the index slot holding the entry with the given name.
+ * Input:
+ *  - t: the table
+ *  - name, hash, len: the name of the entry and its cached hash and length
+ * Returns:
+ *  - slot: index slot of the entry
+ *  - FAIL: if not found
+ */
+static int index_find(DirTable *t, char *name, unsigned int hash, int len) {
+	int mask = t->index_size - 1;
+
+	for (int slot = hash & mask; t->index[slot] != DIR_INDEX_EMPTY; slot = (slot + 1) & mask) {
+		int pos = t->index[slot];
+		if (pos == DIR_INDEX_REMOVED)
+			continue;
+		DirEntry *e = &t->entries[pos];
+		if (e->hash == hash && e->len == len && memcmp(e->name, name, len) == 0)
+			return slot;
+	}
+	return FAIL;
+}
+
+
+/*
+ * Lays out an empty table in zeroed memory, such as that of a checkpoint
+ * image being written (see directory_map).
+ * Input:
+ *  - mem: DIR_TABLE_SIZE(cap) bytes, zeroed
+ *  - cap: entries it has room for (power of two)
+ * Returns: the table
+ */
+DirTable *directory_table_init(void *mem, int cap) {
+	DirTable *t = mem;
+
+	t->cap_entries = cap;
+	t->index_size = 2 * cap;
+	t->index = (int *) &t->entries[cap];
+	for (int i = 0; i < t->index_size; i++)
+		t->index[i] = DIR_INDEX_EMPTY;
+	return t;
+}
+
+/*
+ * Adds a child at the next position of a table laid out by
+ * directory_table_init, which no directory uses yet.
+ * Input:
+ *  - t: the table
+ *  - pos: the position, the number of children put so far
+ *  - name: the child's name, shorter than MAX_FILE_NAME
+ *  - inumber: the child's i-number
+ */
+void directory_table_put(DirTable *t, int pos, char *name, int inumber) {
+	DirEntry *e = &t->entries[pos];
+
+	e->hash = name_hash(name, &e->len);
+	memcpy(e->name, name, e->len + 1);
+	e->inumber = inumber;
+	index_insert(t, pos);
+}
+
+
+/*
+ * Creates an empty directory.
+ * Returns:
+ *  - pointer to the directory
+ *  - NULL: if out of memory
+ */
+Directory *directory_create() {
+	Directory *dir = slab_alloc(&dir_cache);
+
+	if (!dir)
+		return NULL;
+
+	dir->table = NULL;
+	dir->n_entries = 0;
+	dir->n_live = 0;
+	dir->saved = NULL;
+	dir->saved_epoch = 0;
+	if (table_rebuild(dir, DIR_INITIAL_ENTRIES) == FAIL) {
+		slab_free(&dir_cache, dir);
+		return NULL;
+	}
+	return dir;
+}
+
+
+/*
+ * Creates a directory whose table is in a checkpoint image. The table is
+ * used where it is; only its index pointer is set, as the image may be
+ * mapped anywhere. It stops being used once the directory outgrows it.
+ * Input:
+ *  - t: the table, in the image
+ *  - n_entries, n_live: as they were when the image was taken
+ * Returns:
+ *  - pointer to the directory
+ *  - NULL: if out of memory
+ */
+Directory *directory_map(DirTable *t, int n_entries, int n_live) {
+	Directory *dir = slab_alloc(&dir_cache);
+
+	if (!dir)
+		return NULL;
+
+	t->mapped = 1;
+	t->index = (int *) &t->entries[t->cap_entries];
+	dir->table = t;
+	dir->n_entries = n_entries;
+	dir->n_live = n_live;
+	dir->saved = NULL;
+	dir->saved_epoch = 0;
+	return dir;
+}
+
+
+/*
+ * Releases a directory. The caller has already unlinked it from its
+ * i-node, so it is retired rather than freed.
+ * Input:
+ *  - dir: the directory
+ */
+void directory_destroy(Directory *dir) {
+	if (!dir)
+		return;
+	/* only snapshots read it, and none can reach the directory anymore */
+	free(dir->saved);
+	table_retire(dir->table);
+	reclaim_retire_slab(dir, &dir_cache);
+}
+
+
+/*
+ * Gives the memory of the directory caches back to malloc. No directory
+ * may be in use, nor retired and not yet freed, anymore.
+ */
+void directory_pool_destroy() {
+	slab_cache_destroy(&dir_cache);
+	slab_cache_destroy(&table_cache);
+}
+
+
+/*
+ * Looks for an entry by name.
+ * Input:
+ *  - dir: the directory
+ *  - name: the entry name
+ * Returns:
+ *  - inumber: of the entry
+ *  - FAIL: if not found
+ */
+int directory_lookup(Directory *dir, char *name) {
+	int len, slot;
+	unsigned int hash = name_hash(name, &len);
+
+	if ((slot = index_find(dir->table, name, hash, len)) == FAIL)
+		return FAIL;
+	return dir->table->entries[dir->table->index[slot]].inumber;
+}
+
+
+/*
+ * Looks for an entry by name without holding the directory lock.
+ * Must be called inside a read section; the directory may change under
+ * it, so the result is only meaningful if the caller validates it
+ * afterwards (see inode_read_validate). It never reads out of bounds.
+ * Input:
+ *  - dir: the directory
+ *  - name: the entry name
+ * Returns:
+ *  - inumber: of the entry
+ *  - FAIL: if not found (or a concurrent change was seen)
+ */
+int directory_lookup_racy(Directory *dir, char *name) {
+	int len;
+	unsigned int hash = name_hash(name, &len);
+	DirTable *t = __atomic_load_n(&dir->table, __ATOMIC_ACQUIRE);
+	int mask = t->index_size - 1;
+
+	for (int slot = hash & mask, probes = 0; probes < t->index_size; slot = (slot + 1) & mask, probes++) {
+		int pos = __atomic_load_n(&t->index[slot], __ATOMIC_ACQUIRE);
+		if (pos == DIR_INDEX_EMPTY || pos >= t->cap_entries)
+			return FAIL;
+		if (pos == DIR_INDEX_REMOVED)
+			continue;
+		DirEntry *e = &t->entries[pos];
+		int e_len = __atomic_load_n(&e->len, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&e->hash, __ATOMIC_RELAXED) == hash && e_len == len &&
+		    memcmp(e->name, name, len) == 0)
+			return __atomic_load_n(&e->inumber, __ATOMIC_RELAXED);
+	}
+	return FAIL;
+}
+
+
+/*
+ * Appends an entry. The caller makes sure the name is not in use.
+ * Input:
+ *  - dir: the directory
+ *  - name: the entry name
+ *  - inumber: the i-number of the entry
+ * Returns: SUCCESS or FAIL
+ */
+int directory_add(Directory *dir, char *name, int inumber) {
+	int len;
+	unsigned int hash = name_hash(name, &len);
+
+	if (len >= MAX_FILE_NAME)
+		return FAIL;
+
+	if (dir->n_entries == dir->table->cap_entries) {
+		/* squeeze the holes out if they make up half the table, otherwise grow */
+		int cap = dir->table->cap_entries;
+		if (dir->n_live > cap / 2)
+			cap *= 2;
+		if (table_rebuild(dir, cap) == FAIL)
+			return FAIL;
+	}
+
+	DirTable *t = dir->table;
+	int pos = dir->n_entries++;
+	DirEntry *e = &t->entries[pos];
+	memcpy(e->name, name, len + 1);
+	e->inumber = inumber;
+	e->hash = hash;
+	e->len = len;
+	index_insert(t, pos);
+
+	dir->n_live++;
+	return SUCCESS;
+}
+
+
+/*
+ * Removes an entry.
+ * Input:
+ *  - dir: the directory
+ *  - name: the entry name
+ *  - inumber: the i-number the entry must have
+ * Returns: SUCCESS or FAIL
+ */
+int directory_remove(Directory *dir, char *name, int inumber) {
+	int len, slot;
+	unsigned int hash = name_hash(name, &len);
+	DirTable *t = dir->table;
+
+	if ((slot = index_find(t, name, hash, len)) == FAIL)
+		return FAIL;
+
+	DirEntry *e = &t->entries[t->index[slot]];
+	if (e->inumber != inumber)
+		return FAIL;
+
+	__atomic_store_n(&t->index[slot], DIR_INDEX_REMOVED, __ATOMIC_RELEASE);
+	e->inumber = FREE_INODE;
+	dir->n_live--;
+	return SUCCESS;
+}
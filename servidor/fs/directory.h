@@ -0,0 +1,69 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include "../tecnicofs-api-constants.h"
+
+/* initial number of entries of a directory (it doubles when full) */
+#define DIR_INITIAL_ENTRIES 8
+
+/* markers for the positions stored in the hash index */
+#define DIR_INDEX_EMPTY -1
+#define DIR_INDEX_REMOVED -2
+
+/*
+ * Contains the name of the entry and respective i-number.
+ * The hash and length of the name are cached to skip most strcmp calls.
+ */
+typedef struct dirEntry {
+	char name[MAX_FILE_NAME];
+	int inumber;
+	unsigned int hash;
+	int len;
+} DirEntry;
+
+/*
+ * Storage of a directory, in a single allocation whose geometry never
+ * changes: when it fills up, a new table is built and the old one is
+ * retired (see reclaim.h), so lock-free readers never see a resize.
+ * entries keeps the children in insertion order (for printing); a removed
+ * child leaves a hole (inumber == FREE_INODE) until the next rebuild.
+ * index is an open addressing (linear probing) hash table of positions in
+ * entries, keyed by name, with index_size == 2 * cap_entries so it is at
+ * most half full.
+ * A table can also live in a checkpoint image (see checkpoint.h) and be
+ * used there in place; such tables are never freed.
+ */
+typedef struct dirTable {
+	int cap_entries;
+	int index_size;    /* power of two */
+	int mapped;        /* lives in a checkpoint image */
+	int *index;        /* points past the entries, in the same block */
+	DirEntry entries[];
+} DirTable;
+
+/* bytes of a table with room for cap entries */
+#define DIR_TABLE_SIZE(cap) (sizeof(DirTable) + sizeof(DirEntry) * (cap) + sizeof(int) * 2 * (cap))
+
+/*
+ * Directory contents.
+ */
+typedef struct directory {
+	DirTable *table;
+	int n_entries;     /* used positions in entries, holes included */
+	int n_live;        /* children, i.e. used positions that are not holes */
+	struct dirSnapshot *saved;  /* children as of a snapshot (see state.h) */
+	unsigned long saved_epoch;  /* the snapshot saved was taken for */
+} Directory;
+
+Directory *directory_create();
+Directory *directory_map(DirTable *t, int n_entries, int n_live);
+DirTable *directory_table_init(void *mem, int cap);
+void directory_table_put(DirTable *t, int pos, char *name, int inumber);
+void directory_destroy(Directory *dir);
+int directory_lookup(Directory *dir, char *name);
+int directory_lookup_racy(Directory *dir, char *name);
+int directory_add(Directory *dir, char *name, int inumber);
+int directory_remove(Directory *dir, char *name, int inumber);
+void directory_pool_destroy();
+
+#endif /* DIRECTORY_H */
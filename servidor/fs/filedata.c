@@ -0,0 +1,159 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "filedata.h"
+#include "slab.h"
+#include "state.h"
+
+/* the contents themselves, and their extents (see slab.h) */
+static slab_cache filedata_cache = SLAB_CACHE_INIT(sizeof(FileData));
+static slab_cache extent_cache = SLAB_CACHE_INIT(FILE_EXTENT_SIZE);
+
+
+/*
+ * Takes an extent from its cache.
+ * Returns: the extent (zeroed) or NULL if out of memory
+ */
+static char *extent_alloc() {
+	char *e = slab_alloc(&extent_cache);
+
+	if (e)
+		memset(e, 0, FILE_EXTENT_SIZE);
+	return e;
+}
+
+
+/*
+ * Creates the contents of an empty file.
+ * Returns: the contents or NULL if out of memory
+ */
+FileData *filedata_create() {
+	FileData *f = slab_alloc(&filedata_cache);
+
+	if (!f)
+		return NULL;
+	f->size = 0;
+	f->n_extents = 0;
+	f->cap_extents = 0;
+	f->extents = NULL;
+	return f;
+}
+
+
+/*
+ * Frees the contents of a file, giving its extents back to their cache.
+ * Input:
+ *  - f: the contents, may be NULL
+ */
+void filedata_destroy(FileData *f) {
+	if (!f)
+		return;
+	for (int i = 0; i < f->n_extents; i++) {
+		if (f->extents[i])
+			slab_free(&extent_cache, f->extents[i]);
+	}
+	free(f->extents);
+	slab_free(&filedata_cache, f);
+}
+
+
+/*
+ * Reads from a file.
+ * The caller must hold the file's i-node lock.
+ * Input:
+ *  - f: the contents, NULL for an empty file
+ *  - offset: where to start
+ *  - buf: where to copy the data to
+ *  - len: most bytes to read
+ * Returns: the bytes read, 0 at or past the end of the file
+ */
+int filedata_read(FileData *f, long offset, char *buf, int len) {
+	int done = 0;
+
+	if (!f || offset >= f->size)
+		return 0;
+	if (len > f->size - offset)
+		len = f->size - offset;
+
+	while (done < len) {
+		long pos = offset + done;
+		int e = pos / FILE_EXTENT_SIZE, in = pos % FILE_EXTENT_SIZE;
+		int n = FILE_EXTENT_SIZE - in;
+
+		if (n > len - done)
+			n = len - done;
+		if (e < f->n_extents && f->extents[e])
+			memcpy(buf + done, f->extents[e] + in, n);
+		else
+			memset(buf + done, 0, n);
+		done += n;
+	}
+	return done;
+}
+
+
+/*
+ * Writes to a file, growing it as needed. A write past the end leaves a
+ * hole that reads as zeros.
+ * The caller must hold the file's i-node lock for writing.
+ * Input:
+ *  - f: the contents
+ *  - offset: where to start
+ *  - buf: the data
+ *  - len: bytes to write
+ * Returns: len, or FAIL if the file would grow too big or out of memory,
+ *          in which case the file is left as it was
+ */
+int filedata_write(FileData *f, long offset, char *buf, int len) {
+	int done = 0;
+
+	if (offset < 0 || len < 0 || offset + len > FILE_MAX_SIZE)
+		return FAIL;
+
+	/* grow the map to cover the write */
+	int last = len > 0 ? (offset + len - 1) / FILE_EXTENT_SIZE : -1;
+	if (last >= f->cap_extents) {
+		int cap = f->cap_extents ? f->cap_extents : 4;
+		while (cap <= last)
+			cap *= 2;
+		char **extents = realloc(f->extents, sizeof(char *) * cap);
+		if (!extents)
+			return FAIL;
+		memset(extents + f->cap_extents, 0, sizeof(char *) * (cap - f->cap_extents));
+		f->extents = extents;
+		f->cap_extents = cap;
+	}
+	if (last >= f->n_extents)
+		f->n_extents = last + 1;
+
+	/* take every extent first: one that can't be taken fails the write
+	 * before any byte changes (those taken read as zeros, as holes do) */
+	for (int e = len > 0 ? offset / FILE_EXTENT_SIZE : 0; e <= last; e++)
+		if (!f->extents[e] && !(f->extents[e] = extent_alloc()))
+			return FAIL;
+
+	while (done < len) {
+		long pos = offset + done;
+		int e = pos / FILE_EXTENT_SIZE, in = pos % FILE_EXTENT_SIZE;
+		int n = FILE_EXTENT_SIZE - in;
+
+		if (n > len - done)
+			n = len - done;
+		memcpy(f->extents[e] + in, buf + done, n);
+		done += n;
+	}
+
+	if (offset + len > f->size)
+		f->size = offset + len;
+	return len;
+}
+
+
+/*
+ * Gives the memory of the caches of file contents and extents back to
+ * malloc. No file may be using any anymore.
+ */
+void filedata_pool_destroy() {
+	slab_cache_destroy(&extent_cache);
+	slab_cache_destroy(&filedata_cache);
+}
@@ -0,0 +1,29 @@
+#ifndef FILEDATA_H
+#define FILEDATA_H
+
+/*
+ * File contents are kept in fixed-size extents from a slab cache (see
+ * slab.h). A file maps extent i to bytes [i * FILE_EXTENT_SIZE,
+ * (i + 1) * FILE_EXTENT_SIZE); growing a file adds extents and at most
+ * doubles the map, so data is never copied. Extents past the end of a
+ * file that were never written stay unmapped (NULL) and read as zeros.
+ */
+#define FILE_EXTENT_SIZE 4096
+
+/* largest file, so offsets fit an int */
+#define FILE_MAX_SIZE (1L << 30)
+
+typedef struct fileData {
+	long size;
+	int n_extents;     /* used positions in extents */
+	int cap_extents;
+	char **extents;
+} FileData;
+
+FileData *filedata_create();
+void filedata_destroy(FileData *f);
+int filedata_read(FileData *f, long offset, char *buf, int len);
+int filedata_write(FileData *f, long offset, char *buf, int len);
+void filedata_pool_destroy();
+
+#endif /* FILEDATA_H */
@@ -0,0 +1,149 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "inject.h"
+#include "state.h"
+
+#ifdef TFS_INJECT
+
+typedef enum delay_kind { D_NONE, D_FIXED, D_UNIFORM, D_EXP } delay_kind;
+
+/*
+ * What is injected at one point.
+ */
+typedef struct inject_conf {
+	delay_kind delay;
+	double a, b;      /* fixed: a; uniform: [a, b]; exp: mean a (microseconds) */
+	double fail;      /* probability of failing the operation */
+} inject_conf;
+
+static const char *point_names[INJ_N_POINTS] = {
+	"inode_create", "inode_delete", "inode_get", "dir_add_entry", "dir_reset_entry"
+};
+
+static inject_conf conf[INJ_N_POINTS];
+
+/* per-thread xorshift state, seeded on first use */
+static __thread unsigned long long rng_state;
+
+
+/*
+ * Returns a uniformly distributed number in [0, 1).
+ */
+static double rng_next() {
+	if (!rng_state)
+		rng_state = (unsigned long long) (size_t) &rng_state ^ (unsigned long long) time(NULL) ^ 0x9e3779b97f4a7c15ULL;
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return (rng_state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/*
+ * Busy-waits for the given number of microseconds.
+ */
+static void spin_us(double us) {
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while ((now.tv_sec - start.tv_sec) * 1e6 + (now.tv_nsec - start.tv_nsec) / 1e3 < us);
+}
+
+
+/*
+ * Parses one "point=spec" item of the configuration.
+ * Input:
+ *  - item: the item (modified)
+ * Returns: SUCCESS or FAIL
+ */
+static int parse_item(char *item) {
+	char *spec = strchr(item, '=');
+	inject_conf c = { D_NONE, 0, 0, -1 };  /* fail < 0: not a fault item */
+	int n, matched = 0;
+
+	if (!spec)
+		return FAIL;
+	*spec++ = '\0';
+
+	if (sscanf(spec, "delay:fixed:%lf%n", &c.a, &n) == 1 && !spec[n])
+		c.delay = D_FIXED;
+	else if (sscanf(spec, "delay:uniform:%lf:%lf%n", &c.a, &c.b, &n) == 2 && !spec[n] && c.a <= c.b)
+		c.delay = D_UNIFORM;
+	else if (sscanf(spec, "delay:exp:%lf%n", &c.a, &n) == 1 && !spec[n])
+		c.delay = D_EXP;
+	else if (!(sscanf(spec, "fail:%lf%n", &c.fail, &n) == 1 && !spec[n] && c.fail >= 0 && c.fail <= 1))
+		return FAIL;
+
+	for (int p = 0; p < INJ_N_POINTS; p++) {
+		if (strcmp(item, "*") && strcmp(item, point_names[p]))
+			continue;
+		if (c.fail < 0) {
+			conf[p].delay = c.delay;
+			conf[p].a = c.a;
+			conf[p].b = c.b;
+		} else if (p != INJ_INODE_GET) {
+			/* callers of inode_get() do not handle failures */
+			conf[p].fail = c.fail;
+		}
+		matched = 1;
+	}
+	return matched ? SUCCESS : FAIL;
+}
+
+
+/*
+ * Reads the injection configuration.
+ */
+void inject_init() {
+	char *env = getenv("TECNICOFS_INJECT"), *copy, *item, *saveptr;
+
+	memset(conf, 0, sizeof(conf));
+#ifdef TFS_INJECT_SPEC
+	if (!env)
+		env = TFS_INJECT_SPEC;
+#endif
+	if (!env || !(copy = strdup(env)))
+		return;
+
+	for (item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+		if (parse_item(item) == FAIL)
+			fprintf(stderr, "inject: ignoring invalid item '%s'\n", item);
+	}
+	free(copy);
+}
+
+
+/*
+ * Applies the configured delay and fault for an injection point.
+ * Input:
+ *  - p: the injection point
+ * Returns: SUCCESS, or FAIL if the operation must fail
+ */
+int inject(inject_point p) {
+	inject_conf *c = &conf[p];
+
+	switch (c->delay) {
+		case D_FIXED:
+			spin_us(c->a);
+			break;
+		case D_UNIFORM:
+			spin_us(c->a + (c->b - c->a) * rng_next());
+			break;
+		case D_EXP:
+			spin_us(-c->a * log(1.0 - rng_next()));
+			break;
+		case D_NONE:
+			break;
+	}
+
+	if (c->fail > 0 && rng_next() < c->fail)
+		return FAIL;
+	return SUCCESS;
+}
+
+#endif /* TFS_INJECT */
@@ -0,0 +1,41 @@
+#ifndef INJECT_H
+#define INJECT_H
+
+/*
+ * Latency and fault injection, used to test synchronization under
+ * contention. It is compiled in only with -DTFS_INJECT (make INJECT=1);
+ * otherwise INJECT() is the constant SUCCESS and costs nothing.
+ *
+ * The configuration is read by inject_init() from the TECNICOFS_INJECT
+ * environment variable or, if unset, from the build-time TFS_INJECT_SPEC
+ * string (make INJECT_SPEC=...). It is a comma separated list of
+ *     point=delay:fixed:US
+ *     point=delay:uniform:MIN_US:MAX_US
+ *     point=delay:exp:MEAN_US
+ *     point=fail:PROBABILITY
+ * where point is one of the names below or '*' for all of them, e.g.
+ *     TECNICOFS_INJECT='*=delay:uniform:0:20,dir_add_entry=fail:0.01'
+ * Delays busy-wait, so locks held across them stay held, like the old
+ * insert_delay() loop.
+ */
+
+/* places where latency or faults can be injected */
+typedef enum inject_point {
+	INJ_INODE_CREATE,
+	INJ_INODE_DELETE,
+	INJ_INODE_GET,
+	INJ_DIR_ADD_ENTRY,
+	INJ_DIR_RESET_ENTRY,
+	INJ_N_POINTS
+} inject_point;
+
+#ifdef TFS_INJECT
+void inject_init();
+int inject(inject_point p);
+#define INJECT(p) inject(p)
+#else
+#define inject_init() ((void) 0)
+#define INJECT(p) SUCCESS
+#endif
+
+#endif /* INJECT_H */
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "openfile.h"
+#include "state.h"
+
+static OpenFile table[MAX_OPEN_FILES];
+
+/* free entries, linked through next_free */
+static int free_head;
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Initializes the open-file table, with every entry free.
+ */
+void openfile_table_init() {
+	for (int i = 0; i < MAX_OPEN_FILES; i++) {
+		if (pthread_mutex_init(&table[i].lock, NULL)) {
+			fprintf(stderr, "Error: unable to initialize locks\n");
+			exit(EXIT_FAILURE);
+		}
+		table[i].inumber = FREE_INODE;
+		table[i].next_free = i + 1 < MAX_OPEN_FILES ? i + 1 : FAIL;
+	}
+	free_head = 0;
+}
+
+
+/*
+ * Destroys the open-file table.
+ */
+void openfile_table_destroy() {
+	for (int i = 0; i < MAX_OPEN_FILES; i++)
+		pthread_mutex_destroy(&table[i].lock);
+}
+
+
+/*
+ * Takes a free entry of the table.
+ * Input:
+ *  - inumber: the file being opened
+ *  - mode: READ, WRITE or RW
+ *  - owner: the client opening it
+ * Returns: the file descriptor or FAIL if the table is full
+ */
+int openfile_alloc(int inumber, permission mode, fd_owner *owner) {
+	int fd;
+
+	pthread_mutex_lock(&table_lock);
+	if ((fd = free_head) != FAIL)
+		free_head = table[fd].next_free;
+	pthread_mutex_unlock(&table_lock);
+
+	if (fd == FAIL)
+		return FAIL;
+
+	pthread_mutex_lock(&table[fd].lock);
+	table[fd].inumber = inumber;
+	table[fd].mode = mode;
+	table[fd].offset = 0;
+	table[fd].owner = *owner;
+	pthread_mutex_unlock(&table[fd].lock);
+	return fd;
+}
+
+
+/*
+ * Gets an open file and locks its entry.
+ * Input:
+ *  - fd: the file descriptor
+ *  - owner: the client using it
+ * Returns: the entry, locked, or NULL if fd is not open, or is open by
+ *  another client
+ */
+OpenFile *openfile_get(int fd, fd_owner *owner) {
+	if (fd < 0 || fd >= MAX_OPEN_FILES)
+		return NULL;
+
+	pthread_mutex_lock(&table[fd].lock);
+	if (table[fd].inumber == FREE_INODE || table[fd].owner.session != owner->session ||
+	    memcmp(table[fd].owner.name, owner->name, OWNER_NAME_SIZE)) {
+		pthread_mutex_unlock(&table[fd].lock);
+		return NULL;
+	}
+	return &table[fd];
+}
+
+
+/*
+ * Unlocks an entry taken with openfile_get.
+ */
+void openfile_put(OpenFile *f) {
+	pthread_mutex_unlock(&f->lock);
+}
+
+
+/*
+ * Frees an entry taken with openfile_get, unlocking it.
+ */
+void openfile_release(OpenFile *f) {
+	int fd = f - table;
+
+	f->inumber = FREE_INODE;
+	pthread_mutex_unlock(&f->lock);
+
+	pthread_mutex_lock(&table_lock);
+	table[fd].next_free = free_head;
+	free_head = fd;
+	pthread_mutex_unlock(&table_lock);
+}
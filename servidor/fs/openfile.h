@@ -0,0 +1,45 @@
+#ifndef OPENFILE_H
+#define OPENFILE_H
+
+#include <pthread.h>
+#include "../tecnicofs-api-constants.h"
+
+/* size of the open-file table, shared by every client */
+#define MAX_OPEN_FILES 1024
+
+/* longest socket name of a client (sun_path) */
+#define OWNER_NAME_SIZE 108
+
+/*
+ * The client that opened a file: the session or connection it talks
+ * through or, for a datagram client, the name of its socket. Only its
+ * owner can use a descriptor, and all of them are closed when the owner
+ * goes away (see close_files).
+ */
+typedef struct fd_owner {
+	const void *session;           /* NULL for a datagram client */
+	char name[OWNER_NAME_SIZE];    /* zero-filled past the name */
+} fd_owner;
+
+/*
+ * An entry of the open-file table. File descriptors are indexes in the
+ * table. The lock serializes the operations on one descriptor, so reads
+ * and writes at the current offset see and advance it in order.
+ */
+typedef struct openFile {
+	pthread_mutex_t lock;
+	int inumber;       /* FREE_INODE while the entry is free */
+	permission mode;
+	long offset;
+	fd_owner owner;
+	int next_free;
+} OpenFile;
+
+void openfile_table_init();
+void openfile_table_destroy();
+int openfile_alloc(int inumber, permission mode, fd_owner *owner);
+OpenFile *openfile_get(int fd, fd_owner *owner);
+void openfile_put(OpenFile *f);
+void openfile_release(OpenFile *f);
+
+#endif /* OPENFILE_H */
@@ -1,28 +1,163 @@
+#define _GNU_SOURCE
 #include "operations.h"
+#include "inject.h"
+#include "reclaim.h"
+#include "dcache.h"
+#include "openfile.h"
+#include "wal.h"
+#include "checkpoint.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
 
+/* attempts of the lock-free lookup before falling back to locking */
+#define OPTIMISTIC_RETRIES 3
+
+/* why the last operation of this thread failed, one of TECNICOFS_ERROR_* */
+__thread int fs_error = 0;
+
+/*
+ * Locks the tree gate (see inode_gate_lock).
+ * Input:
+ *  - p: READ around a change, WRITE to have the tree to itself
+ */
+static void gate_lock(permission p) {
+	if (inode_gate_lock(p) == FAIL) {
+		fprintf(stderr, "Error: unable to lock the tree\n");
+		exit(EXIT_FAILURE);
+	}
+}
 
 /*
- * Initializes tecnicofs and creates root node.
+ * Unlocks the tree gate.
+ */
+static void gate_unlock() {
+	if (inode_gate_unlock() == FAIL) {
+		fprintf(stderr, "Error: unable to unlock the tree\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Starts a walk of the tree by a change.
+ * Input:
+ *  - w: the walk
+ */
+static void walk_begin(tree_walk *w) {
+	w->n_pinned = 0;
+	w->blocked = FAIL;
+}
+
+/*
+ * Pins a directory a walk is about to let go of (see inode_pin).
+ * Input:
+ *  - w: the walk, NULL for one that changes nothing and pins nothing
+ *  - inumber: the directory, locked
+ * Returns: SUCCESS, or FAIL if a move of it is pending, recorded in w
+ */
+static int walk_pin(tree_walk *w, int inumber) {
+	if (!w || inumber == FS_ROOT)
+		return SUCCESS;
+	if (inode_pin(inumber) == FAIL) {
+		w->blocked = inumber;
+		return FAIL;
+	}
+	w->pinned[w->n_pinned++] = inumber;
+	return SUCCESS;
+}
+
+/*
+ * Ends a walk, once the change is logged and nothing is locked: unpins
+ * what it pinned and, if a pending move stopped it, waits for the move.
+ * A claim of its own is kept only if it is what it waits for, so that
+ * two moves never wait for each other.
+ * Input:
+ *  - w: the walk
+ * Returns: SUCCESS, or FAIL if the change must start over
+ */
+static int walk_end(tree_walk *w) {
+	while (w->n_pinned > 0)
+		inode_unpin(w->pinned[--w->n_pinned]);
+	if (w->blocked == FAIL)
+		return SUCCESS;
+	if (w->claimed != FAIL && w->claimed != w->blocked) {
+		inode_move_end(w->claimed);
+		w->claimed = FAIL;
+	}
+	inode_move_wait(w->blocked);
+	return FAIL;
+}
+
+/*
+ * Applies an operation replayed from the log.
+ */
+static void redo(char op, type nodeType, char *path1, char *path2) {
+	int res = FAIL;
+
+	switch (op) {
+		case 'c':
+			res = create(path1, nodeType);
+			break;
+		case 'd':
+			res = delete(path1);
+			break;
+		case 'm':
+			res = move(path1, path2);
+			break;
+	}
+	if (res == FAIL)
+		fprintf(stderr, "log: could not redo '%c' %s\n", op, path1);
+}
+
+/*
+ * Initializes tecnicofs: restores the last checkpoint or else creates the
+ * root node, then replays the log, if there is one.
  */
 void init_fs() {
+	inject_init();
 	inode_table_init();
+	dcache_init();
+	openfile_table_init();
 
-	/*Garbage values*/
-	int inodes_locked[1] = {0};
-	int n_inodes_locked = 0;
-	
-	/* create root inode */
-	int root = inode_create(T_DIRECTORY, inodes_locked, &n_inodes_locked);
-	
-	if (root != FS_ROOT) {
-		printf("failed to create node for tecnicofs root\n");
+	/* restore the last checkpoint, if any */
+	unsigned long from;
+	int loaded = checkpoint_load(&from);
+	if (loaded == FAIL)
 		exit(EXIT_FAILURE);
+
+	if (!loaded) {
+		/*Garbage values*/
+		int inodes_locked[1] = {0};
+		int n_inodes_locked = 0;
+
+		/* create root inode */
+		int root = inode_create(T_DIRECTORY, 0, inodes_locked, &n_inodes_locked);
+
+		if (root != FS_ROOT) {
+			printf("failed to create node for tecnicofs root\n");
+			exit(EXIT_FAILURE);
+		}
+
+		inode_unlock(inodes_locked[--n_inodes_locked]);
+	} else {
+		/* the locks the restored directories would have had */
+		inode_table_bias();
 	}
 
-	inode_unlock(inodes_locked[--n_inodes_locked]);
+	/* rebuild the rest of the tree from the log */
+	int n = wal_replay(redo, from);
+	if (n == FAIL) {
+		fprintf(stderr, "Error: unable to replay the log\n");
+		exit(EXIT_FAILURE);
+	}
+	if (loaded)
+		printf("loaded the checkpoint (log position %lu)\n", from);
+	if (n > 0)
+		printf("replayed %d operations from the log\n", n);
 }
 
 
@@ -30,33 +165,62 @@ void init_fs() {
  * Destroy tecnicofs and inode table.
  */
 void destroy_fs() {
+	wal_close();
 	inode_table_destroy();
+	checkpoint_close();
+	dcache_destroy();
+	openfile_table_destroy();
 }
 
 
 
 /*
- * Prints tecnicofs tree.
+ * Prints tecnicofs tree, as it is when called (see inode_snapshot_begin).
  * Input:
- *  - fp: pointer to output file
+ *  - fd: output file
+ *  - format: one of TFS_PRINT_*
+ * Returns: SUCCESS or FAIL
  */
-void print_tecnicofs_tree(FILE *fp){
-	inode_print_tree(fp, FS_ROOT, "");
+int print_tecnicofs_tree(int fd, int format){
+	unsigned long epoch = inode_snapshot_begin(NULL, NULL);
+	int res = inode_print_tree(fd, epoch, format);
+
+	inode_snapshot_end();
+	return res;
 }
 
 
 /*
- * Creates a new node given a path.
+ * Counts the levels of a path below the root.
+ * Input:
+ *  - path: the path
+ * Returns: the number of names in it
+ */
+static int path_depth(char *path) {
+	int n = 0;
+
+	for (char *c = path; *c; c++)
+		if (*c != '/' && (c == path || c[-1] == '/'))
+			n++;
+	return n;
+}
+
+
+/*
+ * Creates a new node given a path (auxiliary to create), with the tree
+ * gate locked.
  * Input:
  *  - name: path of node
  *  - nodeType: type of node
- * Returns: SUCCESS or FAIL
+ *  - w: the walk to the parent
+ *  - lsn: set to the log sequence number of the change, if made
+ * Returns: SUCCESS or FAIL (quietly, if w was blocked)
  */
-int create(char *name, type nodeType){
+static int create_aux(char *name, type nodeType, tree_walk *w, unsigned long *lsn){
 
 	int parent_inumber, child_inumber;
 	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
-	int inodes_locked[INODE_TABLE_SIZE] = {-1}, n_inodes_locked = 0;
+	int inodes_locked[MAX_INODES_LOCKED] = {-1}, n_inodes_locked = 0;
 
 	/* use for copy */
 	type pType;
@@ -66,10 +230,13 @@ int create(char *name, type nodeType){
 	split_parent_child_from_path(name_copy, &parent_name, &child_name);
 
 	/* find the parent i-number */
-	parent_inumber = lookup_aux(parent_name, inodes_locked, &n_inodes_locked, WRITE);
+	parent_inumber = lookup_aux(parent_name, inodes_locked, &n_inodes_locked, WRITE, w);
 
 	/* validation */
+	if (parent_inumber == FAIL && w->blocked != FAIL)
+		return FAIL;
 	if (parent_inumber == FAIL) {
+		fs_error = TECNICOFS_ERROR_FILE_NOT_FOUND;
 		printf("failed to create %s, invalid parent dir %s\n", name, parent_name);
 		while (n_inodes_locked > 0) {
         	if (inode_unlock(inodes_locked[--n_inodes_locked]) == FAIL)  {
@@ -84,6 +251,7 @@ int create(char *name, type nodeType){
 
 	/* validation */
 	if(pType != T_DIRECTORY) {
+		fs_error = TECNICOFS_ERROR_OTHER;
 		printf("failed to create %s, parent %s is not a dir\n",
 		        name, parent_name);
 
@@ -97,10 +265,11 @@ int create(char *name, type nodeType){
 	}
 
 	/* find the child i-number, subnode of the parent('s pdata) - with validation */
-	child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
+	child_inumber = lookup_sub_node(child_name, pdata.dir);
 
 	/* it's supposed to fail because it's not meant to be already created */
 	if ( child_inumber != FAIL) {
+		fs_error = TECNICOFS_ERROR_FILE_ALREADY_EXISTS;
 		printf("failed to create %s, already exists in dir %s\n",
 		       child_name, parent_name);
 		while (n_inodes_locked > 0) {
@@ -113,10 +282,11 @@ int create(char *name, type nodeType){
 	}
 
 	/* create node and add entry to folder that contains new node */
-	child_inumber = inode_create(nodeType, inodes_locked, &n_inodes_locked);
+	child_inumber = inode_create(nodeType, path_depth(name), inodes_locked, &n_inodes_locked);
 
 	/* validation */
 	if (child_inumber == FAIL) {
+		fs_error = TECNICOFS_ERROR_OTHER;
 		printf("failed to create %s in  %s, couldn't allocate inode\n",
 		        child_name, parent_name);
 		while (n_inodes_locked > 0) {
@@ -130,6 +300,7 @@ int create(char *name, type nodeType){
 
 	/* add entry to folder that contains created node - with validation */
 	if (dir_add_entry(parent_inumber, child_inumber, child_name) == FAIL) {
+		fs_error = TECNICOFS_ERROR_OTHER;
 		printf("could not add entry %s in dir %s\n",
 		       child_name, parent_name);
 		while (n_inodes_locked > 0) {
@@ -141,6 +312,11 @@ int create(char *name, type nodeType){
 		return FAIL;
 	}
 
+	/* the path may be cached as not found */
+	dcache_invalidate(name);
+
+	*lsn = wal_append('c', nodeType, name, NULL);
+
 	/* unlock the i-nodes locked in the travessy */
 	while (n_inodes_locked > 0) {
         if (inode_unlock(inodes_locked[--n_inodes_locked]) == FAIL) {
@@ -152,19 +328,46 @@ int create(char *name, type nodeType){
 	return SUCCESS;
 }
 
-
 /*
- * Deletes a node given a path.
+ * Creates a new node given a path.
  * Input:
  *  - name: path of node
+ *  - nodeType: type of node
  * Returns: SUCCESS or FAIL
  */
-int delete(char *name){
+int create(char *name, type nodeType){
+	unsigned long lsn;
+	tree_walk w = { .claimed = FAIL };
+	int res;
+
+	do {
+		walk_begin(&w);
+		gate_lock(READ);
+		res = create_aux(name, nodeType, &w, &lsn);
+		gate_unlock();
+	} while (walk_end(&w) == FAIL);
+
+	if (res == SUCCESS)
+		wal_commit(lsn);
+	return res;
+}
+
+
+/*
+ * Deletes a node given a path (auxiliary to delete), with the tree gate
+ * locked.
+ * Input:
+ *  - name: path of node
+ *  - w: the walk to the parent
+ *  - lsn: set to the log sequence number of the change, if made
+ * Returns: SUCCESS or FAIL (quietly, if w was blocked)
+ */
+static int delete_aux(char *name, tree_walk *w, unsigned long *lsn){
 
 	int parent_inumber, child_inumber;
 	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
 
-	int inodes_locked[INODE_TABLE_SIZE] = {-1}, n_inodes_locked = 0;
+	int inodes_locked[MAX_INODES_LOCKED] = {-1}, n_inodes_locked = 0;
 
 	/* use for copy */
 	type pType, cType;
@@ -174,10 +377,13 @@ int delete(char *name){
 	split_parent_child_from_path(name_copy, &parent_name, &child_name);
 
 	/* find the parent i-number */
-	parent_inumber = lookup_aux(parent_name, inodes_locked, &n_inodes_locked, WRITE);
+	parent_inumber = lookup_aux(parent_name, inodes_locked, &n_inodes_locked, WRITE, w);
 
 	/* validation */
+	if (parent_inumber == FAIL && w->blocked != FAIL)
+		return FAIL;
 	if (parent_inumber == FAIL) {
+		fs_error = TECNICOFS_ERROR_FILE_NOT_FOUND;
 		printf("failed to delete %s, invalid parent dir %s\n",
 		        child_name, parent_name);
 
@@ -194,6 +400,7 @@ int delete(char *name){
 
 	/* validation */
 	if(pType != T_DIRECTORY) {
+		fs_error = TECNICOFS_ERROR_OTHER;
 		printf("failed to delete %s, parent %s is not a dir\n",
 		        child_name, parent_name);
 
@@ -207,10 +414,11 @@ int delete(char *name){
 	}
 
 	/* find the child i-number, subnode of the parent('s pdata) */
-	child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
+	child_inumber = lookup_sub_node(child_name, pdata.dir);
 	
 	/* validation */
 	if (child_inumber == FAIL) {
+		fs_error = TECNICOFS_ERROR_FILE_NOT_FOUND;
 		printf("could not delete %s, does not exist in dir %s\n",
 		       name, parent_name);
 		
@@ -234,7 +442,21 @@ int delete(char *name){
 	inode_get(child_inumber, &cType, &cdata);
 
 	/* validation */
-	if (cType == T_DIRECTORY && is_dir_empty(cdata.dirEntries) == FAIL) {
+	if (cType == T_FILE && inode_is_open(child_inumber)) {
+		fs_error = TECNICOFS_ERROR_FILE_IS_OPEN;
+		printf("could not delete %s: is open\n", name);
+		while (n_inodes_locked > 0) {
+        	if (inode_unlock(inodes_locked[--n_inodes_locked]) == FAIL)  {
+				fprintf(stderr, "Error: could not unlock\n");
+				exit(EXIT_FAILURE);
+			}
+    	}
+		return FAIL;
+	}
+
+	/* validation */
+	if (cType == T_DIRECTORY && is_dir_empty(cdata.dir) == FAIL) {
+		fs_error = TECNICOFS_ERROR_OTHER;
 		printf("could not delete %s: is a directory and not empty\n",
 		       name);
 		while (n_inodes_locked > 0) {
@@ -247,7 +469,8 @@ int delete(char *name){
 	}
 
 	/* remove entry from folder that contained deleted node - with validation */
-	if (dir_reset_entry(parent_inumber, child_inumber) == FAIL) {
+	if (dir_reset_entry(parent_inumber, child_inumber, child_name) == FAIL) {
+		fs_error = TECNICOFS_ERROR_OTHER;
 		printf("failed to delete %s from dir %s\n",
 		       child_name, parent_name);
 		while (n_inodes_locked > 0) {
@@ -260,8 +483,12 @@ int delete(char *name){
 		return FAIL;
 	}
 
+	/* the path may be cached as found */
+	dcache_invalidate(name);
+
 	/* delete the i-node - with validation */
 	if (inode_delete(child_inumber) == FAIL) {
+		fs_error = TECNICOFS_ERROR_OTHER;
 		printf("could not delete inode number %d from dir %s\n",
 		       child_inumber, parent_name);
 
@@ -277,6 +504,8 @@ int delete(char *name){
 	inodes_locked[n_inodes_locked] = -1;
 	n_inodes_locked--;
 
+	*lsn = wal_append('d', T_NONE, name, NULL);
+
 	/* unlock the i-nodes locked in the travessy */
 	while (n_inodes_locked > 0) {
         if (inode_unlock(inodes_locked[--n_inodes_locked]) == FAIL)  {
@@ -284,10 +513,33 @@ int delete(char *name){
 			exit(EXIT_FAILURE);
 		}
     }
-	
+
 	return SUCCESS;
 }
 
+/*
+ * Deletes a node given a path.
+ * Input:
+ *  - name: path of node
+ * Returns: SUCCESS or FAIL
+ */
+int delete(char *name){
+	unsigned long lsn;
+	tree_walk w = { .claimed = FAIL };
+	int res;
+
+	do {
+		walk_begin(&w);
+		gate_lock(READ);
+		res = delete_aux(name, &w, &lsn);
+		gate_unlock();
+	} while (walk_end(&w) == FAIL);
+
+	if (res == SUCCESS)
+		wal_commit(lsn);
+	return res;
+}
+
 
 
 
@@ -301,11 +553,33 @@ int delete(char *name){
  */
 int lookup(char *name) {
 
-	int inodes_locked[INODE_TABLE_SIZE] = {-1}, n_inodes_locked = 0;
+	int inodes_locked[MAX_INODES_LOCKED] = {-1}, n_inodes_locked = 0;
 	int current_inumber;
 
+	char key[MAX_FILE_NAME];
+	unsigned long stamp;
+
+	/* hot paths are a single probe in the path cache */
+	int cacheable = dcache_normalize(name, key) != FAIL;
+	if (cacheable && dcache_lookup(key, &current_inumber, &stamp) == SUCCESS) {
+		if (current_inumber == FAIL)
+			fs_error = TECNICOFS_ERROR_FILE_NOT_FOUND;
+		return current_inumber;
+	}
+
+	/* read-only: try without locks first, so readers don't contend on the root */
+	for (int attempt = 0; attempt < OPTIMISTIC_RETRIES; attempt++) {
+		if (lookup_optimistic(name, &current_inumber) == SUCCESS) {
+			if (cacheable)
+				dcache_insert(key, current_inumber, stamp);
+			if (current_inumber == FAIL)
+				fs_error = TECNICOFS_ERROR_FILE_NOT_FOUND;
+			return current_inumber;
+		}
+	}
+
 	/* find the i-number using the auxiliary function */
-	current_inumber = lookup_aux(name, inodes_locked, &n_inodes_locked, READ);
+	current_inumber = lookup_aux(name, inodes_locked, &n_inodes_locked, READ, NULL);
 
 	/* unlock what we've locked */
 	while (n_inodes_locked > 0) {
@@ -314,30 +588,129 @@ int lookup(char *name) {
 			exit(EXIT_FAILURE);
         }
     }
-	
+
+	if (cacheable)
+		dcache_insert(key, current_inumber, stamp);
+
+	if (current_inumber == FAIL)
+		fs_error = TECNICOFS_ERROR_FILE_NOT_FOUND;
     return current_inumber;
 }
 
 
 
 /*
- * Removes the entry from the old_location and inserts it in the new_location
+ * Unlocks every i-node locked by an operation.
+ */
+static void unlock_all(int inodes_locked[], int *n_inodes_locked) {
+	while (*n_inodes_locked > 0) {
+		if (inode_unlock(inodes_locked[--(*n_inodes_locked)]) == FAIL) {
+			fprintf(stderr, "Error: could not unlock\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+
+/*
+ * Splits a path into the names of its nodes, below the root.
+ * Input:
+ *  - path: the path, which is altered
+ *  - names: where to store the names, top-down
+ * Returns: the number of names
+ */
+static int split_path(char *path, char *names[]) {
+	char *saveptr;
+	int n = 0;
+
+	for (char *name = strtok_r(path, "/", &saveptr); name; name = strtok_r(NULL, "/", &saveptr))
+		names[n++] = name;
+	return n;
+}
+
+/*
+ * Locks a descendant of a locked directory (auxiliary to the move
+ * command), walking down to it hand over hand like lookup_aux. The
+ * directory it starts from stays locked.
+ * Input:
+ *  - inumber: the directory to start from, already locked
+ *  - names: names of the nodes down to the descendant, top-down
+ *  - n: number of names
+ *  - p: for locking the descendant
+ *  - w: the walk, which pins the nodes let go of on the way
+ * Returns: the i-number of the descendant, locked (inumber itself if n
+ *  is 0), or FAIL if a node on the way doesn't exist or isn't a
+ *  directory, or w was blocked, with nothing more locked
+ */
+static int lock_path_below(int inumber, char *names[], int n, permission p, tree_walk *w) {
+	int current_inumber = inumber, child_inumber;
+	type nType;
+	union Data data;
+
+	for (int i = 0; i < n; i++) {
+		inode_get(current_inumber, &nType, &data);
+		if (nType != T_DIRECTORY || (child_inumber = lookup_sub_node(names[i], data.dir)) == FAIL)
+			child_inumber = FAIL;
+		else if (current_inumber != inumber && walk_pin(w, current_inumber) == FAIL)
+			child_inumber = FAIL;
+		else if (inode_lock(child_inumber, (i == n - 1) ? p : READ) == FAIL) {
+			fprintf(stderr, "Error: unable to lock %d\n", child_inumber);
+			exit(EXIT_FAILURE);
+		}
+		if (current_inumber != inumber && inode_unlock(current_inumber) == FAIL) {
+			fprintf(stderr, "Error: unable to unlock %d\n", current_inumber);
+			exit(EXIT_FAILURE);
+		}
+		if ((current_inumber = child_inumber) == FAIL)
+			return FAIL;
+	}
+	return current_inumber;
+}
+
+/*
+ * Removes the entry from the old_location and inserts it in the
+ * new_location (auxiliary to move), with the tree gate locked.
+ * The lowest common ancestor of the two parents is reached hand over
+ * hand and locked, for writing only if it is one of them. It stays
+ * locked while the two branches below it are walked down, one after the
+ * other, the one whose first node has the lower i-number first. Moves
+ * that need the same two branches lock them in the same order, so they
+ * can't deadlock, and moves in separate branches of a directory go on
+ * in parallel.
+ * Moving a directory changes the path of every node below it, so it is
+ * claimed first, and only moved once the changes that walked through it
+ * are done (see inode_move_claim). Changes elsewhere in the tree go on.
  * Input:
  * - old_location: the previous pathname
  * - new_location: the new pathname
- * Returns: SUCCESS or FAIL
+ * - w: the walk to the parents, which keeps the claim across retries
+ * - lsn: set to the log sequence number of the change, if made
+ * Returns: SUCCESS or FAIL (quietly, if w was blocked)
  */
-int move(char *old_location, char *new_location) {
-	int inodes_locked[INODE_TABLE_SIZE] = {-1}, n_inodes_locked = 0;
+static int move_aux(char *old_location, char *new_location, tree_walk *w, unsigned long *lsn) {
+	int inodes_locked[MAX_INODES_LOCKED] = {-1}, n_inodes_locked = 0;
 
 	int old_parent = -1, new_parent = -1;
 	char *old_parent_name, *new_parent_name;
-	
-	int old_child = -1, new_child = -1;
+
+	int old_child = -1;
 	char *old_child_name, *new_child_name;
 
 	char old_location_copy[MAX_FILE_NAME], new_location_copy[MAX_FILE_NAME];
 
+	/* the parents' paths split into names, and how many they share */
+	char old_parent_copy[MAX_FILE_NAME], new_parent_copy[MAX_FILE_NAME];
+	char *old_names[MAX_FILE_NAME], *new_names[MAX_FILE_NAME];
+	int n_old, n_new, n_common = 0;
+
+	/* the common ancestor and the first node of each branch below it */
+	char ancestor_name[MAX_FILE_NAME] = "";
+	int ancestor, old_first, new_first = FAIL;
+
+	/* use for copy */
+	type nType, cType;
+	union Data data;
+
 	/* get the parent and child names in old location */
 	strcpy(old_location_copy, old_location);
 	split_parent_child_from_path(old_location_copy, &old_parent_name, &old_child_name);
@@ -346,71 +719,153 @@ int move(char *old_location, char *new_location) {
 	strcpy(new_location_copy, new_location);
 	split_parent_child_from_path(new_location_copy, &new_parent_name, &new_child_name);
 
+	strcpy(old_parent_copy, old_parent_name);
+	strcpy(new_parent_copy, new_parent_name);
+	n_old = split_path(old_parent_copy, old_names);
+	n_new = split_path(new_parent_copy, new_names);
+	while (n_common < n_old && n_common < n_new && !strcmp(old_names[n_common], new_names[n_common])) {
+		strcat(ancestor_name, "/");
+		strcat(ancestor_name, old_names[n_common++]);
+	}
+
 	/* VALIDATION */
-	/* the strategy we chose to avoid deadlocks is to lock firstly the origin or the destiny depending on the alfabetical order */
-
-	int first = strcmp(old_location_copy, new_location_copy);
-	if (first > 0) { /* old location first */
-		int val_old = validation_old_location(old_location_copy, &old_child, &old_parent, old_parent_name, old_child_name, inodes_locked, &n_inodes_locked);
-		if (val_old == FAIL) {
-			printf("unable to move %s, problems with old location\n", old_location);
-			
-			/* unlock what we've locked */
-			while (n_inodes_locked > 0) {
-        		if (inode_unlock(inodes_locked[--n_inodes_locked]) != SUCCESS) {
-            		fprintf(stderr, "Error: unable to unlock\n");
-					exit(EXIT_FAILURE);
-        		}
-    		}
-			return FAIL;
-		}
-		int  val_new = validation_new_location(new_location_copy, &new_child, &new_parent, new_parent_name, new_child_name, inodes_locked, &n_inodes_locked);
-		if (val_new == FAIL) {
-			printf("unable to move %s, problems with new location %s\n", old_location, new_location);
-			
-			/* unlock what we've locked */
-			while (n_inodes_locked > 0) {
-        		if (inode_unlock(inodes_locked[--n_inodes_locked]) != SUCCESS) {
-            		fprintf(stderr, "Error: unable to unlock\n");
-					exit(EXIT_FAILURE);
-        		}
-    		}
-			return FAIL;
+
+	/* lock the common ancestor */
+	permission p = (n_common == n_old || n_common == n_new) ? WRITE : READ;
+
+	ancestor = lookup_aux(ancestor_name, inodes_locked, &n_inodes_locked, p, w);
+	if (ancestor == FAIL && w->blocked != FAIL)
+		return FAIL;
+	if (ancestor == FAIL || inode_get(ancestor, &nType, &data) == FAIL || nType != T_DIRECTORY) {
+		fs_error = TECNICOFS_ERROR_FILE_NOT_FOUND;
+		printf("unable to move %s, invalid parent dir %s\n", old_location, old_parent_name);
+		unlock_all(inodes_locked, &n_inodes_locked);
+		return FAIL;
+	}
+
+	/* the first nodes can't change while the ancestor is locked */
+	old_first = lookup_sub_node((n_common < n_old) ? old_names[n_common] : old_child_name, data.dir);
+	if (n_common < n_new)
+		new_first = lookup_sub_node(new_names[n_common], data.dir);
+
+	if (old_first == FAIL) {
+		fs_error = TECNICOFS_ERROR_FILE_NOT_FOUND;
+		printf("could not move %s, does not exist\n", old_location);
+		unlock_all(inodes_locked, &n_inodes_locked);
+		return FAIL;
+	}
+	if (n_common < n_new && new_first == FAIL) {
+		fs_error = TECNICOFS_ERROR_FILE_NOT_FOUND;
+		printf("could not move %s, invalid parent dir %s\n", old_location, new_parent_name);
+		unlock_all(inodes_locked, &n_inodes_locked);
+		return FAIL;
+	}
+
+	/* both branches start at the node moved: the new parent is below it */
+	if (old_first == new_first) {
+		fs_error = TECNICOFS_ERROR_OTHER;
+		printf("could not move %s into itself, %s\n", old_location, new_location);
+		unlock_all(inodes_locked, &n_inodes_locked);
+		return FAIL;
+	}
+
+	/* lock the branches, the one with the lower i-number first */
+	for (int i = 0; i < 2; i++) {
+		int old_branch = (new_first == FAIL || old_first < new_first) == (i == 0);
+
+		if (old_branch) {
+			old_parent = lock_path_below(ancestor, old_names + n_common, n_old - n_common, WRITE, w);
+			if (old_parent != FAIL && old_parent != ancestor)
+				inodes_locked[n_inodes_locked++] = old_parent;
+			if (w->blocked != FAIL) {
+				unlock_all(inodes_locked, &n_inodes_locked);
+				return FAIL;
+			}
+
+			/* parent has to exist and be a directory */
+			if (old_parent == FAIL || inode_get(old_parent, &nType, &data) == FAIL || nType != T_DIRECTORY) {
+				fs_error = (old_parent == FAIL) ? TECNICOFS_ERROR_FILE_NOT_FOUND : TECNICOFS_ERROR_OTHER;
+				printf("could not move %s, invalid parent dir %s\n", old_child_name, old_parent_name);
+				unlock_all(inodes_locked, &n_inodes_locked);
+				return FAIL;
+			}
+
+			/* child has to exist */
+			if ((old_child = lookup_sub_node(old_child_name, data.dir)) == FAIL) {
+				fs_error = TECNICOFS_ERROR_FILE_NOT_FOUND;
+				printf("could not move %s, does not exist in dir %s\n", old_location, old_parent_name);
+				unlock_all(inodes_locked, &n_inodes_locked);
+				return FAIL;
+			}
+
+			if (inode_lock(old_child, WRITE) == FAIL) {
+				fprintf(stderr, "Error: unable to lock\n");
+				exit(EXIT_FAILURE);
+			}
+			inodes_locked[n_inodes_locked++] = old_child;
+
+			/* a claim from a try that found another node is no use */
+			if (w->claimed != FAIL && w->claimed != old_child) {
+				inode_move_end(w->claimed);
+				w->claimed = FAIL;
+			}
+
+			/* start over once the changes below it are done */
+			inode_get(old_child, &cType, NULL);
+			if (cType == T_DIRECTORY) {
+				w->claimed = old_child;
+				if (inode_move_claim(old_child) == FAIL) {
+					w->blocked = old_child;
+					unlock_all(inodes_locked, &n_inodes_locked);
+					return FAIL;
+				}
+			}
+		} else {
+			new_parent = lock_path_below(ancestor, new_names + n_common, n_new - n_common, WRITE, w);
+			if (new_parent != FAIL && new_parent != ancestor)
+				inodes_locked[n_inodes_locked++] = new_parent;
+			if (w->blocked != FAIL) {
+				unlock_all(inodes_locked, &n_inodes_locked);
+				return FAIL;
+			}
+
+			/* parent has to exist and be a directory */
+			if (new_parent == FAIL || inode_get(new_parent, &nType, &data) == FAIL || nType != T_DIRECTORY) {
+				fs_error = (new_parent == FAIL) ? TECNICOFS_ERROR_FILE_NOT_FOUND : TECNICOFS_ERROR_OTHER;
+				printf("could not move %s, invalid parent dir %s\n", new_child_name, new_parent_name);
+				unlock_all(inodes_locked, &n_inodes_locked);
+				return FAIL;
+			}
+
+			/* child must not exist */
+			if (lookup_sub_node(new_child_name, data.dir) != FAIL) {
+				fs_error = TECNICOFS_ERROR_FILE_ALREADY_EXISTS;
+				printf("failed to move %s, already exists in dir %s\n", new_child_name, new_parent_name);
+				unlock_all(inodes_locked, &n_inodes_locked);
+				return FAIL;
+			}
 		}
-	} else { /* new location first */
-		int val_new = validation_new_location(new_location_copy, &new_child, &new_parent, new_parent_name, new_child_name, inodes_locked, &n_inodes_locked);
-		if (val_new == FAIL) {
-			printf("unable to move %s, problems with new location %s\n", old_location, new_location);
-			
-			/* unlock what we've locked */
-			while (n_inodes_locked > 0) {
-        		if (inode_unlock(inodes_locked[--n_inodes_locked]) != SUCCESS) {
-            		fprintf(stderr, "Error: unable to unlock\n");
-					exit(EXIT_FAILURE);
-        		}
-    		}
+	}
+
+	/* the ancestor was only needed to get here, unless it is a parent */
+	if (p == READ) {
+		if (walk_pin(w, ancestor) == FAIL) {
+			unlock_all(inodes_locked, &n_inodes_locked);
 			return FAIL;
 		}
-		int val_old = validation_old_location(old_location_copy, &old_child, &old_parent, old_parent_name, old_child_name, inodes_locked, &n_inodes_locked);
-		if (val_old == FAIL) {
-			printf("unable to move %s, problems with old location\n", old_location);
-			
-			/* unlock what we've locked */
-			while (n_inodes_locked > 0) {
-        		if (inode_unlock(inodes_locked[--n_inodes_locked]) != SUCCESS) {
-            		fprintf(stderr, "Error: unable to unlock\n");
-					exit(EXIT_FAILURE);
-        		}
-    		}
-			return FAIL;
+		if (inode_unlock(ancestor) == FAIL) {
+			fprintf(stderr, "Error: could not unlock\n");
+			exit(EXIT_FAILURE);
 		}
+		inodes_locked[0] = inodes_locked[--n_inodes_locked];
 	}
-	
+
 	/* EXECUTION */
-		
-	if (dir_reset_entry(old_parent, old_child) == FAIL) {
-    	printf("unable to move: failed to delete %s from dir %s\n", old_child_name, old_parent_name);    
-    	while (n_inodes_locked > 0) {    
+
+	if (dir_reset_entry(old_parent, old_child, old_child_name) == FAIL) {
+    	fs_error = TECNICOFS_ERROR_OTHER;
+    	printf("unable to move: failed to delete %s from dir %s\n", old_child_name, old_parent_name);
+    	while (n_inodes_locked > 0) {
 			if (inode_unlock(inodes_locked[--n_inodes_locked]) == FAIL) {
             	fprintf(stderr, "Error: could not unlock\n");
 				exit(EXIT_FAILURE);
@@ -418,8 +873,12 @@ int move(char *old_location, char *new_location) {
 	 	}
     	return FAIL;
 	}
-		
+
+	/* everything cached at or below the old path is stale now */
+	dcache_invalidate(old_location);
+
 	if (dir_add_entry(new_parent, old_child, new_child_name) == FAIL) {
+        fs_error = TECNICOFS_ERROR_OTHER;
         printf("unable to move: could not add entry %s in dir %s\n", new_child_name, new_parent_name);
     	while (n_inodes_locked > 0) {
         	if (inode_unlock(inodes_locked[--n_inodes_locked]) == FAIL) {
@@ -429,7 +888,16 @@ int move(char *old_location, char *new_location) {
         }
         return FAIL;
     }
-	
+
+	/* paths at or below the new one may be cached as not found */
+	dcache_invalidate(new_location);
+
+	/* it still holds the lock of its old depth */
+	if (cType == T_DIRECTORY)
+		inode_move_depth(old_child, path_depth(new_location));
+
+	*lsn = wal_append('m', cType, old_location, new_location);
+
 	/* unlock the i-nodes locked in the travessy */
 	while (n_inodes_locked > 0) {
         if (inode_unlock(inodes_locked[--n_inodes_locked]) == FAIL)  {
@@ -437,260 +905,543 @@ int move(char *old_location, char *new_location) {
 			exit(EXIT_FAILURE);
 		}
     }
+
 	return SUCCESS;
 }
 
-/** 
- * Prints the current FS state to a file
+/*
+ * Removes the entry from the old_location and inserts it in the new_location
  * Input:
- * - outputfile: the path for the file we're printing it on
+ * - old_location: the previous pathname
+ * - new_location: the new pathname
+ * Returns: SUCCESS or FAIL
  */
-int print(char *outputfile) {
-	FILE * f; 
+int move(char *old_location, char *new_location) {
+	unsigned long lsn;
+	tree_walk w = { .claimed = FAIL };
+	int res;
+
+	do {
+		walk_begin(&w);
+		gate_lock(READ);
+		res = move_aux(old_location, new_location, &w, &lsn);
+		gate_unlock();
+	} while (walk_end(&w) == FAIL);
+	inode_move_end(w.claimed);
+
+	if (res == SUCCESS)
+		wal_commit(lsn);
+	return res;
+}
 
-	/* open the file to write on */
-	if (!(f = fopen(outputfile, "w"))) {
-		perror("could not open the output file");
-		exit(EXIT_FAILURE);
+/*
+ * Applies one operation of a batch to a child of the locked directory.
+ * Input:
+ *  - parent_inumber: the directory, locked for writing
+ *  - dir: its contents
+ *  - parent: its path
+ *  - o: the operation
+ *  - lsn: set to the log sequence number of a change that was logged
+ * Returns: SUCCESS, the i-number found by a lookup, or TECNICOFS_ERROR_*
+ */
+static int batch_apply(int parent_inumber, Directory *dir, char *parent, batch_op *o, unsigned long *lsn) {
+	int child_inumber, inodes_locked[1], n_inodes_locked = 0;
+	char path[MAX_FILE_NAME];
+	type cType;
+	union Data cdata;
+
+	if (o->name[0] == '\0' || strchr(o->name, '/') ||
+	    snprintf(path, sizeof(path), "%s/%s", parent, o->name) >= sizeof(path))
+		return TECNICOFS_ERROR_OTHER;
+
+	child_inumber = lookup_sub_node(o->name, dir);
+
+	switch (o->op) {
+		case 'l':
+			return child_inumber == FAIL ? TECNICOFS_ERROR_FILE_NOT_FOUND : child_inumber;
+
+		case 'c':
+			if (child_inumber != FAIL)
+				return TECNICOFS_ERROR_FILE_ALREADY_EXISTS;
+			if ((child_inumber = inode_create(o->nodeType, path_depth(path), inodes_locked, &n_inodes_locked)) == FAIL)
+				return TECNICOFS_ERROR_OTHER;
+			if (dir_add_entry(parent_inumber, child_inumber, o->name) == FAIL) {
+				/* deleting also unlocks it */
+				if (inode_delete(child_inumber) == FAIL)
+					unlock_all(inodes_locked, &n_inodes_locked);
+				return TECNICOFS_ERROR_OTHER;
+			}
+			dcache_invalidate(path);
+			/* the parent stays locked, so the new node needn't be */
+			unlock_all(inodes_locked, &n_inodes_locked);
+			*lsn = wal_append('c', o->nodeType, path, NULL);
+			return SUCCESS;
+
+		case 'd':
+			if (child_inumber == FAIL)
+				return TECNICOFS_ERROR_FILE_NOT_FOUND;
+			if (inode_lock(child_inumber, WRITE) == FAIL) {
+				fprintf(stderr, "Error: unable to lock\n");
+				exit(EXIT_FAILURE);
+			}
+			inode_get(child_inumber, &cType, &cdata);
+			if (cType == T_FILE && inode_is_open(child_inumber)) {
+				inode_unlock(child_inumber);
+				return TECNICOFS_ERROR_FILE_IS_OPEN;
+			}
+			if ((cType == T_DIRECTORY && is_dir_empty(cdata.dir) == FAIL) ||
+			    dir_reset_entry(parent_inumber, child_inumber, o->name) == FAIL) {
+				inode_unlock(child_inumber);
+				return TECNICOFS_ERROR_OTHER;
+			}
+			dcache_invalidate(path);
+			if (inode_delete(child_inumber) == FAIL) {
+				inode_unlock(child_inumber);
+				return TECNICOFS_ERROR_OTHER;
+			}
+			*lsn = wal_append('d', T_NONE, path, NULL);
+			return SUCCESS;
+	}
+	return TECNICOFS_ERROR_OTHER;
+}
+
+/*
+ * Applies a batch of operations to children of one directory. The
+ * directory is looked up and locked once for the whole batch, instead
+ * of once per operation.
+ * Input:
+ *  - parent: path of the directory
+ *  - ops: the operations
+ *  - n: number of operations
+ *  - results: filled with the result of each operation: SUCCESS, the
+ *    i-number found by a lookup, or one of TECNICOFS_ERROR_*
+ * Returns: SUCCESS or FAIL if the directory can't be used, in which case
+ *  no operation is applied
+ */
+int batch(char *parent, batch_op ops[], int n, int results[]) {
+	int inodes_locked[MAX_INODES_LOCKED] = {-1}, n_inodes_locked = 0;
+	int parent_inumber;
+	type pType;
+	union Data pdata;
+	unsigned long lsn = 0;
+	tree_walk w = { .claimed = FAIL };
+
+	do {
+		walk_begin(&w);
+		gate_lock(READ);
+		parent_inumber = lookup_aux(parent, inodes_locked, &n_inodes_locked, WRITE, &w);
+		if (parent_inumber == FAIL)
+			gate_unlock();
+	} while (parent_inumber == FAIL && walk_end(&w) == FAIL);
+	if (parent_inumber == FAIL) {
+		printf("failed to apply batch, invalid dir %s\n", parent);
+		fs_error = TECNICOFS_ERROR_FILE_NOT_FOUND;
+		return FAIL;
+	}
+
+	inode_get(parent_inumber, &pType, &pdata);
+	if (pType != T_DIRECTORY) {
+		printf("failed to apply batch, %s is not a dir\n", parent);
+		fs_error = TECNICOFS_ERROR_OTHER;
+		unlock_all(inodes_locked, &n_inodes_locked);
+		gate_unlock();
+		walk_end(&w);
+		return FAIL;
+	}
+
+	for (int i = 0; i < n; i++) {
+		/* the directory's table may have grown */
+		inode_get(parent_inumber, &pType, &pdata);
+		results[i] = batch_apply(parent_inumber, pdata.dir, parent, &ops[i], &lsn);
+	}
+
+	/* one wait for the whole batch */
+	unlock_all(inodes_locked, &n_inodes_locked);
+	gate_unlock();
+	wal_commit(lsn);
+	walk_end(&w);
+	return SUCCESS;
+}
+
+/*
+ * Opens a file.
+ * Input:
+ *  - name: path of the file
+ *  - mode: READ, WRITE or RW
+ *  - owner: the client opening it, the only one that can use the
+ *    descriptor
+ * Returns: the file descriptor or FAIL
+ */
+int open_file(char *name, permission mode, fd_owner *owner) {
+	int inodes_locked[MAX_INODES_LOCKED] = {-1}, n_inodes_locked = 0;
+	int inumber, fd = FAIL;
+	type nType;
+
+	if (mode != READ && mode != WRITE && mode != RW) {
+		fs_error = TECNICOFS_ERROR_INVALID_MODE;
+		return FAIL;
+	}
+
+	/* the file stays locked until it counts as open, so it can't be deleted */
+	inumber = lookup_aux(name, inodes_locked, &n_inodes_locked, READ, NULL);
+	if (inumber == FAIL) {
+		fs_error = TECNICOFS_ERROR_FILE_NOT_FOUND;
+	} else if (inode_get(inumber, &nType, NULL) == FAIL || nType != T_FILE) {
+		printf("failed to open %s, not a file\n", name);
+		fs_error = TECNICOFS_ERROR_OTHER;
+	} else if ((fd = openfile_alloc(inumber, mode, owner)) == FAIL) {
+		printf("failed to open %s, too many open files\n", name);
+		fs_error = TECNICOFS_ERROR_MAXED_OPEN_FILES;
+	} else {
+		inode_open_count(inumber, 1);
 	}
 
-	/* no other operations may occur while we're printing */
-	if (inode_lock(FS_ROOT, WRITE) != SUCCESS) {
+	unlock_all(inodes_locked, &n_inodes_locked);
+	return fd;
+}
+
+
+/*
+ * Closes a file.
+ * Input:
+ *  - fd: the file descriptor
+ *  - owner: the client that opened it
+ * Returns: SUCCESS or FAIL
+ */
+int close_file(int fd, fd_owner *owner) {
+	OpenFile *f = openfile_get(fd, owner);
+
+	if (!f) {
+		fs_error = TECNICOFS_ERROR_FILE_NOT_OPEN;
+		return FAIL;
+	}
+	inode_open_count(f->inumber, -1);
+	openfile_release(f);
+	return SUCCESS;
+}
+
+
+/*
+ * Closes every file a client left open, once it unmounted or went away,
+ * so that its descriptors are free again and its files can be deleted.
+ * Input:
+ *  - owner: the client
+ * Returns: the number of files closed
+ */
+int close_files(fd_owner *owner) {
+	int n = 0;
+
+	for (int fd = 0; fd < MAX_OPEN_FILES; fd++)
+		if (close_file(fd, owner) == SUCCESS)
+			n++;
+	return n;
+}
+
+
+/*
+ * Reads from an open file.
+ * Input:
+ *  - fd: the file descriptor
+ *  - owner: the client that opened it
+ *  - offset: where to read from, or TFS_OFFSET_CURRENT for the file's
+ *    offset, which then advances
+ *  - buf: where to copy the data to
+ *  - len: most bytes to read
+ * Returns: the bytes read or FAIL
+ */
+int read_file(int fd, fd_owner *owner, long offset, char *buf, int len) {
+	OpenFile *f = openfile_get(fd, owner);
+	int res;
+
+	if (!f) {
+		fs_error = TECNICOFS_ERROR_FILE_NOT_OPEN;
+		return FAIL;
+	}
+	if (!(f->mode & READ)) {
+		openfile_put(f);
+		fs_error = TECNICOFS_ERROR_INVALID_MODE;
+		return FAIL;
+	}
+
+	if (inode_lock(f->inumber, READ) == FAIL) {
 		fprintf(stderr, "Error: unable to lock\n");
 		exit(EXIT_FAILURE);
 	}
+	res = inode_read(f->inumber, offset == TFS_OFFSET_CURRENT ? f->offset : offset, buf, len);
+	if (inode_unlock(f->inumber) == FAIL) {
+		fprintf(stderr, "Error: unable to unlock\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (res == FAIL)
+		fs_error = TECNICOFS_ERROR_OTHER;
+	else if (offset == TFS_OFFSET_CURRENT)
+		f->offset += res;
+	openfile_put(f);
+	return res;
+}
+
+
+/*
+ * Writes to an open file.
+ * Input:
+ *  - fd: the file descriptor
+ *  - owner: the client that opened it
+ *  - offset: where to write, or TFS_OFFSET_CURRENT for the file's
+ *    offset, which then advances
+ *  - buf: the data
+ *  - len: bytes to write
+ * Returns: the bytes written or FAIL
+ */
+int write_file(int fd, fd_owner *owner, long offset, char *buf, int len) {
+	OpenFile *f = openfile_get(fd, owner);
+	int res;
 
-	print_tecnicofs_tree(f); /* print to the file */
+	if (!f) {
+		fs_error = TECNICOFS_ERROR_FILE_NOT_OPEN;
+		return FAIL;
+	}
+	if (!(f->mode & WRITE)) {
+		openfile_put(f);
+		fs_error = TECNICOFS_ERROR_INVALID_MODE;
+		return FAIL;
+	}
 
-	/* the other commands may proceed now */
-	if (inode_unlock(FS_ROOT) != SUCCESS) {
+	if (inode_lock(f->inumber, WRITE) == FAIL) {
+		fprintf(stderr, "Error: unable to lock\n");
+		exit(EXIT_FAILURE);
+	}
+	res = inode_write(f->inumber, offset == TFS_OFFSET_CURRENT ? f->offset : offset, buf, len);
+	if (inode_unlock(f->inumber) == FAIL) {
 		fprintf(stderr, "Error: unable to unlock\n");
 		exit(EXIT_FAILURE);
 	}
 
-	/* close the file we wrote on */
-	if (fclose(f)) {
-		perror("could not close the output file");
-		exit(EXIT_FAILURE);
+	if (res == FAIL)
+		fs_error = TECNICOFS_ERROR_OTHER;
+	else if (offset == TFS_OFFSET_CURRENT)
+		f->offset += res;
+	openfile_put(f);
+	return res;
+}
+
+/** 
+ * Prints the current FS state to a file. Other operations go on
+ * meanwhile; the file shows the tree as it was when print started.
+ * Input:
+ * - outputfile: the path for the file we're printing it on
+ * - format: one of TFS_PRINT_*
+ * Returns: SUCCESS or FAIL
+ */
+int print(char *outputfile, int format) {
+	int fd;
+
+	if (format < TFS_PRINT_PLAIN || format > TFS_PRINT_MANIFEST) {
+		fs_error = TECNICOFS_ERROR_OTHER;
+		return FAIL;
+	}
+
+	/* open the file to write on */
+	if ((fd = open(outputfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0) {
+		perror("could not open the output file");
+		fs_error = (errno == EACCES || errno == EROFS) ? TECNICOFS_ERROR_PERMISSION_DENIED :
+		           (errno == ENOENT) ? TECNICOFS_ERROR_FILE_NOT_FOUND : TECNICOFS_ERROR_OTHER;
+		return FAIL;
+	}
+
+	/* print to the file, then close it */
+	if (print_tecnicofs_tree(fd, format) == FAIL || close(fd) < 0) {
+		perror("could not write the output file");
+		fs_error = TECNICOFS_ERROR_OTHER;
+		return FAIL;
 	}
 	
 	return SUCCESS;
 }
 
+/*
+ * Prints the current FS state into a sealed memory file, so it can be
+ * handed to a client instead of written to a path on the server.
+ * Input:
+ * - format: one of TFS_PRINT_*
+ * Returns: the descriptor of the memory file, which the caller must
+ *  close, or FAIL
+ */
+int dump(int format) {
+	int fd;
+
+	if (format < TFS_PRINT_PLAIN || format > TFS_PRINT_MANIFEST) {
+		fs_error = TECNICOFS_ERROR_OTHER;
+		return FAIL;
+	}
+	if ((fd = memfd_create("tecnicofs-dump", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0) {
+		perror("could not create the dump");
+		fs_error = TECNICOFS_ERROR_OTHER;
+		return FAIL;
+	}
+
+	/* once sealed, nobody can change the dump under the client */
+	if (print_tecnicofs_tree(fd, format) == FAIL ||
+	    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		perror("could not write the dump");
+		close(fd);
+		fs_error = TECNICOFS_ERROR_OTHER;
+		return FAIL;
+	}
+	return fd;
+}
+
 /*
  * Lookup for a given path (auxiliary funtion)
+ * The path is walked hand over hand: each i-node is locked before its
+ * parent is unlocked, so only the i-node found stays locked. The lock
+ * pins it, as deleting an i-node takes its parent's lock and its own
+ * for writing, so neither the entry nor the i-node can go in between.
  * Input:
  *  - name: path of node
  *  - inodes_locked: the i-nodes locked in the travessy
  *  - n_inodes_locked: how many i-nodes were locked in the travessy
  *  - permission: for locking the i-node corresponding to the returned i-number
+ *  - w: the walk of a change, which pins the directories let go of on
+ *    the way, or NULL
  * Returns:
  *  inumber: identifier of the i-node, if found
- *     FAIL: otherwise
+ *     FAIL: otherwise, or if w was blocked, with nothing left locked
  */
-int lookup_aux(char *name, int inodes_locked[], int *n_inodes_locked, permission p) {
+int lookup_aux(char *name, int inodes_locked[], int *n_inodes_locked, permission p, tree_walk *w) {
 
-	char full_path[MAX_FILE_NAME], last[MAX_FILE_NAME];
+	char full_path[MAX_FILE_NAME];
 	char delim[] = "/";
-	char *saveptr;
-
-	strcpy(full_path, name);
+	char *saveptr, *component, *next;
 
 	/* start at root node */
-	int current_inumber = FS_ROOT;
+	int current_inumber = FS_ROOT, child_inumber;
 
 	/* use for copy */
 	type nType;
 	union Data data;
 
-	char *newpath = strtok_r(full_path, delim, &saveptr);
+	strcpy(full_path, name);
+	component = strtok_r(full_path, delim, &saveptr);
 
-	if(!newpath) {	/* if the newpath is NULL, we're dealing with the root */
-		if(inode_lock(current_inumber, p) == FAIL){
-			fprintf(stderr, "Error: Could not lock the root!");
-			exit(EXIT_FAILURE);
-		}
+	/* if there is no component, we're dealing with the root */
+	if (inode_lock(current_inumber, component ? READ : p) == FAIL) {
+		fprintf(stderr, "Error: Could not lock the root!");
+		exit(EXIT_FAILURE);
+	}
 
-		inodes_locked[*n_inodes_locked] = current_inumber;
-        (*n_inodes_locked)++;
+	/* each time we do this we're advancing on our travessy */
+	while (component) {
+		next = strtok_r(NULL, delim, &saveptr);
 
-		/* get root inode data */
 		inode_get(current_inumber, &nType, &data);
-
-		return current_inumber;
-
-	} else { /* if it isn't, we have to do a travessy and look for the i-node */
-		if(inode_lock(current_inumber, READ)==FAIL){
-			fprintf(stderr, "Error: Could not lock the root!");
-			exit(EXIT_FAILURE);
+		if (nType != T_DIRECTORY || (child_inumber = lookup_sub_node(component, data.dir)) == FAIL) {
+			if (inode_unlock(current_inumber) == FAIL) {
+				fprintf(stderr, "Error: unable to unlock %d\n", current_inumber);
+				exit(EXIT_FAILURE);
+			}
+			return FAIL;
 		}
-		inodes_locked[*n_inodes_locked] = current_inumber;
-        (*n_inodes_locked)++;
-	}
 
-	/* get root inode data */
-	inode_get(current_inumber, &nType, &data);
-	strcpy(last, newpath);
-
-	/* start looking */
-
-	newpath = strtok_r(NULL, delim, &saveptr); /* each time we do this we're advancing on our travessy */
-	/* search for all sub nodes 
-	 * when newpath is NULL it means we've reached the end of our travessy 
-	 * when lookup_sub_node fails it means it has no subnode
-	 */ 
-	while (newpath != NULL && (current_inumber = lookup_sub_node(last, data.dirEntries)) != FAIL) {
-		if (inode_lock(current_inumber, READ) == FAIL)
+		if (walk_pin(w, current_inumber) == FAIL) {
+			if (inode_unlock(current_inumber) == FAIL) {
+				fprintf(stderr, "Error: unable to unlock %d\n", current_inumber);
+				exit(EXIT_FAILURE);
+			}
 			return FAIL;
-        
-		inodes_locked[*n_inodes_locked] = current_inumber;
-        (*n_inodes_locked)++;
+		}
 
-		strcpy(last, newpath);
-		inode_get(current_inumber, &nType, &data);
-		newpath = strtok_r(NULL, delim, &saveptr);
-		if (!newpath) break;
-    }
-	/* last inode in the path (parent) */
-	if((current_inumber = lookup_sub_node(last, data.dirEntries))!=FAIL) {
-		
-		if (inode_lock(current_inumber, p) == FAIL) {
-			fprintf(stderr, "Error: unable to lock %d\n", current_inumber);
+		/* the last i-node in the path with the permission asked for */
+		if (inode_lock(child_inumber, next ? READ : p) == FAIL) {
+			fprintf(stderr, "Error: unable to lock %d\n", child_inumber);
 			exit(EXIT_FAILURE);
-        }
-		inodes_locked[*n_inodes_locked] = current_inumber;
-        (*n_inodes_locked)++;
+		}
+		if (inode_unlock(current_inumber) == FAIL) {
+			fprintf(stderr, "Error: unable to unlock %d\n", current_inumber);
+			exit(EXIT_FAILURE);
+		}
 
-		inode_get(current_inumber, &nType, &data);
-		return current_inumber;
+		current_inumber = child_inumber;
+		component = next;
 	}
-	return FAIL;	
+
+	inodes_locked[*n_inodes_locked] = current_inumber;
+	(*n_inodes_locked)++;
+	return current_inumber;
 }
 
 
 
 /*
- * Performs validation in the old location (auxiliary to the move command).
- * there has to be a file/directory corresponding to it:
- *  - parent must exist and be a directory
- *  - child must exist
+ * Lookup for a given path without locking (auxiliary function).
+ * Every i-node on the path is read between inode_read_begin and a final
+ * inode_read_validate, done after the whole walk, so the result is the
+ * one a locked lookup would have returned at some instant of the call.
  * Input:
- *  - old_location: where we're performing validation
- *  - child_inumber: the child_inumber we're looking up
- *  - parent_inumber: the parent_inumber we're looking up
- *  - child_name: the child's name
- *  - parent_name: the parent's name
- *  - inodes_locked[]: inodes locked during validation
- *  - n_inodes_locked: number of inodes locked during validation
- * Returns: SUCCESS or FAIL
- */ 
-int validation_old_location(char *old_location, int *child_inumber, int *parent_inumber, char *parent_name, char *child_name, int inodes_locked[], int *n_inodes_locked) {
-	
-	/* use for copy */
-    type pType;
-    union Data pdata;
-
-    (*parent_inumber) = lookup_aux(parent_name, inodes_locked, n_inodes_locked, WRITE);
-    /* parent has to exist */
-    if ((*parent_inumber) == FAIL) {
-        printf("could not move %s, invalid parent dir %s\n", child_name, parent_name);
-        return FAIL;
-    }
-    inode_get((*parent_inumber), &pType, &pdata);
-    
-    /* parent has to be a directory */
-    if (pType != T_DIRECTORY) {
-        printf("failed to move %s, parent %s is not a dir\n", child_name, parent_name);
-        return FAIL;
-    }
-
-   (*child_inumber) = lookup_sub_node(child_name, pdata.dirEntries);
-
-    /* child has to exist */
-    if ((*child_inumber) == FAIL) {
-        printf("could not move %s, does not exist in dir %s\n", old_location, parent_name);
-        return FAIL;
-    }
-
-	if (inode_lock((*child_inumber), WRITE) == FAIL) {
-		fprintf(stderr, "Error: unable to lock\n");
-		exit(EXIT_FAILURE);
-    }
-
-	inodes_locked[*n_inodes_locked] = (*child_inumber);
-    (*n_inodes_locked)++;
+ *  - name: path of node
+ *  - inumber: where to store the i-number found (or FAIL if not found)
+ * Returns:
+ *  SUCCESS: if the walk was consistent
+ *     FAIL: if it overlapped with a change and must be retried
+ */
+int lookup_optimistic(char *name, int *inumber) {
 
-	return SUCCESS;
-}
+	char full_path[MAX_FILE_NAME];
+	char delim[] = "/";
+	char *saveptr, *component;
 
-/*
- * Performs validation in the new location (auxiliary to the move command).
- * there cannot be a file/directory corresponding to it:
- *  - parent must exist and be a directory
- *  - child must not exist
- * Input:
- *  - new_location: where we're performing validation
- *  - child_inumber: the child_inumber we're looking up
- *  - parent_inumber: the parent_inumber we're looking up
- *  - child_name: the child's name
- *  - parent_name: the parent's name
- *  - inodes_locked[]: inodes locked during validation
- *  - n_inodes_locked: number of inodes locked during validation
- * Returns: SUCCESS or FAIL
- */ 
-int validation_new_location(char *new_location, int *child_inumber, int *parent_inumber, char *parent_name, char *child_name, int inodes_locked[], int *n_inodes_locked) {
-	/* use for copy */
-    type pType;
-    union Data pdata;
+	/* i-nodes on the path and the sequence numbers they were read with */
+	int path[MAX_FILE_NAME];
+	unsigned int seqs[MAX_FILE_NAME];
+	int depth = 0, current_inumber = FS_ROOT, res = SUCCESS;
 
-	(*parent_inumber) = lookup_aux(parent_name, inodes_locked, n_inodes_locked, WRITE);
+	strcpy(full_path, name);
 
-    /* parent has to exist */
-    if ((*parent_inumber) == FAIL) {
-        printf("could not move %s, invalid parent dir %s\n", child_name, parent_name);
-        return FAIL;
-    }
+	if (reclaim_read_enter() == FAIL)
+		return FAIL;
 
-    inode_get((*parent_inumber), &pType, &pdata);
+	path[0] = FS_ROOT;
+	seqs[0] = inode_read_begin(FS_ROOT);
 
-    /* parent has to be a directory */
-    if (pType != T_DIRECTORY) {
-        printf("failed to move %s, parent %s is not a dir\n", child_name, parent_name);
-        return FAIL;
-    }
+	for (component = strtok_r(full_path, delim, &saveptr); component; component = strtok_r(NULL, delim, &saveptr)) {
+		/* being changed right now: don't read it */
+		if (seqs[depth] & 1) {
+			res = FAIL;
+			break;
+		}
+		if ((current_inumber = inode_lookup_racy(path[depth], seqs[depth], component)) == FAIL)
+			break;
+		depth++;
+		path[depth] = current_inumber;
+		seqs[depth] = inode_read_begin(current_inumber);
+	}
 
-    (*child_inumber) = lookup_sub_node(child_name, pdata.dirEntries);
+	for (int i = 0; res == SUCCESS && i <= depth; i++) {
+		if (inode_read_validate(path[i], seqs[i]) == FAIL)
+			res = FAIL;
+	}
 
-    /* child must not exist */
-    if ((*child_inumber) != FAIL) {
-        printf("failed to move %s, already exists in dir %s\n", child_name, parent_name);
-        return FAIL;
-    }
+	reclaim_read_exit();
 
-	return SUCCESS;
+	*inumber = current_inumber;
+	return res;
 }
 
 
-
 /*
  * Looks for node in directory entry from name.
  * Input:
  *  - name: path of node
- *  - entries: entries of directory
+ *  - dir: entries of directory
  * Returns:
  *  - inumber: found node's inumber
  *  - FAIL: if not found
  */
-int lookup_sub_node(char *name, DirEntry *entries) {
-	if (entries == NULL) {
+int lookup_sub_node(char *name, Directory *dir) {
+	if (dir == NULL) {
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (entries[i].inumber != FREE_INODE && strcmp(entries[i].name, name) == 0) {
-            return entries[i].inumber;
-        }
-    }
-	return FAIL;
+	return directory_lookup(dir, name);
 }
 
 
@@ -698,19 +1449,14 @@ int lookup_sub_node(char *name, DirEntry *entries) {
 /*
  * Checks if content of directory is not empty.
  * Input:
- *  - entries: entries of directory
+ *  - dir: entries of directory
  * Returns: SUCCESS or FAIL
  */
 
-int is_dir_empty(DirEntry *dirEntries) {
-	if (dirEntries == NULL) {
+int is_dir_empty(Directory *dir) {
+	if (dir == NULL || dir->n_live > 0) {
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-		if (dirEntries[i].inumber != FREE_INODE) {
-			return FAIL;
-		}
-	}
 	return SUCCESS;
 }
 
@@ -730,7 +1476,7 @@ void split_parent_child_from_path(char * path, char ** parent, char ** child) {
 	int len = strlen(path);
 
 	// deal with trailing slash ( a/x vs a/x/ )
-	if (path[len-1] == '/') {
+	if (len > 0 && path[len-1] == '/') {
 		path[len-1] = '\0';
 	}
 
@@ -1,22 +1,51 @@
 #ifndef FS_H
 #define FS_H
 #include "state.h"
+#include "openfile.h"
+
+/* reason of the last failed operation of the calling thread */
+extern __thread int fs_error;
 
 void init_fs();
 void destroy_fs();
-void print_tecnicofs_tree(FILE *fp);
+int print_tecnicofs_tree(int fd, int format);
+
+/* one operation of a batch, on a child of the batch's directory */
+typedef struct batch_op {
+	char op;        /* 'c', 'd' or 'l' */
+	type nodeType;  /* of a create */
+	char *name;     /* name of the child */
+} batch_op;
+
+/*
+ * A walk of the tree by a change. The directories it walked through and
+ * let go of stay pinned until it is done (see inode_pin), so none of
+ * them can be moved before the change logs the path it took.
+ */
+typedef struct tree_walk {
+	int pinned[MAX_FILE_NAME];
+	int n_pinned;
+	int blocked;    /* directory whose move stopped the walk, or FAIL */
+	int claimed;    /* directory claimed to move it, or FAIL */
+} tree_walk;
 
 int create(char *name, type nodeType);
 int delete(char *name);
 int lookup(char *name);
 int move(char *old_location, char *new_location);
-int print(char *outputfile);
+int batch(char *parent, batch_op ops[], int n, int results[]);
+int open_file(char *name, permission mode, fd_owner *owner);
+int close_file(int fd, fd_owner *owner);
+int close_files(fd_owner *owner);
+int read_file(int fd, fd_owner *owner, long offset, char *buf, int len);
+int write_file(int fd, fd_owner *owner, long offset, char *buf, int len);
+int print(char *outputfile, int format);
+int dump(int format);
 
-int lookup_aux(char *name, int inodes_locked[], int *n_inodes_locked, permission p);
-int validation_old_location(char *old_location, int *child_inumber, int *parent_inumber, char *parent_name,char *child_name, int inodes_locked[], int *n_inodes_locked);
-int validation_new_location(char *new_location, int *child_inumber, int *parent_inumber, char *parent_name,char *child_name, int inodes_locked[], int *n_inodes_locked);
-int lookup_sub_node(char *name, DirEntry *entries);
-int is_dir_empty(DirEntry *dirEntries);
+int lookup_aux(char *name, int inodes_locked[], int *n_inodes_locked, permission p, tree_walk *w);
+int lookup_optimistic(char *name, int *inumber);
+int lookup_sub_node(char *name, Directory *dir);
+int is_dir_empty(Directory *dir);
 void split_parent_child_from_path(char * path, char ** parent, char ** child);
 
 #endif /* FS_H */
@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include "reclaim.h"
+#include "state.h"
+
+/*
+ * Epoch-based reclamation. A global epoch only moves on once every
+ * thread inside a read section has entered it in the current epoch.
+ * A block retired in epoch e can then only be seen by readers of epochs
+ * e - 1 and e, so it is freed when the epoch becomes e + 2. Until then
+ * it waits in the limbo list of e, one of three used in turn.
+ */
+
+/* a reader slot holds its epoch shifted left, with this bit set while inside */
+#define READER_ACTIVE 1UL
+/* bits in a word of the map of taken reader slots */
+#define SLOT_BITS (8 * sizeof(unsigned long))
+
+/*
+ * Per-thread read section state, padded to a cache line so readers
+ * never share one.
+ */
+typedef struct reader_slot {
+	unsigned long state;
+	char pad[64 - sizeof(unsigned long)];
+} reader_slot;
+
+/* a retired block, and the slab cache it goes back to (NULL for malloc) */
+typedef struct retired_block {
+	void *ptr;
+	slab_cache *cache;
+} retired_block;
+
+/* blocks retired in one epoch */
+typedef struct limbo_list {
+	retired_block *blocks;
+	int n, cap;
+} limbo_list;
+
+static reader_slot readers[RECLAIM_MAX_THREADS];
+static unsigned long taken[RECLAIM_MAX_THREADS / SLOT_BITS]; /* slots of live threads */
+static int n_readers = 0;        /* highest slot ever taken, plus one */
+static __thread int my_reader = -1;
+
+/* gives the slot of a thread back when it exits */
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+static unsigned long global_epoch = 0;
+
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static limbo_list limbo[3];
+static int since_advance = 0;    /* blocks retired since the epoch last moved */
+static epoch_stats stats;
+
+
+/*
+ * Frees the reader slot of an exiting thread, for another to take.
+ */
+static void thread_exit(void *slot) {
+	int r = (long) slot - 1;
+
+	__atomic_store_n(&readers[r].state, 0, __ATOMIC_RELEASE);
+	__atomic_fetch_and(&taken[r / SLOT_BITS], ~(1UL << (r % SLOT_BITS)), __ATOMIC_RELEASE);
+}
+
+static void exit_key_create() {
+	if (pthread_key_create(&exit_key, thread_exit)) {
+		fprintf(stderr, "Error: unable to create a thread key\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ * Takes a free reader slot for the calling thread, until it exits.
+ * Returns: the slot, or -1 if RECLAIM_MAX_THREADS threads hold one
+ */
+static int take_slot() {
+	for (int w = 0; w < RECLAIM_MAX_THREADS / SLOT_BITS; w++) {
+		unsigned long bits = __atomic_load_n(&taken[w], __ATOMIC_RELAXED);
+
+		while (~bits) {
+			int r = w * SLOT_BITS + __builtin_ctzl(~bits);
+			if (!__atomic_compare_exchange_n(&taken[w], &bits, bits | (1UL << (r % SLOT_BITS)),
+			                                 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				continue;
+
+			/* try_advance looks at every slot below n_readers */
+			int n = __atomic_load_n(&n_readers, __ATOMIC_RELAXED);
+			while (n <= r && !__atomic_compare_exchange_n(&n_readers, &n, r + 1,
+			                                              0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+				;
+			pthread_once(&exit_once, exit_key_create);
+			pthread_setspecific(exit_key, (void *) (long) (r + 1));
+			return r;
+		}
+	}
+	return -1;
+}
+
+
+/*
+ * Enters a read section.
+ * Returns: SUCCESS, or FAIL if the thread could not get a reader slot
+ *          (the caller must then use the locking path)
+ */
+int reclaim_read_enter() {
+	if (my_reader == -1 && (my_reader = take_slot()) == -1)
+		return FAIL;
+	unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+	__atomic_store_n(&readers[my_reader].state, (epoch << 1) | READER_ACTIVE, __ATOMIC_RELAXED);
+	/* the epoch must be visible before any shared pointer is loaded */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return SUCCESS;
+}
+
+
+/*
+ * Leaves a read section.
+ */
+void reclaim_read_exit() {
+	__atomic_store_n(&readers[my_reader].state, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Moves the global epoch on, unless a reader is still inside a read
+ * section entered in an older one. The caller holds retire_lock.
+ * Input:
+ *  - done: set to the limbo list that became safe to free, which the
+ *    caller frees after unlocking
+ * Returns: SUCCESS or FAIL
+ */
+static int try_advance(limbo_list *done) {
+	unsigned long epoch = global_epoch;
+
+	/* pairs with the fence in reclaim_read_enter */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	int n = __atomic_load_n(&n_readers, __ATOMIC_ACQUIRE);
+	if (n > RECLAIM_MAX_THREADS)
+		n = RECLAIM_MAX_THREADS;
+
+	for (int r = 0; r < n; r++) {
+		unsigned long state = __atomic_load_n(&readers[r].state, __ATOMIC_ACQUIRE);
+		if ((state & READER_ACTIVE) && (state >> 1) != epoch) {
+			stats.stalls++;
+			return FAIL;
+		}
+	}
+
+	__atomic_store_n(&global_epoch, epoch + 1, __ATOMIC_RELEASE);
+	stats.advances++;
+	since_advance = 0;
+
+	/* retired in epoch - 1, two epochs ago from now */
+	*done = limbo[(epoch + 2) % 3];
+	limbo[(epoch + 2) % 3] = (limbo_list) { NULL, 0, 0 };
+	stats.pending -= done->n;
+	stats.freed += done->n;
+	return SUCCESS;
+}
+
+
+/*
+ * Frees the blocks of a limbo list taken off by try_advance.
+ */
+static void limbo_free(limbo_list *done) {
+	for (int i = 0; i < done->n; i++) {
+		if (done->blocks[i].cache)
+			slab_free(done->blocks[i].cache, done->blocks[i].ptr);
+		else
+			free(done->blocks[i].ptr);
+	}
+	free(done->blocks);
+	*done = (limbo_list) { NULL, 0, 0 };
+}
+
+
+/*
+ * Frees a block once no reader can reach it any more. It never waits
+ * for readers, unless RECLAIM_MAX_PENDING blocks are already waiting to
+ * be freed; then it waits until the epoch can move on, which read
+ * sections, never blocking, allow soon.
+ * The block must already be unlinked from every shared structure.
+ * Input:
+ *  - ptr: the block (may be NULL)
+ *  - cache: the slab cache it came from, NULL if from malloc
+ */
+static void retire(void *ptr, slab_cache *cache) {
+	limbo_list done = { NULL, 0, 0 };
+
+	if (!ptr)
+		return;
+
+	pthread_mutex_lock(&retire_lock);
+	limbo_list *l = &limbo[global_epoch % 3];
+	if (l->n == l->cap) {
+		l->cap = l->cap ? 2 * l->cap : RECLAIM_BATCH;
+		if (!(l->blocks = realloc(l->blocks, sizeof(retired_block) * l->cap))) {
+			fprintf(stderr, "Error: no memory to retire a block\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	l->blocks[l->n++] = (retired_block) { ptr, cache };
+	stats.retired++;
+	stats.pending++;
+
+	if (++since_advance >= RECLAIM_BATCH)
+		try_advance(&done);
+
+	if (stats.pending > RECLAIM_MAX_PENDING) {
+		stats.waits++;
+		while (stats.pending > RECLAIM_MAX_PENDING) {
+			limbo_free(&done);
+			if (try_advance(&done) == FAIL) {
+				pthread_mutex_unlock(&retire_lock);
+				sched_yield();
+				pthread_mutex_lock(&retire_lock);
+			}
+		}
+	}
+	pthread_mutex_unlock(&retire_lock);
+
+	limbo_free(&done);
+}
+
+/*
+ * Frees a block taken from malloc once no reader can reach it any more
+ * (see retire).
+ * Input:
+ *  - ptr: the block (may be NULL)
+ */
+void reclaim_retire(void *ptr) {
+	retire(ptr, NULL);
+}
+
+/*
+ * Gives an object back to its slab cache once no reader can reach it any
+ * more (see retire).
+ * Input:
+ *  - ptr: the object (may be NULL)
+ *  - cache: its cache
+ */
+void reclaim_retire_slab(void *ptr, slab_cache *cache) {
+	retire(ptr, cache);
+}
+
+
+/*
+ * Frees every retired block. Only safe when no read section can be active
+ * (e.g. when the file system is destroyed).
+ */
+void reclaim_flush() {
+	pthread_mutex_lock(&retire_lock);
+	for (int i = 0; i < 3; i++) {
+		stats.freed += limbo[i].n;
+		limbo_free(&limbo[i]);
+	}
+	stats.pending = 0;
+	since_advance = 0;
+	pthread_mutex_unlock(&retire_lock);
+}
+
+
+/*
+ * Fills in the counters of the reclamation.
+ * Input:
+ *  - s: where to store them
+ */
+void reclaim_stats(epoch_stats *s) {
+	pthread_mutex_lock(&retire_lock);
+	*s = stats;
+	s->epoch = global_epoch;
+	pthread_mutex_unlock(&retire_lock);
+}
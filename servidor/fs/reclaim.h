@@ -0,0 +1,41 @@
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+#include "slab.h"
+
+/*
+ * Deferred freeing for memory that lock-free readers may still be using.
+ * Optimistic readers bracket their accesses with reclaim_read_enter() and
+ * reclaim_read_exit(); writers hand unlinked blocks to reclaim_retire()
+ * (or reclaim_retire_slab(), for objects of a slab cache), which frees
+ * them only once every reader that could have seen them has left its
+ * read section (epoch-based: see reclaim.c). Read sections must never
+ * block.
+ */
+
+/* maximum number of live threads that can use read sections */
+#define RECLAIM_MAX_THREADS 256
+/* retired blocks after which the epoch is moved on */
+#define RECLAIM_BATCH 1024
+/* retired blocks waiting to be freed after which reclaim_retire waits */
+#define RECLAIM_MAX_PENDING (64 * RECLAIM_BATCH)
+
+/* counters of the reclamation, see reclaim_stats */
+typedef struct epoch_stats {
+	unsigned long epoch;
+	long retired;     /* blocks handed to reclaim_retire */
+	long freed;
+	long pending;     /* retired and not yet freed */
+	long advances;    /* times the epoch moved on */
+	long stalls;      /* times a reader in an older epoch held it back */
+	long waits;       /* times reclaim_retire waited, over RECLAIM_MAX_PENDING */
+} epoch_stats;
+
+int reclaim_read_enter();
+void reclaim_read_exit();
+void reclaim_retire(void *ptr);
+void reclaim_retire_slab(void *ptr, slab_cache *cache);
+void reclaim_flush();
+void reclaim_stats(epoch_stats *s);
+
+#endif /* RECLAIM_H */
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "serialize.h"
+#include "state.h"
+
+
+/*
+ * Writes bytes to the output file, remembering the first error.
+ */
+static void write_out(tree_writer *w, const char *data, size_t len) {
+	while (len > 0 && !w->error) {
+		ssize_t n = write(w->fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			w->error = errno;
+		} else {
+			data += n;
+			len -= n;
+		}
+	}
+}
+
+/*
+ * Appends bytes to the output. Once a write failed, nothing more is.
+ */
+static void put(tree_writer *w, const char *data, size_t len) {
+	if (w->error)
+		return;
+	if (w->fd < 0 && len > w->cap - w->len) {
+		/* a part: the buffer grows */
+		size_t cap = w->cap ? w->cap : 4096;
+		char *buf;
+		while (len > cap - w->len)
+			cap *= 2;
+		if (!(buf = realloc(w->buf, cap))) {
+			w->error = ENOMEM;
+			return;
+		}
+		w->buf = buf;
+		w->cap = cap;
+	}
+	if (len > w->cap - w->len) {
+		write_out(w, w->buf, w->len);
+		w->len = 0;
+	}
+	if (len > w->cap) {
+		write_out(w, data, len);
+		return;
+	}
+	memcpy(w->buf + w->len, data, len);
+	w->len += len;
+}
+
+static void put_str(tree_writer *w, const char *s) {
+	put(w, s, strlen(s));
+}
+
+/*
+ * Appends a name as a JSON string.
+ */
+static void put_json_string(tree_writer *w, const char *s, size_t len) {
+	char esc[8];
+
+	put(w, "\"", 1);
+	for (size_t i = 0, start = 0; i <= len; i++) {
+		unsigned char c = (i < len) ? s[i] : 0;
+		if (i < len && c >= 0x20 && c != '"' && c != '\\')
+			continue;
+		put(w, s + start, i - start);
+		start = i + 1;
+		if (i == len)
+			break;
+		if (c == '"' || c == '\\')
+			snprintf(esc, sizeof(esc), "\\%c", c);
+		else
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+		put_str(w, esc);
+	}
+	put(w, "\"", 1);
+}
+
+
+/*
+ * Starts the output of a walk.
+ * Input:
+ *  - w: the writer
+ *  - fd: where the output goes
+ *  - format: one of TFS_PRINT_*
+ *  - buf, cap: the buffer to use
+ */
+void tree_begin(tree_writer *w, int fd, int format, char *buf, size_t cap) {
+	w->fd = fd;
+	w->format = format;
+	w->buf = buf;
+	w->len = 0;
+	w->cap = cap;
+	w->comma = 0;
+	w->error = 0;
+
+	if (format == TFS_PRINT_MANIFEST) {
+		tfs_manifest_header hdr = { TFS_MANIFEST_MAGIC, TFS_MANIFEST_VERSION, 0 };
+		put(w, (char *) &hdr, sizeof(hdr));
+	}
+}
+
+/*
+ * Starts a part: output kept in memory, to be given to tree_append. A
+ * part has no header nor end of its own.
+ * Input:
+ *  - w: the writer
+ *  - format: one of TFS_PRINT_*
+ *  - comma: whether nodes came before the part's first one, as siblings
+ */
+void tree_begin_part(tree_writer *w, int format, int comma) {
+	w->fd = -1;
+	w->format = format;
+	w->buf = NULL;
+	w->len = 0;
+	w->cap = 0;
+	w->comma = comma;
+	w->error = 0;
+}
+
+/*
+ * Appends the output of a part, which is released.
+ * Input:
+ *  - w: the writer
+ *  - part: the part, as its last node left it
+ */
+void tree_append(tree_writer *w, tree_writer *part) {
+	if (part->error && !w->error)
+		w->error = part->error;
+	put(w, part->buf, part->len);
+	w->comma = part->comma;
+	free(part->buf);
+	part->buf = NULL;
+}
+
+/*
+ * Outputs a node. A directory stays open, for its children, until
+ * tree_leave.
+ * Input:
+ *  - w: the writer
+ *  - path, path_len: full path of the node ("" for the root)
+ *  - name_len: length of its name, at the end of path
+ *  - depth: 0 for the root, 1 for its children and so on
+ *  - nodeType: T_FILE or T_DIRECTORY
+ */
+void tree_node(tree_writer *w, char *path, size_t path_len, size_t name_len, int depth, type nodeType) {
+	char *name = path + path_len - name_len;
+
+	switch (w->format) {
+		case TFS_PRINT_PLAIN:
+			put(w, path, path_len);
+			put(w, "\n", 1);
+			break;
+
+		case TFS_PRINT_JSON:
+			if (w->comma)
+				put(w, ",", 1);
+			put_str(w, "{\"name\":");
+			put_json_string(w, name, name_len);
+			if (nodeType == T_DIRECTORY) {
+				put_str(w, ",\"type\":\"directory\",\"children\":[");
+				w->comma = 0;
+			} else {
+				put_str(w, ",\"type\":\"file\"}");
+				w->comma = 1;
+			}
+			break;
+
+		case TFS_PRINT_MANIFEST: {
+			tfs_manifest_entry e = { nodeType, 0, name_len, depth };
+			put(w, (char *) &e, sizeof(e));
+			put(w, name, name_len);
+			break;
+		}
+	}
+}
+
+/*
+ * Closes the directory given last to tree_node and not closed yet.
+ */
+void tree_leave(tree_writer *w) {
+	if (w->format == TFS_PRINT_JSON) {
+		put(w, "]}", 2);
+		w->comma = 1;
+	}
+}
+
+/*
+ * Ends the output and writes out whatever is left of it.
+ * Returns: SUCCESS, or FAIL if a write failed (errno tells why)
+ */
+int tree_end(tree_writer *w) {
+	if (w->format == TFS_PRINT_JSON) {
+		put(w, "\n", 1);
+	} else if (w->format == TFS_PRINT_MANIFEST) {
+		tfs_manifest_entry e = { T_NONE, 0, 0, 0 };
+		put(w, (char *) &e, sizeof(e));
+	}
+	write_out(w, w->buf, w->len);
+	w->len = 0;
+
+	if (w->error) {
+		errno = w->error;
+		return FAIL;
+	}
+	return SUCCESS;
+}
@@ -0,0 +1,35 @@
+#ifndef SERIALIZE_H
+#define SERIALIZE_H
+
+#include <stddef.h>
+#include "../tecnicofs-api-constants.h"
+
+/* output buffered by a print before it is written out */
+#define TREE_BUFFER_SIZE (1 << 20)
+
+/*
+ * Output of a tree walk in one of the print formats (TFS_PRINT_*).
+ * Nodes come in preorder: tree_node opens a directory and tree_leave
+ * closes it once its children were given. What they produce is appended
+ * to a buffer that is written out each time it fills, so even a large
+ * tree takes a few big writes. A part (tree_begin_part) instead keeps
+ * all of its output in a buffer that grows, to be appended to another
+ * writer later: subtrees printed apart are joined in order that way.
+ */
+typedef struct tree_writer {
+	int fd;        /* -1 for a part */
+	int format;
+	char *buf;
+	size_t len, cap;
+	int comma;     /* JSON: a sibling came before the next node */
+	int error;     /* errno of a failed write, or 0 */
+} tree_writer;
+
+void tree_begin(tree_writer *w, int fd, int format, char *buf, size_t cap);
+void tree_begin_part(tree_writer *w, int format, int comma);
+void tree_append(tree_writer *w, tree_writer *part);
+void tree_node(tree_writer *w, char *path, size_t path_len, size_t name_len, int depth, type nodeType);
+void tree_leave(tree_writer *w);
+int tree_end(tree_writer *w);
+
+#endif /* SERIALIZE_H */
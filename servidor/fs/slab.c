@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "slab.h"
+#include "state.h"
+
+/* memory taken from malloc at a time, with the objects after the header */
+typedef struct slab_chunk {
+	struct slab_chunk *next;
+	char pad[SLAB_ALIGN - sizeof(struct slab_chunk *)];
+} slab_chunk;
+
+/* free objects a thread keeps of one cache */
+typedef struct slab_local {
+	void *free;
+	int n;
+	unsigned int gen;   /* of the cache, when they were taken */
+} slab_local;
+
+static __thread slab_local locals[SLAB_MAX_CACHES];
+
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static slab_cache *caches[SLAB_MAX_CACHES];
+static int n_caches = 0;
+
+/* gives the objects of a thread back when it exits */
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+static __thread int exit_registered = 0;
+
+
+/*
+ * Links n objects from a list (of at least n) onto the depot.
+ * Input:
+ *  - c: the cache
+ *  - list: where the list starts, set to what is left of it
+ *  - n: how many to move
+ */
+static void depot_put(slab_cache *c, void **list, int n) {
+	void *first = *list, *last = first;
+
+	for (int i = 1; i < n; i++)
+		last = *(void **) last;
+	*list = *(void **) last;
+
+	pthread_mutex_lock(&c->lock);
+	*(void **) last = c->free;
+	c->free = first;
+	pthread_mutex_unlock(&c->lock);
+}
+
+
+/*
+ * Gives every free object the exiting thread kept back to the depots.
+ */
+static void thread_exit(void *unused) {
+	int n = __atomic_load_n(&n_caches, __ATOMIC_RELAXED);
+
+	for (int id = 0; id < n; id++) {
+		slab_local *l = &locals[id];
+
+		if (l->n && l->gen == caches[id]->gen)
+			depot_put(caches[id], &l->free, l->n);
+		l->n = 0;
+	}
+}
+
+static void exit_key_create() {
+	if (pthread_key_create(&exit_key, thread_exit)) {
+		fprintf(stderr, "Error: unable to create a thread key\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+/*
+ * Returns the free objects the calling thread keeps of a cache, giving
+ * the cache its per-thread lists on first use.
+ */
+static slab_local *local_of(slab_cache *c) {
+	int id = __atomic_load_n(&c->id, __ATOMIC_ACQUIRE);
+
+	if (id == -1) {
+		pthread_mutex_lock(&caches_lock);
+		if ((id = c->id) == -1) {
+			if (n_caches == SLAB_MAX_CACHES) {
+				fprintf(stderr, "Error: too many slab caches\n");
+				exit(EXIT_FAILURE);
+			}
+			id = n_caches++;
+			caches[id] = c;
+			__atomic_store_n(&c->id, id, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&caches_lock);
+	}
+
+	slab_local *l = &locals[id];
+	if (l->gen != c->gen) {
+		/* first use by the thread, or the cache was destroyed since */
+		l->free = NULL;
+		l->n = 0;
+		l->gen = c->gen;
+		if (!exit_registered) {
+			pthread_once(&exit_once, exit_key_create);
+			pthread_setspecific(exit_key, locals);
+			exit_registered = 1;
+		}
+	}
+	return l;
+}
+
+
+/*
+ * Fills the empty list of a thread with up to SLAB_BATCH objects from the
+ * depot, which takes a chunk from malloc if it has none.
+ * Input:
+ *  - c: the cache
+ *  - l: the thread's list
+ * Returns: SUCCESS or FAIL if out of memory
+ */
+static int refill(slab_cache *c, slab_local *l) {
+	pthread_mutex_lock(&c->lock);
+	if (!c->free) {
+		slab_chunk *chunk = malloc(sizeof(slab_chunk) + c->size * SLAB_CHUNK);
+
+		if (!chunk) {
+			pthread_mutex_unlock(&c->lock);
+			return FAIL;
+		}
+		chunk->next = c->chunks;
+		c->chunks = chunk;
+		for (int i = SLAB_CHUNK - 1; i >= 0; i--) {
+			void *obj = (char *) (chunk + 1) + c->size * i;
+			*(void **) obj = c->free;
+			c->free = obj;
+		}
+	}
+
+	void *last = c->free;
+	int n = 1;
+	while (n < SLAB_BATCH && *(void **) last) {
+		last = *(void **) last;
+		n++;
+	}
+	l->free = c->free;
+	c->free = *(void **) last;
+	*(void **) last = NULL;
+	l->n = n;
+	pthread_mutex_unlock(&c->lock);
+	return SUCCESS;
+}
+
+
+/*
+ * Takes an object from a cache.
+ * Input:
+ *  - c: the cache
+ * Returns: the object (uninitialized), or NULL if out of memory
+ */
+void *slab_alloc(slab_cache *c) {
+	slab_local *l = local_of(c);
+	void *obj;
+
+	if (!l->free && refill(c, l) == FAIL)
+		return NULL;
+	obj = l->free;
+	l->free = *(void **) obj;
+	l->n--;
+	return obj;
+}
+
+
+/*
+ * Gives an object back to its cache. Any thread may give back an object,
+ * whichever took it.
+ * Input:
+ *  - c: the cache
+ *  - obj: the object (may be NULL)
+ */
+void slab_free(slab_cache *c, void *obj) {
+	slab_local *l;
+
+	if (!obj)
+		return;
+	l = local_of(c);
+	*(void **) obj = l->free;
+	l->free = obj;
+	if (++l->n > SLAB_LOCAL_MAX) {
+		depot_put(c, &l->free, SLAB_BATCH);
+		l->n -= SLAB_BATCH;
+	}
+}
+
+
+/*
+ * Gives every chunk of a cache back to malloc. No object of it may be in
+ * use anymore; the cache can be used again afterwards.
+ * Input:
+ *  - c: the cache
+ */
+void slab_cache_destroy(slab_cache *c) {
+	pthread_mutex_lock(&c->lock);
+	while (c->chunks) {
+		slab_chunk *chunk = c->chunks;
+		c->chunks = chunk->next;
+		free(chunk);
+	}
+	c->free = NULL;
+	/* drops what threads kept, without touching them */
+	__atomic_add_fetch(&c->gen, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&c->lock);
+}
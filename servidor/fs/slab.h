@@ -0,0 +1,46 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Caches of fixed-size objects (directories, their first tables, file
+ * contents and their extents) that would otherwise go to malloc on every create and back
+ * on every delete. Each thread keeps up to SLAB_LOCAL_MAX free objects of
+ * a cache to itself, taken and given without a lock; past that they go
+ * back to the cache's shared depot, SLAB_BATCH at a time. The depot takes
+ * memory from malloc SLAB_CHUNK objects at a time and only gives it back
+ * in slab_cache_destroy.
+ */
+
+/* objects moved between a thread and the depot at a time */
+#define SLAB_BATCH 32
+/* free objects a thread keeps of each cache */
+#define SLAB_LOCAL_MAX (2 * SLAB_BATCH)
+/* objects the depot takes from malloc at a time */
+#define SLAB_CHUNK 256
+/* caches there can be */
+#define SLAB_MAX_CACHES 8
+
+/* objects are aligned as malloc aligns them */
+#define SLAB_ALIGN 16
+
+typedef struct slab_cache {
+	size_t size;            /* of an object, rounded up to SLAB_ALIGN */
+	int id;                 /* of the per-thread lists, -1 until first used */
+	unsigned int gen;       /* bumped when destroyed: older per-thread lists are dropped */
+	pthread_mutex_t lock;   /* of the depot */
+	void *free;             /* free objects, linked through their first bytes */
+	struct slab_chunk *chunks;
+} slab_cache;
+
+#define SLAB_CACHE_INIT(objsize) { \
+	.size = ((objsize) + SLAB_ALIGN - 1) & ~(size_t) (SLAB_ALIGN - 1), \
+	.id = -1, .gen = 1, .lock = PTHREAD_MUTEX_INITIALIZER }
+
+void *slab_alloc(slab_cache *c);
+void slab_free(slab_cache *c, void *obj);
+void slab_cache_destroy(slab_cache *c);
+
+#endif /* SLAB_H */
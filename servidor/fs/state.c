@@ -2,32 +2,250 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sched.h>
 #include "state.h"
+#include "inject.h"
+#include "reclaim.h"
+#include "serialize.h"
 #include "../tecnicofs-api-constants.h"
 
-inode_t inode_table[INODE_TABLE_SIZE];
+/* end of a free list */
+#define FREE_LIST_END -1
+
+/*
+ * One shard of the i-node table: a directory of lazily allocated chunks.
+ * Chunk pointers are published with release stores and never change
+ * afterwards, so readers need no lock to reach an i-node.
+ * Free slots form a lock-free stack threaded through inode_t.next_free.
+ * The head packs a version tag (high 32 bits) with the top slot (low 32
+ * bits); the tag changes on every update so a stale CAS cannot succeed.
+ */
+typedef struct inode_shard {
+    inode_t *chunks[INODE_MAX_CHUNKS];
+    int n_chunks;
+    pthread_mutex_t grow_lock;
+    unsigned long long free_head;
+    long n_free;
+} inode_shard;
+
+#define FREE_HEAD(tag, slot) (((unsigned long long) (tag) << 32) | (unsigned int) (slot))
+#define FREE_HEAD_TAG(head) ((unsigned int) ((head) >> 32))
+#define FREE_HEAD_SLOT(head) ((int) (unsigned int) (head))
+
+static inode_shard *shards;
+static int n_shards;
+
+/* shard used by the calling thread for new i-nodes (assigned on first use) */
+static __thread int my_shard = -1;
+static int next_shard = 0;
+
+/* its address tells the calling thread apart as a mover (see inode_move_claim) */
+static __thread char me;
+
+/*
+ * The snapshot running (0 if none) and the last one taken, see
+ * inode_snapshot_begin. Directories deleted while one runs are parked.
+ */
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long snap_epoch = 0, last_epoch = 0;
+static pthread_mutex_t parked_lock = PTHREAD_MUTEX_INITIALIZER;
+static Directory **parked;
+static int n_parked, parked_cap;
+
+/*
+ * Held for reading by each change to the tree for as long as it lasts,
+ * and for writing by what must wait for those under way: snapshots and
+ * checkpoints (see inode_gate_lock). Every change takes it, so it is a
+ * big-reader lock: changes only touch their own CPU's slot. A writer
+ * turns new readers away, so a steady stream of changes can't starve it.
+ */
+static brlock *tree_gate;
+
+/*
+ * Directories less than this many levels below the root (the root is
+ * level 0) get a big-reader lock when created (see inode_bias_levels).
+ */
+static int bias_levels = 2;
+
+
+/*
+ * Returns the i-node with the given i-number.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns:
+ *  - pointer to the i-node, if its chunk was already allocated
+ *  - NULL: otherwise
+ */
+static inode_t *inode_ref(int inumber) {
+    if (inumber < 0)
+        return NULL;
+
+    int local = inumber / n_shards;
+    int chunk = local / INODE_CHUNK_SIZE;
+    if (chunk >= INODE_MAX_CHUNKS)
+        return NULL;
+
+    inode_t *c = __atomic_load_n(&shards[inumber % n_shards].chunks[chunk], __ATOMIC_ACQUIRE);
+    if (!c)
+        return NULL;
+    return &c[local % INODE_CHUNK_SIZE];
+}
+
+
+/*
+ * Starts changing an i-node: lock-free readers that overlap with the
+ * change will fail validation. The caller holds the i-node write lock.
+ */
+static void seq_write_begin(inode_t *inode) {
+    __atomic_store_n(&inode->seq, inode->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+ * Ends a change started with seq_write_begin.
+ */
+static void seq_write_end(inode_t *inode) {
+    __atomic_store_n(&inode->seq, inode->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Enters a read section (see reclaim.h), waiting for a reader slot if
+ * every one is taken.
+ */
+static void read_section_enter() {
+    while (reclaim_read_enter() == FAIL)
+        sched_yield();
+}
+
+/*
+ * Returns how many changes hold an i-node pinned (see inode_pin). Its
+ * big-reader lock may go meanwhile, for a caller not holding it locked.
+ */
+static long pin_count(inode_t *inode) {
+    long pins;
+
+    read_section_enter();
+    brlock *br = __atomic_load_n(&inode->br, __ATOMIC_ACQUIRE);
+    pins = br ? brlock_pins(br) : __atomic_load_n(&inode->pins, __ATOMIC_ACQUIRE);
+    reclaim_read_exit();
+    return pins;
+}
+
+
+/*
+ * Pushes a chain of free slots onto a shard's free list with a single CAS.
+ * Input:
+ *  - shard: index of the shard
+ *  - first, last: slots at the ends of the chain (already linked)
+ *  - n: length of the chain
+ */
+static void free_list_push(int shard, int first, int last, int n) {
+    inode_shard *sh = &shards[shard];
+    inode_t *tail = inode_ref(last * n_shards + shard);
+    unsigned long long head = __atomic_load_n(&sh->free_head, __ATOMIC_ACQUIRE);
+
+    do {
+        tail->next_free = FREE_HEAD_SLOT(head);
+    } while (!__atomic_compare_exchange_n(&sh->free_head, &head,
+                FREE_HEAD(FREE_HEAD_TAG(head) + 1, first), 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+
+    __atomic_add_fetch(&sh->n_free, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Pops a free slot from a shard's free list.
+ * Input:
+ *  - shard: index of the shard
+ * Returns:
+ *  inumber: of the slot taken off the list
+ *     FAIL: if the list is empty
+ */
+static int free_list_pop(int shard) {
+    inode_shard *sh = &shards[shard];
+    unsigned long long head = __atomic_load_n(&sh->free_head, __ATOMIC_ACQUIRE);
+    int slot;
+
+    do {
+        slot = FREE_HEAD_SLOT(head);
+        if (slot == FREE_LIST_END)
+            return FAIL;
+        /* the slot may be reused under us, in which case the tag makes the CAS fail */
+        int next = __atomic_load_n(&inode_ref(slot * n_shards + shard)->next_free, __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&sh->free_head, &head,
+                FREE_HEAD(FREE_HEAD_TAG(head) + 1, next), 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            break;
+    } while (1);
+
+    __atomic_sub_fetch(&sh->n_free, 1, __ATOMIC_RELAXED);
+    return slot * n_shards + shard;
+}
 
 
 /*
- * Sleeps for synchronization testing.
+ * Adds one chunk of free i-nodes to a shard and puts them on its free
+ * list in one batch.
+ * Input:
+ *  - shard: index of the shard
+ *  - seen: number of chunks the caller saw; nothing is done if another
+ *          thread already grew the shard past it
+ * Returns: SUCCESS or FAIL
  */
-void insert_delay(int cycles) {
-    for (int i = 0; i < cycles; i++) {}
+static int inode_shard_grow(int shard, int seen) {
+    inode_shard *sh = &shards[shard];
+    int res = SUCCESS;
+
+    pthread_mutex_lock(&sh->grow_lock);
+    if (sh->n_chunks == seen) {
+        inode_t *c;
+        if (seen == INODE_MAX_CHUNKS || !(c = malloc(sizeof(inode_t) * INODE_CHUNK_SIZE))) {
+            res = FAIL;
+        } else {
+            int base = seen * INODE_CHUNK_SIZE;
+
+            for (int i = 0; i < INODE_CHUNK_SIZE; i++) {
+                c[i].nodeType = T_NONE;
+                c[i].data.dir = NULL;
+                c[i].next_free = base + i + 1;
+                c[i].seq = 0;
+                c[i].br = NULL;
+                c[i].pins = 0;
+                c[i].mover = NULL;
+                if (pthread_rwlock_init(&c[i].rwlock, NULL)) {
+                    fprintf(stderr, "Error: unable to initialize locks\n");
+                }
+            }
+            __atomic_store_n(&sh->chunks[seen], c, __ATOMIC_RELEASE);
+            __atomic_store_n(&sh->n_chunks, seen + 1, __ATOMIC_RELEASE);
+            free_list_push(shard, base, base + INODE_CHUNK_SIZE - 1, INODE_CHUNK_SIZE);
+        }
+    }
+    pthread_mutex_unlock(&sh->grow_lock);
+    return res;
 }
 
 
 /*
  * Initializes the i-nodes table.
+ * Only the shard directories are allocated here; chunks come on demand.
  */
 void inode_table_init() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        inode_table[i].nodeType = T_NONE;
-        inode_table[i].data.dirEntries = NULL;
-        inode_table[i].data.fileContents = NULL;
-        if (pthread_rwlock_init(&inode_table[i].rwlock, NULL)) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    n_shards = (ncpu < 1) ? 1 : (ncpu > INODE_MAX_SHARDS) ? INODE_MAX_SHARDS : ncpu;
+    if (!(shards = calloc(n_shards, sizeof(inode_shard)))) {
+        fprintf(stderr, "Error: no memory for the i-node table\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int s = 0; s < n_shards; s++) {
+        if (pthread_mutex_init(&shards[s].grow_lock, NULL)) {
             fprintf(stderr, "Error: unable to initialize locks\n");
-        }  
-        
+        }
+        shards[s].free_head = FREE_HEAD(0, FREE_LIST_END);
+    }
+
+    if (!(tree_gate = brlock_create(0))) {
+        fprintf(stderr, "Error: unable to initialize locks\n");
+        exit(EXIT_FAILURE);
     }
 }
 
@@ -36,60 +254,230 @@ void inode_table_init() {
  */
 
 void inode_table_destroy() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        if (inode_table[i].nodeType != T_NONE) {
-            /* as data is an union, the same pointer is used for both dirEntries and fileContents */
-            /* just release one of them */
-	        if (inode_table[i].data.dirEntries)
-                free(inode_table[i].data.dirEntries);
-            if (pthread_rwlock_destroy(&inode_table[i].rwlock)) {
-                fprintf(stderr, "Error: unable to destroy locks\n");
-            } 
-        }        
+    for (int s = 0; s < n_shards; s++) {
+        for (int c = 0; c < shards[s].n_chunks; c++) {
+            inode_t *chunk = shards[s].chunks[c];
+
+            for (int i = 0; i < INODE_CHUNK_SIZE; i++) {
+                if (chunk[i].nodeType == T_DIRECTORY)
+                    directory_destroy(chunk[i].data.dir);
+                else if (chunk[i].nodeType == T_FILE)
+                    filedata_destroy(chunk[i].data.file);
+                if (pthread_rwlock_destroy(&chunk[i].rwlock)) {
+                    fprintf(stderr, "Error: unable to destroy locks\n");
+                }
+                brlock_destroy(chunk[i].br);
+            }
+            free(chunk);
+        }
+        pthread_mutex_destroy(&shards[s].grow_lock);
+    }
+    free(shards);
+    shards = NULL;
+    brlock_destroy(tree_gate);
+    tree_gate = NULL;
+    reclaim_flush();
+    directory_pool_destroy();
+    filedata_pool_destroy();
+}
+
+/*
+ * Fills the table, right after inode_table_init, with the i-nodes of a
+ * checkpoint, each at its own i-number. Every other slot of the chunks
+ * needed goes on the free lists, lowest first. The number of shards may
+ * differ from when the checkpoint was taken.
+ * Input:
+ *  - n_inodes: i-numbers 0 .. n_inodes - 1 are restored
+ *  - load: gives the type and data of each of them (T_NONE if unused)
+ *  - arg: passed to load
+ * Returns: SUCCESS or FAIL
+ */
+int inode_table_restore(int n_inodes, inode_loader load, void *arg) {
+    for (int s = 0; s < n_shards; s++) {
+        int n_local = (n_inodes > s) ? (n_inodes - s + n_shards - 1) / n_shards : 0;
+        int n_chunks = (n_local + INODE_CHUNK_SIZE - 1) / INODE_CHUNK_SIZE;
+        inode_shard *sh = &shards[s];
+        int head = FREE_LIST_END;
+        long n_free = 0;
+
+        for (int c = sh->n_chunks; c < n_chunks; c++)
+            if (inode_shard_grow(s, c) == FAIL)
+                return FAIL;
+
+        /* growing listed every slot as free: list them again, skipping restored ones */
+        for (int local = sh->n_chunks * INODE_CHUNK_SIZE - 1; local >= 0; local--) {
+            int inumber = local * n_shards + s;
+            inode_t *inode = inode_ref(inumber);
+
+            inode->data.dir = NULL;
+            inode->open_count = 0;
+            inode->nodeType = (inumber < n_inodes) ? load(inumber, &inode->data, arg) : T_NONE;
+            if (inode->nodeType == T_NONE) {
+                inode->next_free = head;
+                head = local;
+                n_free++;
+            }
+        }
+        sh->free_head = FREE_HEAD(0, head);
+        sh->n_free = n_free;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Saves the children of a directory for the running snapshot, unless
+ * they were saved already, so the snapshot sees them as they were when
+ * it was taken. Whatever an earlier snapshot left is dropped.
+ * The caller holds the directory's i-node lock for writing.
+ * Input:
+ *  - dir: the directory, about to change or be printed
+ */
+static void snapshot_save(Directory *dir) {
+    unsigned long epoch = __atomic_load_n(&snap_epoch, __ATOMIC_ACQUIRE);
+
+    if (dir->saved_epoch == epoch)
+        return;
+    free(dir->saved);
+    dir->saved = NULL;
+    dir->saved_epoch = epoch;
+    if (!epoch)
+        return;
+
+    DirSnapshot *saved = malloc(sizeof(DirSnapshot) + sizeof(SnapEntry) * dir->n_live);
+    if (!saved) {
+        fprintf(stderr, "Error: no memory for a snapshot\n");
+        exit(EXIT_FAILURE);
     }
+    saved->n = 0;
+    for (int pos = 0; pos < dir->n_entries; pos++) {
+        DirEntry *e = &dir->table->entries[pos];
+        if (e->inumber == FREE_INODE)
+            continue;
+
+        /* a child is not deleted before it leaves the directory */
+        inode_t *child = inode_ref(e->inumber);
+        SnapEntry *se = &saved->entries[saved->n++];
+        memcpy(se->name, e->name, e->len + 1);
+        se->len = e->len;
+        se->inumber = e->inumber;
+        se->nodeType = child->nodeType;
+        se->dir = (child->nodeType == T_DIRECTORY) ? child->data.dir : NULL;
+    }
+    dir->saved = saved;
+}
+
+/*
+ * Releases the directory of a deleted i-node. While a snapshot runs, it
+ * is kept until the snapshot ends, as the snapshot may still print it.
+ * Input:
+ *  - dir: the directory
+ */
+static void snapshot_release(Directory *dir) {
+    pthread_mutex_lock(&parked_lock);
+    if (snap_epoch) {
+        if (n_parked == parked_cap) {
+            parked_cap = parked_cap ? 2 * parked_cap : 64;
+            if (!(parked = realloc(parked, sizeof(Directory *) * parked_cap))) {
+                fprintf(stderr, "Error: no memory for a snapshot\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        parked[n_parked++] = dir;
+        dir = NULL;
+    }
+    pthread_mutex_unlock(&parked_lock);
+    directory_destroy(dir);
 }
 
 /*
  * Creates a new i-node in the table with the given information.
  * Input:
  *  - nType: the type of the node (file or directory)
+ *  - depth: levels below the root it goes (0 for the root itself), for
+ *    choosing its lock (see inode_bias_levels)
  * Returns:
  *  inumber: identifier of the new i-node, if successfully created
  *     FAIL: if an error occurs
  */
-int inode_create(type nType, int inodes_locked[], int * n_inodes_locked) {
-    /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
+int inode_create(type nType, int depth, int inodes_locked[], int * n_inodes_locked) {
+    /* Used for testing synchronization speedup and error paths */
+    if (INJECT(INJ_INODE_CREATE) == FAIL)
+        return FAIL;
 
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-    
-        if(inode_trylock(inumber, WRITE))
-            continue;
-        
-        inodes_locked[(*n_inodes_locked)] = inumber;
-        (*n_inodes_locked)++;
-
-        if (inode_table[inumber].nodeType == T_NONE) {
-            inode_table[inumber].nodeType = nType;
-
-            if (nType == T_DIRECTORY) {
-                /* Initializes entry table */
-                inode_table[inumber].data.dirEntries = malloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
-            
-                for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-                }
-            }
-            else {
-                inode_table[inumber].data.fileContents = NULL;
-            }
-            return inumber;
+    if (my_shard == -1)
+        my_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % n_shards;
+
+    int inumber;
+
+    /* own shard first, then any other shard with free slots, then grow */
+    while ((inumber = free_list_pop(my_shard)) == FAIL) {
+        for (int s = 1; s < n_shards && inumber == FAIL; s++)
+            inumber = free_list_pop((my_shard + s) % n_shards);
+        if (inumber != FAIL)
+            break;
+        if (inode_shard_grow(my_shard, __atomic_load_n(&shards[my_shard].n_chunks, __ATOMIC_ACQUIRE)) == FAIL)
+            return FAIL;
+    }
+
+    inode_t *inode = inode_ref(inumber);
+
+    /* nobody else can reach a slot taken off the free list: this never waits */
+    if (inode_lock(inumber, WRITE) == FAIL) {
+        fprintf(stderr, "Error: unable to lock\n");
+        exit(EXIT_FAILURE);
+    }
+    inodes_locked[(*n_inodes_locked)] = inumber;
+    (*n_inodes_locked)++;
+
+    Directory *dir = NULL;
+
+    if (nType == T_DIRECTORY) {
+        /* Initializes entry table */
+        if (!(dir = directory_create())) {
+            (*n_inodes_locked)--;
+            inode_unlock(inumber);
+            free_list_push(inumber % n_shards, inumber / n_shards, inumber / n_shards, 1);
+            return FAIL;
         }
-        (*n_inodes_locked)--;
-        inode_unlock(inodes_locked[*n_inodes_locked]);
-        
+        /* not part of the running snapshot, if any */
+        dir->saved_epoch = __atomic_load_n(&snap_epoch, __ATOMIC_ACQUIRE);
+
+        /* without memory for it, the rwlock does */
+        if (depth < bias_levels)
+            inode_bias(inumber);
+    }
+
+    seq_write_begin(inode);
+    if (nType == T_DIRECTORY)
+        inode->data.dir = dir;
+    else
+        inode->data.file = NULL;
+    inode->open_count = 0;
+    inode->nodeType = nType;
+    seq_write_end(inode);
+    return inumber;
+}
+
+/*
+ * Switches an i-node back from its big-reader lock to its rwlock, and
+ * frees the big-reader lock once nobody can be using it anymore. The
+ * caller holds it locked for writing, unpinned, and keeps holding it,
+ * now through the rwlock; whoever waits for the old lock is turned away
+ * and moves over (see brlock_kill).
+ * Input:
+ *  - inode: the i-node
+ */
+static void inode_unbias(inode_t *inode) {
+    brlock *br = inode->br;
+
+    /* only held in passing while the big-reader lock is set */
+    if (pthread_rwlock_wrlock(&inode->rwlock)) {
+        fprintf(stderr, "Error: unable to lock\n");
+        exit(EXIT_FAILURE);
     }
-    return FAIL;
+    __atomic_store_n(&inode->br, NULL, __ATOMIC_RELEASE);
+    brlock_kill(br);
+    brlock_retire(br);
 }
 
 /*
@@ -99,24 +487,54 @@ int inode_create(type nType, int inodes_locked[], int * n_inodes_locked) {
  * Returns: SUCCESS or FAIL
  */
 int inode_delete(int inumber) {
-    /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
+    /* Used for testing synchronization speedup and error paths */
+    if (INJECT(INJ_INODE_DELETE) == FAIL)
+        return FAIL;
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    inode_t *inode = inode_ref(inumber);
+
+    if (!inode || (inode->nodeType == T_NONE)) {
         printf("inode_delete: invalid inumber\n");
         return FAIL;
     } 
 
-    inode_table[inumber].nodeType = T_NONE;
+    type nType = inode->nodeType;
+    union Data data = inode->data;
+
+    /*
+     * Changes that walked through an empty directory are only left to
+     * unpin it: wait for them, so that no unpin reaches the slot reused
+     */
+    while (nType == T_DIRECTORY && pin_count(inode))
+        sched_yield();
+
+    /* a move that claimed it finds it gone when it tries again */
+    __atomic_store_n(&inode->mover, NULL, __ATOMIC_RELEASE);
+
+    seq_write_begin(inode);
+    inode->nodeType = T_NONE;
+    inode->data.dir = NULL;
+    seq_write_end(inode);
+
+    /* the slot starts over with its rwlock */
+    if (inode->br)
+        inode_unbias(inode);
+
     /* see inode_table_destroy function */
-    if (inode_table[inumber].data.dirEntries)
-        free(inode_table[inumber].data.dirEntries);
+    if (nType == T_DIRECTORY)
+        snapshot_release(data.dir);
+    else
+        filedata_destroy(data.file);
 
     if (inode_unlock(inumber) == FAIL) {
         fprintf(stderr, "Error: unable to unlock\n");
         exit(EXIT_FAILURE);
     }
 
+    /* hand the slot back to the shard it belongs to */
+    int slot = inumber / n_shards;
+    free_list_push(inumber % n_shards, slot, slot, 1);
+
     return SUCCESS;
 }
 
@@ -131,18 +549,20 @@ int inode_delete(int inumber) {
  */
 int inode_get(int inumber, type *nType, union Data *data) {
     /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
+    (void) INJECT(INJ_INODE_GET);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    inode_t *inode = inode_ref(inumber);
+
+    if (!inode || (inode->nodeType == T_NONE)) {
         printf("inode_get: invalid inumber %d\n", inumber);
         return FAIL;
     }
 
     if (nType)
-        *nType = inode_table[inumber].nodeType;
+        *nType = inode->nodeType;
 
     if (data)
-        *data = inode_table[inumber].data;
+        *data = inode->data;
 
     return SUCCESS;
 }
@@ -153,36 +573,36 @@ int inode_get(int inumber, type *nType, union Data *data) {
  * Input:
  *  - inumber: identifier of the i-node
  *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry
  * Returns: SUCCESS or FAIL
  */
-int dir_reset_entry(int inumber, int sub_inumber) {
-    /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
+int dir_reset_entry(int inumber, int sub_inumber, char *sub_name) {
+    /* Used for testing synchronization speedup and error paths */
+    if (INJECT(INJ_DIR_RESET_ENTRY) == FAIL)
+        return FAIL;
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    inode_t *inode = inode_ref(inumber), *sub_inode = inode_ref(sub_inumber);
+
+    if (!inode || (inode->nodeType == T_NONE)) {
         printf("inode_reset_entry: invalid inumber\n");
         return FAIL;
     }
 
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
+    if (inode->nodeType != T_DIRECTORY) {
         printf("inode_reset_entry: can only reset entry to directories\n");
         return FAIL;
     }
 
-    if ((sub_inumber < FREE_INODE) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
+    if (!sub_inode || (sub_inode->nodeType == T_NONE)) {
         printf("inode_reset_entry: invalid entry inumber\n");
         return FAIL;
     }
 
-    
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == sub_inumber) {
-            inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-            inode_table[inumber].data.dirEntries[i].name[0] = '\0';
-            return SUCCESS;
-        }
-    }
-    return FAIL;
+    snapshot_save(inode->data.dir);
+    seq_write_begin(inode);
+    int res = directory_remove(inode->data.dir, sub_name, sub_inumber);
+    seq_write_end(inode);
+    return res;
 }
 
 
@@ -195,20 +615,23 @@ int dir_reset_entry(int inumber, int sub_inumber) {
  * Returns: SUCCESS or FAIL
  */
 int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
-    /* Used for testing synchronization speedup */
-    insert_delay(DELAY);
+    /* Used for testing synchronization speedup and error paths */
+    if (INJECT(INJ_DIR_ADD_ENTRY) == FAIL)
+        return FAIL;
+
+    inode_t *inode = inode_ref(inumber), *sub_inode = inode_ref(sub_inumber);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    if (!inode || (inode->nodeType == T_NONE)) {
         printf("inode_add_entry: invalid inumber\n");
         return FAIL;
     }
 
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
+    if (inode->nodeType != T_DIRECTORY) {
         printf("inode_add_entry: can only add entry to directories\n");
         return FAIL;
     }
 
-    if ((sub_inumber < 0) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
+    if (!sub_inode || (sub_inode->nodeType == T_NONE)) {
         printf("inode_add_entry: invalid entry inumber\n");
         return FAIL;
     }
@@ -218,44 +641,556 @@ int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
                entry name must be non-empty\n");
         return FAIL;
     }
-    
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == FREE_INODE) {
-            inode_table[inumber].data.dirEntries[i].inumber = sub_inumber;
-            strcpy(inode_table[inumber].data.dirEntries[i].name, sub_name);
-            return SUCCESS;
+    snapshot_save(inode->data.dir);
+    seq_write_begin(inode);
+    int res = directory_add(inode->data.dir, sub_name, sub_inumber);
+    seq_write_end(inode);
+    return res;
+}
+
+
+/*
+ * Reads from a file.
+ * The caller must hold the i-node's lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - offset: where to start
+ *  - buf: where to copy the data to
+ *  - len: most bytes to read
+ * Returns: the bytes read or FAIL if it isn't a file
+ */
+int inode_read(int inumber, long offset, char *buf, int len) {
+    inode_t *inode = inode_ref(inumber);
+
+    if (!inode || inode->nodeType != T_FILE || offset < 0 || len < 0)
+        return FAIL;
+    return filedata_read(inode->data.file, offset, buf, len);
+}
+
+/*
+ * Writes to a file.
+ * The caller must hold the i-node's lock for writing.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - offset: where to start
+ *  - buf: the data
+ *  - len: bytes to write
+ * Returns: the bytes written or FAIL
+ */
+int inode_write(int inumber, long offset, char *buf, int len) {
+    inode_t *inode = inode_ref(inumber);
+
+    if (!inode || inode->nodeType != T_FILE)
+        return FAIL;
+
+    /* files get contents on their first write */
+    if (!inode->data.file) {
+        FileData *f = filedata_create();
+
+        if (!f)
+            return FAIL;
+        seq_write_begin(inode);
+        inode->data.file = f;
+        seq_write_end(inode);
+    }
+    return filedata_write(inode->data.file, offset, buf, len);
+}
+
+/*
+ * Counts an open-file table entry referring to a file in or out.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - delta: 1 when opening, -1 when closing
+ */
+void inode_open_count(int inumber, int delta) {
+    __atomic_add_fetch(&inode_ref(inumber)->open_count, delta, __ATOMIC_RELAXED);
+}
+
+/*
+ * Whether a file is open. Stable while the caller holds the i-node's
+ * lock for writing, as files are opened with it locked.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: 1 if it is open, 0 otherwise
+ */
+int inode_is_open(int inumber) {
+    return __atomic_load_n(&inode_ref(inumber)->open_count, __ATOMIC_RELAXED) > 0;
+}
+
+
+/*
+ * Takes a snapshot of the tree. Nothing is copied: from now on, each
+ * directory saves its children the first time it is changed (or walked)
+ * and directories deleted are kept until the snapshot ends. The tree
+ * gate is locked for writing only to wait for the changes under way;
+ * the ones after see the new epoch.
+ * Snapshots run one at a time.
+ * Input:
+ *  - quiesced: called while no change is under way, to note what else
+ *    the snapshot matches (e.g. a log position), or NULL
+ *  - arg: passed to quiesced
+ * Returns: the epoch of the snapshot, for inode_print_tree
+ */
+unsigned long inode_snapshot_begin(void (*quiesced)(void *), void *arg) {
+    unsigned long epoch;
+
+    pthread_mutex_lock(&snap_lock);
+    if (inode_gate_lock(WRITE) == FAIL) {
+        fprintf(stderr, "Error: unable to lock\n");
+        exit(EXIT_FAILURE);
+    }
+    if (quiesced)
+        quiesced(arg);
+    epoch = ++last_epoch;
+    __atomic_store_n(&snap_epoch, epoch, __ATOMIC_RELEASE);
+    if (inode_gate_unlock() == FAIL) {
+        fprintf(stderr, "Error: unable to unlock\n");
+        exit(EXIT_FAILURE);
+    }
+    return epoch;
+}
+
+/*
+ * Ends the snapshot taken by inode_snapshot_begin and releases the
+ * directories deleted meanwhile.
+ */
+void inode_snapshot_end() {
+    Directory **dirs;
+    int n;
+
+    pthread_mutex_lock(&parked_lock);
+    __atomic_store_n(&snap_epoch, 0, __ATOMIC_RELEASE);
+    dirs = parked;
+    n = n_parked;
+    parked = NULL;
+    n_parked = parked_cap = 0;
+    pthread_mutex_unlock(&parked_lock);
+
+    for (int i = 0; i < n; i++)
+        directory_destroy(dirs[i]);
+    free(dirs);
+    pthread_mutex_unlock(&snap_lock);
+}
+
+/*
+ * Takes the children a directory had when a snapshot was taken. Its
+ * i-node is only locked while they are saved, if no change did it first.
+ * Input:
+ *  - inumber: identifier of the directory's i-node, when the snapshot was taken
+ *  - dir: the directory
+ *  - epoch: the snapshot
+ * Returns: the children, for the caller to free, or NULL if there were none
+ */
+static DirSnapshot *snapshot_take(int inumber, Directory *dir, unsigned long epoch) {
+    inode_t *inode = inode_ref(inumber);
+    DirSnapshot *saved;
+
+    if (inode_lock(inumber, WRITE) == FAIL) {
+        fprintf(stderr, "Error: unable to lock\n");
+        exit(EXIT_FAILURE);
+    }
+    /* a directory deleted since, unchanged before, was empty */
+    if (inode->nodeType == T_DIRECTORY && inode->data.dir == dir)
+        snapshot_save(dir);
+    saved = (dir->saved_epoch == epoch) ? dir->saved : NULL;
+    dir->saved = NULL;
+    if (inode_unlock(inumber) == FAIL) {
+        fprintf(stderr, "Error: unable to unlock\n");
+        exit(EXIT_FAILURE);
+    }
+    return saved;
+}
+
+/*
+ * The directories a walk of inode_print_tree is in, from where it
+ * started down.
+ */
+typedef struct walk_frame {
+    DirSnapshot *saved;
+    int next;            /* child to print next */
+    int end;             /* the children printed are those before it */
+    size_t path_len;     /* length of the directory's path */
+} walk_frame;
+
+typedef struct walk_stack {
+    walk_frame *frames;
+    int depth, cap;
+    char *path;          /* of the node printed last */
+    size_t path_cap;
+} walk_stack;
+
+/*
+ * Enters a directory that has children.
+ */
+static void walk_push(walk_stack *st, DirSnapshot *saved, int next, int end, size_t path_len) {
+    if (st->depth == st->cap) {
+        st->cap = st->cap ? 2 * st->cap : 64;
+        if (!(st->frames = realloc(st->frames, sizeof(walk_frame) * st->cap))) {
+            fprintf(stderr, "Error: no memory to print\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    st->frames[st->depth].saved = saved;
+    st->frames[st->depth].next = next;
+    st->frames[st->depth].end = end;
+    st->frames[st->depth++].path_len = path_len;
+}
+
+/*
+ * Prints the children of the directory on top of the stack, from next to
+ * end, each followed by its subtree. The stack keeps its own depth and
+ * the path is built in a buffer that grows as needed, so any depth and
+ * length is printed. The directory is left on the stack for the caller.
+ * Input:
+ *  - w: where to print
+ *  - st: the stack
+ *  - epoch: the snapshot
+ */
+static void walk(tree_writer *w, walk_stack *st, unsigned long epoch) {
+    int base = st->depth;
+    DirSnapshot *saved;
+
+    /* a failed write stops the walk */
+    while (!w->error) {
+        walk_frame *f = &st->frames[st->depth - 1];
+
+        if (f->next == f->end) {
+            if (st->depth == base)
+                break;
+            free(f->saved);
+            st->depth--;
+            tree_leave(w);
+            continue;
+        }
+
+        SnapEntry *se = &f->saved->entries[f->next++];
+        size_t path_len = f->path_len + 1 + se->len;
+        if (path_len + 1 > st->path_cap) {
+            st->path_cap = 2 * (path_len + 1);
+            if (!(st->path = realloc(st->path, st->path_cap))) {
+                fprintf(stderr, "Error: no memory to print\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        st->path[f->path_len] = '/';
+        memcpy(st->path + f->path_len + 1, se->name, se->len + 1);
+
+        tree_node(w, st->path, path_len, se->len, st->depth, se->nodeType);
+        if (se->nodeType == T_DIRECTORY) {
+            if ((saved = snapshot_take(se->inumber, se->dir, epoch)))
+                walk_push(st, saved, 0, saved->n, path_len);
+            else
+                tree_leave(w);
         }
     }
-    return FAIL;
+
+    while (st->depth > base)
+        free(st->frames[--st->depth].saved);
+}
+
+/*
+ * A print split across threads: the subtrees of the root's children are
+ * handed out in order, one at a time, and each is printed into a part
+ * of its own; the parts are then joined in order.
+ */
+typedef struct print_job {
+    DirSnapshot *root;
+    unsigned long epoch;
+    int format;
+    int next;            /* child of the root to hand out next */
+    tree_writer *parts;
+} print_job;
+
+/*
+ * Prints subtrees of a print_job until none is left.
+ */
+static void *print_worker(void *arg) {
+    print_job *job = arg;
+    walk_stack st = { NULL, 0, 0, NULL, 0 };
+    int i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->root->n) {
+        tree_begin_part(&job->parts[i], job->format, i > 0);
+        walk_push(&st, job->root, i, i + 1, 0);
+        walk(&job->parts[i], &st, job->epoch);
+        st.depth--;
+    }
+    free(st.frames);
+    free(st.path);
+    return NULL;
+}
+
+/* output buffer of inode_print_tree, only used by the running snapshot */
+static char tree_buf[TREE_BUFFER_SIZE];
+
+/* threads a print uses, counting the caller (see inode_print_threads) */
+static int print_threads = 1;
+
+/*
+ * Sets how many threads print a tree (the caller and helpers).
+ * Input:
+ *  - n: at least 1
+ */
+void inode_print_threads(int n) {
+    print_threads = (n < 1) ? 1 : n;
+}
+
+/*
+ * Sets how many levels of directories below the root, counting it, get
+ * a big-reader lock when created; 0 gives none.
+ * Input:
+ *  - levels: the number of levels
+ */
+void inode_bias_levels(int levels) {
+    bias_levels = (levels < 0) ? 0 : levels;
 }
 
+/*
+ * Switches an i-node to a big-reader lock (see brlock.h), for i-nodes
+ * walked through by nearly every operation. The caller holds it locked
+ * for writing and keeps holding it, now through the new lock; whoever
+ * gets the rwlock afterwards finds the switch and moves over. The i-node
+ * keeps the lock until it is deleted or moved down (see inode_unbias).
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: SUCCESS, or FAIL if there is no memory for the lock
+ */
+int inode_bias(int inumber) {
+    inode_t *inode = inode_ref(inumber);
+    brlock *br;
+
+    if (!inode)
+        return FAIL;
+    if (inode->br)
+        return SUCCESS;
+    if (!(br = brlock_create(1)))
+        return FAIL;
+
+    /* nobody else can reach it yet: this never waits */
+    read_section_enter();
+    brlock_write_lock(br);
+    __atomic_store_n(&inode->br, br, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&inode->rwlock);
+    return SUCCESS;
+}
 
 /*
- * Prints the i-nodes table.
+ * Gives a directory moved to another depth the lock inode_create would
+ * have given it there. The caller holds it locked for writing and
+ * claimed (see inode_move_claim), so unpinned. The directories below it
+ * keep their locks, and switch back when deleted.
  * Input:
  *  - inumber: identifier of the i-node
- *  - name: pointer to the name of current file/dir
+ *  - depth: its new level below the root
  */
-void inode_print_tree(FILE *fp, int inumber, char *name) {
-    if (inode_table[inumber].nodeType == T_FILE) {
-        fprintf(fp, "%s\n", name);
+void inode_move_depth(int inumber, int depth) {
+    inode_t *inode = inode_ref(inumber);
+
+    if (depth < bias_levels)
+        inode_bias(inumber);
+    else if (inode->br)
+        inode_unbias(inode);
+}
+
+/*
+ * Switches the directories of a restored tree to big-reader locks, as
+ * if they had been created with inode_create (auxiliary to
+ * inode_table_bias).
+ * Input:
+ *  - inumber: a directory
+ *  - depth: its level below the root
+ */
+static void bias_subtree(int inumber, int depth) {
+    inode_t *inode = inode_ref(inumber);
+    Directory *dir = inode->data.dir;
+
+    if (depth >= bias_levels)
         return;
+
+    if (inode_lock(inumber, WRITE) == FAIL) {
+        fprintf(stderr, "Error: unable to lock\n");
+        exit(EXIT_FAILURE);
+    }
+    inode_bias(inumber);
+    inode_unlock(inumber);
+
+    for (int pos = 0; pos < dir->n_entries; pos++) {
+        int sub = dir->table->entries[pos].inumber;
+
+        if (sub != FREE_INODE && inode_ref(sub)->nodeType == T_DIRECTORY)
+            bias_subtree(sub, depth + 1);
+    }
+}
+
+/*
+ * Gives the directories of a tree restored from a checkpoint the locks
+ * inode_create would have. Only called before the tree is shared.
+ */
+void inode_table_bias() {
+    bias_subtree(FS_ROOT, 0);
+}
+
+/*
+ * Prints the tree as it was when a snapshot was taken, while other
+ * operations go on. With more than one print thread, the subtrees of
+ * the root's children are printed in parallel and joined in the order
+ * a single thread prints them in, so the output is the same.
+ * Input:
+ *  - fd: where to print
+ *  - epoch: what inode_snapshot_begin returned
+ *  - format: one of TFS_PRINT_*
+ * Returns: SUCCESS, or FAIL if the output couldn't be written
+ */
+int inode_print_tree(int fd, unsigned long epoch, int format) {
+    tree_writer w;
+    walk_stack st = { NULL, 0, 0, NULL, 0 };
+    DirSnapshot *root = snapshot_take(FS_ROOT, inode_ref(FS_ROOT)->data.dir, epoch);
+    int n_threads = root ? ((print_threads < root->n) ? print_threads : root->n) : 1;
+
+    tree_begin(&w, fd, format, tree_buf, sizeof(tree_buf));
+    tree_node(&w, "", 0, 0, 0, T_DIRECTORY);
+
+    if (root && n_threads > 1) {
+        print_job job = { root, epoch, format, 0, NULL };
+        pthread_t tid[n_threads - 1];
+        int n_helpers = 0;
+
+        if (!(job.parts = malloc(sizeof(tree_writer) * root->n))) {
+            fprintf(stderr, "Error: no memory to print\n");
+            exit(EXIT_FAILURE);
+        }
+        /* the caller works too, so a helper that can't start is no loss */
+        while (n_helpers < n_threads - 1 && !pthread_create(&tid[n_helpers], NULL, print_worker, &job))
+            n_helpers++;
+        print_worker(&job);
+        for (int i = 0; i < n_helpers; i++)
+            pthread_join(tid[i], NULL);
+
+        for (int i = 0; i < root->n; i++)
+            tree_append(&w, &job.parts[i]);
+        free(job.parts);
+    } else if (root) {
+        walk_push(&st, root, 0, root->n, 0);
+        walk(&w, &st, epoch);
     }
 
-    if (inode_table[inumber].nodeType == T_DIRECTORY) {
-        fprintf(fp, "%s\n", name);
-        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-            if (inode_table[inumber].data.dirEntries[i].inumber != FREE_INODE) {
-                char path[MAX_FILE_NAME];
-                if (snprintf(path, sizeof(path), "%s/%s", name, inode_table[inumber].data.dirEntries[i].name) > sizeof(path)) {
-                    fprintf(stderr, "truncation when building full path\n");
+    free(root);
+    free(st.frames);
+    free(st.path);
+    tree_leave(&w);
+    return tree_end(&w);
+}
+
+/*
+ * A directory of a snapshot whose children are yet to be visited.
+ */
+typedef struct snap_dir {
+    int inumber;
+    Directory *dir;
+} snap_dir;
+
+/*
+ * Calls a function with the children of every directory of the tree as
+ * it was when a snapshot was taken, while other operations go on. Each
+ * directory's i-node is only locked while its children are saved, as
+ * when printing.
+ * Input:
+ *  - epoch: what inode_snapshot_begin returned
+ *  - visit: the function, which must not keep the children
+ *  - arg: passed to visit
+ */
+void inode_snapshot_walk(unsigned long epoch, snapshot_visitor visit, void *arg) {
+    snap_dir d = { FS_ROOT, inode_ref(FS_ROOT)->data.dir };
+    snap_dir *stack = NULL;
+    int depth = 0, cap = 0;
+
+    for (;;) {
+        DirSnapshot *saved = snapshot_take(d.inumber, d.dir, epoch);
+
+        visit(d.inumber, saved, arg);
+        for (int i = 0; saved && i < saved->n; i++) {
+            SnapEntry *se = &saved->entries[i];
+
+            if (se->nodeType != T_DIRECTORY)
+                continue;
+            if (depth == cap) {
+                cap = cap ? 2 * cap : 64;
+                if (!(stack = realloc(stack, sizeof(snap_dir) * cap))) {
+                    fprintf(stderr, "Error: no memory for a snapshot\n");
+                    exit(EXIT_FAILURE);
                 }
-                inode_print_tree(fp, inode_table[inumber].data.dirEntries[i].inumber, path);
             }
+            stack[depth++] = (snap_dir) { se->inumber, se->dir };
         }
+        free(saved);
+        if (depth == 0)
+            break;
+        d = stack[--depth];
     }
+    free(stack);
+}
+
+
+/*
+ * Starts an optimistic (lock-free) read of an i-node.
+ * Must be called inside a read section (see reclaim.h).
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: the sequence number to validate the read with; an odd value
+ *          means the i-node is being changed and the read must be retried
+ *          with locks (readers never wait for writers)
+ */
+unsigned int inode_read_begin(int inumber) {
+    inode_t *inode = inode_ref(inumber);
+
+    if (!inode)
+        return 1;
+    return __atomic_load_n(&inode->seq, __ATOMIC_ACQUIRE);
 }
 
+/*
+ * Checks that an i-node did not change since inode_read_begin.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - seq: value returned by inode_read_begin
+ * Returns: SUCCESS if everything read in between is consistent, or FAIL
+ */
+int inode_read_validate(int inumber, unsigned int seq) {
+    inode_t *inode = inode_ref(inumber);
+
+    if (!inode || (seq & 1))
+        return FAIL;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (__atomic_load_n(&inode->seq, __ATOMIC_RELAXED) == seq) ? SUCCESS : FAIL;
+}
+
+/*
+ * Looks for an entry of a directory i-node without locking it.
+ * Must be called inside a read section, between inode_read_begin and
+ * inode_read_validate on the same i-node. The type and contents are
+ * validated against seq before the contents are used, so a slot deleted
+ * and reused as a file meanwhile is never read as a directory.
+ * Input:
+ *  - inumber: identifier of the directory i-node
+ *  - seq: value returned by inode_read_begin
+ *  - name: the entry name
+ * Returns:
+ *  - inumber: of the entry
+ *  - FAIL: if not found, the i-node is not a directory or it changed
+ */
+int inode_lookup_racy(int inumber, unsigned int seq, char *name) {
+    inode_t *inode = inode_ref(inumber);
+    Directory *dir;
+
+    if (!inode || __atomic_load_n(&inode->nodeType, __ATOMIC_RELAXED) != T_DIRECTORY)
+        return FAIL;
+    if (!(dir = __atomic_load_n(&inode->data.dir, __ATOMIC_RELAXED)))
+        return FAIL;
+    /* a retired directory stays readable until the read section ends */
+    if (inode_read_validate(inumber, seq) == FAIL)
+        return FAIL;
+    return directory_lookup_racy(dir, name);
+}
 
 
 /*
@@ -266,19 +1201,32 @@ void inode_print_tree(FILE *fp, int inumber, char *name) {
  * Returns: SUCCESS or FAIL
  */ 
 int inode_lock(int inumber, permission p) {
-    switch (p) {
-        case READ:
-            if (pthread_rwlock_rdlock(&inode_table[inumber].rwlock)) {
-                return FAIL;
-            }
-            break;
-        case WRITE:
-            if (pthread_rwlock_wrlock(&inode_table[inumber].rwlock)) {
-                return FAIL;
-            }
-            break;
+    inode_t *inode = inode_ref(inumber);
+
+    if (!inode || (p != READ && p != WRITE))
+        return FAIL;
+
+    for (;;) {
+        /* the big-reader lock may go before it is held (see inode_unbias) */
+        read_section_enter();
+        brlock *br = __atomic_load_n(&inode->br, __ATOMIC_ACQUIRE);
+
+        if (br) {
+            /* ends the read section; fails once it went */
+            if ((p == READ ? brlock_read_lock(br) : brlock_write_lock(br)) == SUCCESS)
+                return SUCCESS;
+            continue;
+        }
+        reclaim_read_exit();
+
+        if (p == READ ? pthread_rwlock_rdlock(&inode->rwlock) : pthread_rwlock_wrlock(&inode->rwlock))
+            return FAIL;
+
+        /* unless it was switched to a big-reader lock while we waited */
+        if (!__atomic_load_n(&inode->br, __ATOMIC_ACQUIRE))
+            return SUCCESS;
+        pthread_rwlock_unlock(&inode->rwlock);
     }
-    return SUCCESS;
 }
 
 /*
@@ -289,19 +1237,27 @@ int inode_lock(int inumber, permission p) {
  * Returns: SUCCESS or FAIL
  */
 int inode_trylock(int inumber, permission p) {
-    switch (p) {
-        case READ:
-            if (pthread_rwlock_tryrdlock(&inode_table[inumber].rwlock)) {
-                return FAIL;
-            }
-            break;
-        case WRITE:
-            if (pthread_rwlock_trywrlock(&inode_table[inumber].rwlock)) {
-                return FAIL;
-            }
-            break;
+    inode_t *inode = inode_ref(inumber);
+    brlock *br;
+
+    if (!inode || (p != READ && p != WRITE))
+        return FAIL;
+
+    /* as in inode_lock; nothing here waits */
+    read_section_enter();
+    if (!(br = __atomic_load_n(&inode->br, __ATOMIC_ACQUIRE))) {
+        if (p == READ ? pthread_rwlock_tryrdlock(&inode->rwlock) : pthread_rwlock_trywrlock(&inode->rwlock)) {
+            reclaim_read_exit();
+            return FAIL;
+        }
+        if (!(br = __atomic_load_n(&inode->br, __ATOMIC_ACQUIRE))) {
+            reclaim_read_exit();
+            return SUCCESS;
+        }
+        pthread_rwlock_unlock(&inode->rwlock);
     }
-    return SUCCESS;
+    /* ends the read section */
+    return (p == READ) ? brlock_read_trylock(br) : brlock_write_trylock(br);
 }
 
 /*
@@ -311,9 +1267,160 @@ int inode_trylock(int inumber, permission p) {
  * Returns: SUCCESS or FAIL
  */
 int inode_unlock(int inumber) {
-    if (pthread_rwlock_unlock(&inode_table[inumber].rwlock)) {
+    inode_t *inode = inode_ref(inumber);
+
+    if (!inode)
         return FAIL;
+
+    /* it can't have been switched while held */
+    if (inode->br) {
+        brlock_unlock(inode->br);
+        return SUCCESS;
     }
+    if (pthread_rwlock_unlock(&inode->rwlock)) {
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Pins a directory that a change walks through, before the change lets
+ * go of its lock. Until the change is done, and so has logged the path
+ * it took, the directory can't be moved (see inode_move_claim). The
+ * root can't be moved and is never pinned. A directory only switches to
+ * a big-reader lock unpinned, so pins are always counted in one place.
+ * The caller holds the i-node locked.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: SUCCESS, or FAIL if another thread claimed it to move it;
+ *  the caller must then let go of everything and wait (see
+ *  inode_move_wait)
+ */
+int inode_pin(int inumber) {
+    inode_t *inode = inode_ref(inumber);
+    void *mover = __atomic_load_n(&inode->mover, __ATOMIC_RELAXED);
+
+    if (mover && mover != &me)
+        return FAIL;
+    if (inode->br)
+        brlock_pin(inode->br, 1);
+    else
+        __atomic_add_fetch(&inode->pins, 1, __ATOMIC_RELAXED);
     return SUCCESS;
 }
 
+/*
+ * Unpins a directory pinned with inode_pin.
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+void inode_unpin(int inumber) {
+    inode_t *inode = inode_ref(inumber);
+
+    if (inode->br)
+        brlock_pin(inode->br, -1);
+    else
+        __atomic_sub_fetch(&inode->pins, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Claims a directory to move it. From then on nobody can pin it, so
+ * only the changes that already walked through it are left to finish.
+ * The caller holds it locked for writing. The claim lasts until
+ * inode_move_end, even across the caller letting go of the lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: SUCCESS if it may be moved now, or FAIL if it is still pinned
+ *  or another thread claimed it; the caller must then let go of
+ *  everything and wait (see inode_move_wait)
+ */
+int inode_move_claim(int inumber) {
+    inode_t *inode = inode_ref(inumber);
+    void *mover = __atomic_load_n(&inode->mover, __ATOMIC_RELAXED);
+
+    if (mover && mover != &me)
+        return FAIL;
+    __atomic_store_n(&inode->mover, &me, __ATOMIC_RELAXED);
+    return pin_count(inode) ? FAIL : SUCCESS;
+}
+
+/*
+ * Waits for what stopped a change at a directory: the claim of another
+ * thread to end, or, for one the caller claimed, the pins to go. The
+ * caller must hold no lock nor pin, and no claim but this one.
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+void inode_move_wait(int inumber) {
+    inode_t *inode = inode_ref(inumber);
+
+    for (;;) {
+        void *mover = __atomic_load_n(&inode->mover, __ATOMIC_ACQUIRE);
+
+        if (!mover || (mover == &me && !pin_count(inode)))
+            return;
+        sched_yield();
+    }
+}
+
+/*
+ * Ends a claim of the caller made with inode_move_claim, if it has one.
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+void inode_move_end(int inumber) {
+    inode_t *inode = inode_ref(inumber);
+
+    if (inode && __atomic_load_n(&inode->mover, __ATOMIC_RELAXED) == &me)
+        __atomic_store_n(&inode->mover, NULL, __ATOMIC_RELEASE);
+}
+
+/*
+ * Locks the tree gate. Changes to the tree lock it for reading before
+ * their first i-node and until after their last, so that locking it for
+ * writing waits for every change under way and holds back new ones,
+ * while lookups, which don't take it, go on.
+ * Input:
+ * - p: READ for a change, WRITE to exclude them
+ * Returns: SUCCESS or FAIL
+ */
+int inode_gate_lock(permission p) {
+    switch (p) {
+        case READ:
+            brlock_read_lock(tree_gate);
+            return SUCCESS;
+        case WRITE:
+            brlock_write_lock(tree_gate);
+            return SUCCESS;
+        default:
+            return FAIL;
+    }
+}
+
+/*
+ * Unlocks the tree gate.
+ * Returns: SUCCESS or FAIL
+ */
+int inode_gate_unlock() {
+    brlock_unlock(tree_gate);
+    return SUCCESS;
+}
+
+/*
+ * Fills in the occupancy of the i-node table.
+ * The counters are read without stopping allocation, so under load they
+ * are a consistent-enough estimate rather than an exact snapshot.
+ * Input:
+ *  - stats: where to store the statistics
+ */
+void inode_table_stats(inode_stats *stats) {
+    memset(stats, 0, sizeof(inode_stats));
+    stats->n_shards = n_shards;
+
+    for (int s = 0; s < n_shards; s++) {
+        stats->capacity += (long) __atomic_load_n(&shards[s].n_chunks, __ATOMIC_ACQUIRE) * INODE_CHUNK_SIZE;
+        stats->shard_free[s] = __atomic_load_n(&shards[s].n_free, __ATOMIC_RELAXED);
+        stats->free += stats->shard_free[s];
+    }
+    stats->in_use = stats->capacity - stats->free;
+}
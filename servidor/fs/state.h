@@ -5,34 +5,42 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include "../tecnicofs-api-constants.h"
+#include "directory.h"
+#include "filedata.h"
+#include "brlock.h"
 
 /* FS root inode number */
 #define FS_ROOT 0
 
 #define FREE_INODE -1
-#define INODE_TABLE_SIZE 50
-#define MAX_DIR_ENTRIES 20
-
-#define SUCCESS 0
-#define FAIL -1
-
-#define DELAY 5000
 
+/*
+ * The i-node table is split into shards (one per online core, at most
+ * INODE_MAX_SHARDS). Each shard grows on demand by INODE_CHUNK_SIZE
+ * i-nodes; chunks are never moved, so i-numbers stay stable.
+ * i-number n lives in shard (n % n_shards), slot (n / n_shards).
+ */
+#define INODE_CHUNK_SIZE 1024
+#define INODE_MAX_CHUNKS 4096
+#define INODE_MAX_SHARDS 64
 
 /*
- * Contains the name of the entry and respective i-number
+ * upper bound on the i-nodes one operation keeps locked: paths are
+ * walked hand over hand, so a move holds at most the common ancestor,
+ * both parents and the node moved
  */
-typedef struct dirEntry {
-	char name[MAX_FILE_NAME];
-	int inumber;
-} DirEntry;
+#define MAX_INODES_LOCKED 4
+
+#define SUCCESS 0
+#define FAIL -1
+
 
 /*
- * Data is either text (file) or entries (DirEntry)
+ * Data is either contents (file, NULL while empty) or entries (Directory)
  */
 union Data {
-	char *fileContents; /* for files */
-	DirEntry *dirEntries; /* for directories */
+	FileData *file; /* for files */
+	Directory *dir; /* for directories */
 };
 
 /*
@@ -42,21 +50,84 @@ typedef struct inode_t {
 	type nodeType;
 	union Data data;
     pthread_rwlock_t rwlock;
+	brlock *br; /* used instead of rwlock while set (see inode_bias) */
+	int pins; /* changes that walked through it, not yet done (see inode_pin) */
+	void *mover; /* the thread that claimed it to move it, if any */
+	int next_free; /* next slot on the shard's free list, while T_NONE */
+	unsigned int seq; /* odd while the i-node is being changed (see inode_read_begin) */
+	int open_count; /* open-file table entries referring to this file */
 } inode_t;
 
+/*
+ * The children of a directory as they were when a snapshot was taken,
+ * saved by whichever comes first after it: a change to the directory or
+ * the snapshot's walk (see inode_snapshot_begin).
+ */
+typedef struct snapEntry {
+	char name[MAX_FILE_NAME];
+	int len;
+	int inumber;
+	type nodeType;
+	Directory *dir;   /* of a child directory */
+} SnapEntry;
+
+typedef struct dirSnapshot {
+	int n;
+	SnapEntry entries[];
+} DirSnapshot;
+
+/*
+ * Occupancy of the i-node table, as seen by the free-inode allocator.
+ */
+typedef struct inode_stats {
+	int n_shards;
+	long capacity;  /* i-nodes in allocated chunks */
+	long in_use;
+	long free;      /* i-nodes waiting on the free lists */
+	long shard_free[INODE_MAX_SHARDS];
+} inode_stats;
+
+/* gives the type (and data) of i-node inumber when a table is restored */
+typedef type (*inode_loader)(int inumber, union Data *data, void *arg);
+
+/* called with the children of each directory of a snapshot (NULL if it has none) */
+typedef void (*snapshot_visitor)(int inumber, DirSnapshot *children, void *arg);
+
 
-void insert_delay(int cycles);
 void inode_table_init();
 void inode_table_destroy();
-int inode_create(type nType, int[], int*);
+int inode_table_restore(int n_inodes, inode_loader load, void *arg);
+int inode_create(type nType, int depth, int[], int*);
 int inode_delete(int inumber);
 int inode_get(int inumber, type *nType, union Data *data);
-int inode_set_file(int inumber, char *fileContents, int len);
-int dir_reset_entry(int inumber, int sub_inumber);
+int inode_read(int inumber, long offset, char *buf, int len);
+int inode_write(int inumber, long offset, char *buf, int len);
+void inode_open_count(int inumber, int delta);
+int inode_is_open(int inumber);
+int dir_reset_entry(int inumber, int sub_inumber, char *sub_name);
 int dir_add_entry(int inumber, int sub_inumber, char *sub_name);
-void inode_print_tree(FILE *fp, int inumber, char *name);
+unsigned long inode_snapshot_begin(void (*quiesced)(void *), void *arg);
+void inode_snapshot_end();
+int inode_print_tree(int fd, unsigned long epoch, int format);
+void inode_snapshot_walk(unsigned long epoch, snapshot_visitor visit, void *arg);
+void inode_print_threads(int n);
+void inode_bias_levels(int levels);
+int inode_bias(int inumber);
+void inode_move_depth(int inumber, int depth);
+void inode_table_bias();
 int inode_lock(int inumber, permission p);
 int inode_trylock(int inumber, permission p);
 int inode_unlock(int inumber);
+int inode_pin(int inumber);
+void inode_unpin(int inumber);
+int inode_move_claim(int inumber);
+void inode_move_wait(int inumber);
+void inode_move_end(int inumber);
+int inode_gate_lock(permission p);
+int inode_gate_unlock();
+void inode_table_stats(inode_stats *stats);
+unsigned int inode_read_begin(int inumber);
+int inode_read_validate(int inumber, unsigned int seq);
+int inode_lookup_racy(int inumber, unsigned int seq, char *name);
 
 #endif /* INODES_H */
@@ -0,0 +1,477 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "wal.h"
+
+/*
+ * A record on disk: this header followed by len1 bytes of the first
+ * path and len2 bytes of the second one. crc covers everything after
+ * it, so a record torn by a crash is recognized and dropped at replay.
+ */
+typedef struct wal_record {
+	uint32_t crc;
+	uint16_t len1;
+	uint16_t len2;
+	uint8_t op;
+	uint8_t nodeType;
+	uint16_t reserved;
+} wal_record;
+
+#define WAL_MAX_RECORD (sizeof(wal_record) + 2 * MAX_FILE_NAME)
+
+/*
+ * The log starts with this header. Positions in the log count the bytes
+ * of records since it was created; compacting it after a checkpoint
+ * drops a prefix of records and moves base to the position of the first
+ * one left.
+ */
+typedef struct wal_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t base;
+} wal_header;
+
+#define WAL_MAGIC 0x4C534654  /* "TFSL" */
+#define WAL_VERSION 1
+
+static int log_fd = -1;
+static int log_flags;
+static char *log_path;
+static unsigned long log_base;  /* position of the first record in the file */
+static unsigned long log_end;   /* position after the last record written */
+static durability log_mode;
+static int replaying;
+static uint32_t crc_table[256];
+
+/*
+ * Records appended go to buf; the thread that flushes swaps it with
+ * spare and writes spare without the lock, while others keep appending.
+ * Only one thread flushes at a time.
+ */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static char *buf, *spare;
+static size_t buf_len, buf_cap, spare_cap;
+static unsigned long last_lsn;     /* of the last record appended */
+static unsigned long durable_lsn;  /* every record up to it was flushed */
+static int flushing;
+static unsigned long n_records, n_syncs;
+
+
+static void crc_init() {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++)
+			c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+}
+
+static uint32_t crc32(const char *data, size_t len) {
+	uint32_t c = 0xFFFFFFFF;
+
+	for (size_t i = 0; i < len; i++)
+		c = crc_table[(c ^ (unsigned char) data[i]) & 0xFF] ^ (c >> 8);
+	return c ^ 0xFFFFFFFF;
+}
+
+/*
+ * Writes all of a buffer to the log. A log that can't be written can't
+ * keep its promises, so failing stops the server.
+ */
+static void write_all(int fd, char *data, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("Error: unable to write the log");
+			exit(EXIT_FAILURE);
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+/*
+ * Opens the log, creating it if needed. New records go at its end.
+ * Input:
+ *  - path: the log file
+ *  - mode: how durable a record must be before its operation returns
+ * Returns: SUCCESS or FAIL
+ */
+int wal_open(char *path, durability mode) {
+	struct stat st;
+	wal_header hdr;
+
+	log_flags = O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC;
+	if (mode == WAL_SYNC)
+		log_flags |= O_DSYNC;
+	if ((log_fd = open(path, log_flags, 0600)) < 0 || fstat(log_fd, &st) < 0) {
+		perror("Error: unable to open the log");
+		return FAIL;
+	}
+
+	if (st.st_size < sizeof(wal_header)) {
+		/* new, or torn while being created */
+		memset(&hdr, 0, sizeof(wal_header));
+		hdr.magic = WAL_MAGIC;
+		hdr.version = WAL_VERSION;
+		if (ftruncate(log_fd, 0) < 0) {
+			perror("Error: unable to create the log");
+			return FAIL;
+		}
+		write_all(log_fd, (char *) &hdr, sizeof(wal_header));
+		st.st_size = sizeof(wal_header);
+	} else if (pread(log_fd, &hdr, sizeof(wal_header), 0) != sizeof(wal_header) ||
+	           hdr.magic != WAL_MAGIC || hdr.version != WAL_VERSION) {
+		fprintf(stderr, "Error: %s is not a log\n", path);
+		close(log_fd);
+		log_fd = -1;
+		return FAIL;
+	}
+	log_base = hdr.base;
+	log_end = log_base + st.st_size - sizeof(wal_header);
+	if (!(log_path = strdup(path))) {
+		fprintf(stderr, "Error: No memory allocated for the log.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	crc_init();
+	log_mode = mode;
+	buf_cap = spare_cap = 64 * WAL_MAX_RECORD;
+	if (!(buf = malloc(buf_cap)) || !(spare = malloc(spare_cap))) {
+		fprintf(stderr, "Error: No memory allocated for the log.\n");
+		exit(EXIT_FAILURE);
+	}
+	buf_len = 0;
+	last_lsn = durable_lsn = 0;
+	return SUCCESS;
+}
+
+/*
+ * Flushes whatever is left and closes the log.
+ */
+void wal_close() {
+	if (log_fd < 0)
+		return;
+	wal_commit(last_lsn);
+	if (log_mode != WAL_NONE)
+		fdatasync(log_fd);
+	close(log_fd);
+	log_fd = -1;
+	free(buf);
+	free(spare);
+	free(log_path);
+}
+
+/*
+ * Returns: whether operations are being logged
+ */
+int wal_enabled() {
+	return log_fd >= 0;
+}
+
+/*
+ * Applies every complete record of the log from a position on, in order.
+ * A torn or corrupt tail, left by a crash in the middle of a write, is
+ * cut off.
+ * Input:
+ *  - redo: applies one record
+ *  - from: position of the first record to apply (what a checkpoint
+ *          already holds comes before it)
+ * Returns: number of records applied, or FAIL
+ */
+int wal_replay(wal_redo redo, unsigned long from) {
+	struct stat st;
+	wal_record rec;
+	char *data, path1[MAX_FILE_NAME], path2[MAX_FILE_NAME];
+	size_t off = 0, len, size;
+	int n = 0;
+
+	if (log_fd < 0)
+		return 0;
+	if (from < log_base) {
+		fprintf(stderr, "Error: the log starts at %lu, after the checkpoint (%lu)\n", log_base, from);
+		return FAIL;
+	}
+	if (fstat(log_fd, &st) < 0) {
+		perror("Error: unable to read the log");
+		return FAIL;
+	}
+	size = st.st_size - sizeof(wal_header);
+	if (!(data = malloc(size + 1))) {
+		fprintf(stderr, "Error: No memory allocated for the log.\n");
+		return FAIL;
+	}
+	if (pread(log_fd, data, size, sizeof(wal_header)) != size) {
+		perror("Error: unable to read the log");
+		free(data);
+		return FAIL;
+	}
+
+	/* operations applied now are already in the log */
+	replaying = 1;
+	while (size - off >= sizeof(wal_record)) {
+		memcpy(&rec, data + off, sizeof(wal_record));
+		len = sizeof(wal_record) + rec.len1 + rec.len2;
+		if (rec.len1 >= MAX_FILE_NAME || rec.len2 >= MAX_FILE_NAME || size - off < len ||
+		    crc32(data + off + sizeof(uint32_t), len - sizeof(uint32_t)) != rec.crc)
+			break;
+
+		if (log_base + off >= from) {
+			memcpy(path1, data + off + sizeof(wal_record), rec.len1);
+			path1[rec.len1] = '\0';
+			memcpy(path2, data + off + sizeof(wal_record) + rec.len1, rec.len2);
+			path2[rec.len2] = '\0';
+			redo(rec.op, rec.nodeType, path1, path2);
+			n++;
+		}
+		off += len;
+	}
+	replaying = 0;
+	free(data);
+
+	if (off < size) {
+		fprintf(stderr, "log: dropping %ld bytes of incomplete records\n", (long) (size - off));
+		if (ftruncate(log_fd, sizeof(wal_header) + off) < 0) {
+			perror("Error: unable to truncate the log");
+			return FAIL;
+		}
+		log_end = log_base + off;
+	}
+
+	/* a log newer than the checkpoint: start over where it ends */
+	if (log_end < from) {
+		fprintf(stderr, "log: ends before the checkpoint, starting a new one\n");
+		return wal_truncate(from) == FAIL ? FAIL : n;
+	}
+	return n;
+}
+
+/*
+ * Makes every record appended so far durable and tells where the log
+ * ends. Called with the namespace quiesced (see checkpoint_save), so no
+ * record is appended meanwhile and the position matches the tree.
+ * Returns: the position after the last record, or 0 if nothing is logged
+ */
+unsigned long wal_position() {
+	unsigned long pos;
+
+	if (log_fd < 0)
+		return 0;
+	pthread_mutex_lock(&log_lock);
+	unsigned long lsn = last_lsn;
+	pthread_mutex_unlock(&log_lock);
+	wal_commit(lsn);
+
+	pthread_mutex_lock(&log_lock);
+	pos = log_end;
+	pthread_mutex_unlock(&log_lock);
+	return pos;
+}
+
+/*
+ * Syncs the directory holding a file, so that creating or renaming the
+ * file survives a crash.
+ * Input:
+ *  - path: the file
+ * Returns: SUCCESS or FAIL
+ */
+int fsync_parent(char *path) {
+	char dir[PATH_MAX];
+	char *slash = strrchr(path, '/');
+	int fd, res;
+
+	if (!slash)
+		strcpy(dir, ".");
+	else if (snprintf(dir, sizeof(dir), "%.*s", (int) (slash - path) + 1, path) >= sizeof(dir))
+		return FAIL;
+	if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return FAIL;
+	res = fsync(fd) < 0 ? FAIL : SUCCESS;
+	close(fd);
+	return res;
+}
+
+/*
+ * Compacts the log: the records before a position, which a checkpoint
+ * made durable, are dropped. The records after it are copied to a new
+ * log that replaces the current one atomically; appends wait meanwhile.
+ * Input:
+ *  - upto: position of the first record to keep
+ * Returns: SUCCESS or FAIL (the current log is kept)
+ */
+int wal_truncate(unsigned long upto) {
+	char tmp[PATH_MAX], chunk[64 * 1024];
+	wal_header hdr;
+	int fd, res = FAIL;
+
+	if (log_fd < 0)
+		return SUCCESS;
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", log_path) >= sizeof(tmp))
+		return FAIL;
+
+	pthread_mutex_lock(&log_lock);
+	while (flushing)
+		pthread_cond_wait(&log_cond, &log_lock);
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+		goto out;
+	memset(&hdr, 0, sizeof(wal_header));
+	hdr.magic = WAL_MAGIC;
+	hdr.version = WAL_VERSION;
+	hdr.base = upto;
+	write_all(fd, (char *) &hdr, sizeof(wal_header));
+
+	for (off_t off = sizeof(wal_header) + (off_t) (upto - log_base);
+	     upto < log_end && off < sizeof(wal_header) + (off_t) (log_end - log_base); ) {
+		ssize_t n = pread(log_fd, chunk, sizeof(chunk), off);
+		if (n <= 0) {
+			close(fd);
+			unlink(tmp);
+			goto out;
+		}
+		write_all(fd, chunk, n);
+		off += n;
+	}
+
+	if (fdatasync(fd) < 0 || rename(tmp, log_path) < 0) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	close(fd);
+	fsync_parent(log_path);
+
+	/* from now on appends go to the new log */
+	if ((fd = open(log_path, log_flags, 0600)) < 0) {
+		perror("Error: unable to open the log");
+		exit(EXIT_FAILURE);
+	}
+	close(log_fd);
+	log_fd = fd;
+	log_base = upto;
+	if (log_end < upto)
+		log_end = upto;
+	res = SUCCESS;
+out:
+	pthread_mutex_unlock(&log_lock);
+	return res;
+}
+
+/*
+ * Appends the record of an operation. Called with the operation's locks
+ * still held.
+ * Input:
+ *  - op: 'c', 'd' or 'm'
+ *  - nodeType: type of the node created
+ *  - path1: path of the node
+ *  - path2: where a move puts it, or NULL
+ * Returns: the log sequence number to pass to wal_commit, or 0 if
+ *  nothing was logged
+ */
+unsigned long wal_append(char op, type nodeType, char *path1, char *path2) {
+	char record[WAL_MAX_RECORD];
+	wal_record rec;
+	unsigned long lsn;
+	size_t len;
+
+	if (log_fd < 0 || replaying)
+		return 0;
+
+	memset(&rec, 0, sizeof(wal_record));
+	rec.op = op;
+	rec.nodeType = nodeType;
+	rec.len1 = strlen(path1);
+	rec.len2 = path2 ? strlen(path2) : 0;
+	len = sizeof(wal_record) + rec.len1 + rec.len2;
+	memcpy(record + sizeof(wal_record), path1, rec.len1);
+	if (path2)
+		memcpy(record + sizeof(wal_record) + rec.len1, path2, rec.len2);
+	memcpy(record, &rec, sizeof(wal_record));
+	rec.crc = crc32(record + sizeof(uint32_t), len - sizeof(uint32_t));
+	memcpy(record, &rec, sizeof(wal_record));
+
+	pthread_mutex_lock(&log_lock);
+	lsn = ++last_lsn;
+	n_records++;
+	if (log_mode == WAL_SYNC) {
+		write_all(log_fd, record, len);
+		log_end += len;
+		durable_lsn = lsn;
+		n_syncs++;
+	} else {
+		if (buf_len + len > buf_cap) {
+			buf_cap *= 2;
+			if (!(buf = realloc(buf, buf_cap))) {
+				fprintf(stderr, "Error: No memory allocated for the log.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		memcpy(buf + buf_len, record, len);
+		buf_len += len;
+	}
+	pthread_mutex_unlock(&log_lock);
+	return lsn;
+}
+
+/*
+ * Waits until a record is durable (as the log's mode defines it). The
+ * first thread to wait flushes every record appended so far, with one
+ * write and one fdatasync; the others wait for it, and whatever they
+ * append meanwhile goes in the next flush. Called without locks held.
+ * Input:
+ *  - lsn: what wal_append returned
+ */
+void wal_commit(unsigned long lsn) {
+	pthread_mutex_lock(&log_lock);
+	while (durable_lsn < lsn) {
+		if (flushing) {
+			pthread_cond_wait(&log_cond, &log_lock);
+			continue;
+		}
+
+		char *data = buf;
+		size_t len = buf_len, cap = buf_cap;
+		unsigned long upto = last_lsn;
+		flushing = 1;
+		buf = spare;
+		buf_cap = spare_cap;
+		buf_len = 0;
+		pthread_mutex_unlock(&log_lock);
+
+		write_all(log_fd, data, len);
+		if (log_mode == WAL_BATCH && fdatasync(log_fd) < 0) {
+			perror("Error: unable to sync the log");
+			exit(EXIT_FAILURE);
+		}
+
+		pthread_mutex_lock(&log_lock);
+		spare = data;
+		spare_cap = cap;
+		durable_lsn = upto;
+		log_end += len;
+		n_syncs++;
+		flushing = 0;
+		pthread_cond_broadcast(&log_cond);
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+/*
+ * Instrumentation: records appended and flushes done so far.
+ */
+void wal_stats(unsigned long *records, unsigned long *syncs) {
+	pthread_mutex_lock(&log_lock);
+	*records = n_records;
+	*syncs = n_syncs;
+	pthread_mutex_unlock(&log_lock);
+}
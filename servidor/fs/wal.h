@@ -0,0 +1,34 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include "state.h"
+
+/*
+ * Write-ahead (redo) log of the namespace. Every create, delete and move
+ * that succeeds appends a record while it still holds its locks, so the
+ * records of conflicting operations are in the order they were applied,
+ * and waits for the record to be durable after unlocking, before the
+ * client is answered. init_fs replays the log to rebuild the tree, on
+ * top of the last checkpoint if there is one (see checkpoint.h).
+ */
+typedef enum durability {
+	WAL_NONE,   /* records are written; the OS decides when they reach the disk */
+	WAL_BATCH,  /* group commit: one fdatasync covers every thread waiting */
+	WAL_SYNC    /* each record is written through (O_DSYNC) as it is appended */
+} durability;
+
+/* applies a replayed record: op is 'c', 'd' or 'm'; path2 is only for 'm' */
+typedef void (*wal_redo)(char op, type nodeType, char *path1, char *path2);
+
+int wal_open(char *path, durability mode);
+void wal_close();
+int wal_enabled();
+int wal_replay(wal_redo redo, unsigned long from);
+unsigned long wal_append(char op, type nodeType, char *path1, char *path2);
+void wal_commit(unsigned long lsn);
+unsigned long wal_position();
+int wal_truncate(unsigned long upto);
+int fsync_parent(char *path);
+void wal_stats(unsigned long *records, unsigned long *syncs);
+
+#endif /* WAL_H */
@@ -1,22 +1,133 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "fs/operations.h"
+#include "fs/wal.h"
+#include "fs/checkpoint.h"
 #include "tecnicofs-api-constants.h"
 
 #define MAX_INPUT_SIZE 100
 
+/* largest number of datagrams a thread takes per batch */
+#define MAX_BATCH 256
+
 /* number of execution threads */
 int numberThreads = 0;
 
+/* datagrams received and replied per system call (-b) */
+int batchSize = 16;
+/* how long a thread keeps filling a partial batch, in microseconds (-l) */
+long batchLatency = 0;
+
+/* socket type the server listens on (-t) */
+int transport = SOCK_DGRAM;
+
+/* whether print may write to paths named by clients (-d turns it off) */
+int printToPaths = TRUE;
+
+/* write-ahead log of the namespace (-w) and how durable its records are (-D) */
+char *logPath = NULL;
+durability logMode = WAL_BATCH;
+
+/* checkpoint image of the namespace (-C) and seconds between checkpoints (-c) */
+char *checkpointPath = NULL;
+int checkpointInterval = 60;
+
+/* threads a print is split across (-P), by default one per CPU */
+int printThreads = 0;
+
+/* levels of directories, from the root down, with big-reader locks (-B) */
+int biasLevels = 2;
+
 char * serverName;
 int sockfd; 
-struct sockaddr_un server_addr, client_addr; 
-socklen_t addrlen;
+struct sockaddr_un server_addr; 
+
+/* connection-oriented transports: every connection is registered here */
+int epfd;
+
+/* clients served through shared-memory rings at once, one thread each */
+#define MAX_SHM_SESSIONS 64
+int shmSessions = 0;
+
+/* times a ring consumer polls before sleeping in a futex, if other CPUs
+ * can make progress meanwhile (with one CPU polling only delays them) */
+#define SHM_SPINS 2000
+int shmSpins = 0;
+
+/* per-connection buffers of the connection-oriented transports */
+#define CONN_BUF_SIZE (2 * TFS_MAX_MESSAGE)
+#define CONN_MAX_REPLIES 16
+
+/*
+ * State of one request: the message received, who sent it and the reply.
+ * The message is either a text command or a binary tfs_request; the
+ * reply is a bare int for the former and a tfs_response, maybe followed
+ * by batch results, for the latter. A dump also passes a descriptor back,
+ * and an attach passes one in.
+ */
+typedef struct request_ctx {
+    char command[TFS_MAX_MESSAGE + 1];
+    size_t len;
+    const void *session; /* connection or shared-memory session, NULL for a datagram */
+    struct sockaddr_un client_addr;
+    socklen_t addrlen;
+    char reply[TFS_MAX_RESPONSE];
+    size_t reply_len;
+    int reply_fd; /* descriptor passed along with the reply, or -1 */
+    int request_fd; /* descriptor passed along with the request, or -1 */
+    char control[CMSG_SPACE(sizeof(int))];
+} request_ctx;
+
+/*
+ * A batch of requests, received with one recvmmsg and answered with one
+ * sendmmsg. Each worker thread owns one, with batchSize entries.
+ */
+typedef struct request_batch {
+    request_ctx *reqs;
+    struct iovec *iovs;
+    struct mmsghdr *msgs;
+} request_batch;
+
+/* a reply waiting to be sent on a connection */
+typedef struct reply_slot {
+    char data[TFS_MAX_RESPONSE];
+    size_t len;
+    int fd; /* descriptor to pass with it, or -1 */
+} reply_slot;
+
+/*
+ * A client connection. It is armed in epoll with EPOLLONESHOT, so at most
+ * one worker serves it at a time and its requests are applied in order.
+ */
+typedef struct connection {
+    int fd;
+    char in[CONN_BUF_SIZE];   /* bytes received and not yet applied */
+    size_t in_len;
+    reply_slot out[CONN_MAX_REPLIES]; /* replies not yet sent */
+    int n_out;
+    size_t out_off;           /* bytes of out[0] already sent */
+    int in_fd;                /* descriptor received for the next request, or -1 */
+} connection;
+
+static int attachSession(int fd);
 
 /*
  * Creates the threads vector
@@ -42,7 +153,7 @@ pthread_t * create_threads_vec(int numT) {
  * Auxiliary function
  */ 
 static void displayUsage (const char* appName) {
-    printf("Usage: %s num_threads socket_name\n", appName);
+    printf("Usage: %s num_threads socket_name [-b batch_size] [-l batch_latency_us] [-t dgram|stream|seqpacket] [-d] [-w log_file [-D none|batch|sync]] [-C checkpoint_file [-c interval_s]] [-P print_threads] [-B bias_levels]\n", appName);
     exit(EXIT_FAILURE);
 }
 
@@ -50,20 +161,95 @@ static void displayUsage (const char* appName) {
  * Parsing the execution arguments
  */ 
 static void parseArgs (long argc, char* const argv[]) {
-    if (argc != 3) {
+    int opt;
+    char *end;
+
+    while ((opt = getopt(argc, argv, "b:l:t:dw:D:C:c:P:B:")) != -1) {
+        switch (opt) {
+            case 'b':
+                batchSize = strtol(optarg, &end, 10);
+                if (*end != '\0' || batchSize < 1 || batchSize > MAX_BATCH) {
+                    fprintf(stderr, "Error: batch size must be between 1 and %d.\n", MAX_BATCH);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                batchLatency = strtol(optarg, &end, 10);
+                if (*end != '\0' || batchLatency < 0) {
+                    fprintf(stderr, "Error: Invalid batch latency.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'd':
+                printToPaths = FALSE;
+                break;
+            case 'w':
+                logPath = optarg;
+                break;
+            case 'D':
+                if (!strcmp(optarg, "none"))
+                    logMode = WAL_NONE;
+                else if (!strcmp(optarg, "batch"))
+                    logMode = WAL_BATCH;
+                else if (!strcmp(optarg, "sync"))
+                    logMode = WAL_SYNC;
+                else
+                    displayUsage(argv[0]);
+                break;
+            case 'C':
+                checkpointPath = optarg;
+                break;
+            case 'c':
+                checkpointInterval = strtol(optarg, &end, 10);
+                if (*end != '\0' || checkpointInterval < 1) {
+                    fprintf(stderr, "Error: Invalid checkpoint interval.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                printThreads = strtol(optarg, &end, 10);
+                if (*end != '\0' || printThreads < 1) {
+                    fprintf(stderr, "Error: Invalid number of print threads.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'B':
+                biasLevels = strtol(optarg, &end, 10);
+                if (*end != '\0' || biasLevels < 0) {
+                    fprintf(stderr, "Error: Invalid number of bias levels.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                if (!strcmp(optarg, "dgram"))
+                    transport = SOCK_DGRAM;
+                else if (!strcmp(optarg, "stream"))
+                    transport = SOCK_STREAM;
+                else if (!strcmp(optarg, "seqpacket"))
+                    transport = SOCK_SEQPACKET;
+                else
+                    displayUsage(argv[0]);
+                break;
+            default:
+                displayUsage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2) {
         fprintf(stderr, "Invalid format:\n");
         displayUsage(argv[0]);
     }
+    argv += optind - 1;
 
     // argv[1] is the number of threads
-    if((numberThreads = * argv[1] - '0') < 1){ /* ERROR CASE */
+    numberThreads = strtol(argv[1], &end, 10);
+    if(*end != '\0' || numberThreads < 1){ /* ERROR CASE */
         fprintf(stderr, "Error: Invalid number of threads.\n");
         exit(EXIT_FAILURE);
     }
 
     // argv[2] is the server socket name
-    serverName = (char *)malloc(sizeof(char) * (strlen(argv[2])+1));
-    strcpy(serverName, argv[2]);
+    serverName = argv[2];
 }
 
 /*
@@ -75,69 +261,871 @@ void errorParse(){
 }
 
 /*
- * Executes the commands in the commands vector
+ * Applies one command.
+ * Input:
+ *  - command: the command received from a client
+ * Returns: the result to send back to the client
  */
-void applyCommands() {
-    while (1){
-        
-        char command[MAX_INPUT_SIZE];
-        int c;
-
-        /* receiving the command to apply */
-        addrlen = sizeof(struct sockaddr_un);
-        c = recvfrom(sockfd, command, sizeof(command)-1, 0, (struct sockaddr *)&client_addr, &addrlen);
-        if (c <= 0) {
-            perror("server: recvfrom error");
+int applyCommand(char *command) {
+    char token/*, type*/;
+    char name[MAX_INPUT_SIZE], sec_argument[MAX_INPUT_SIZE];
+    int numTokens = sscanf(command, "%c %99s %99s", &token, name, sec_argument);
+    /* a malformed command only fails, as any client can send one */
+    if (numTokens < 2 || (numTokens < 3 && (token == 'c' || token == 'm'))) {
+        fprintf(stderr, "Error: invalid command in Queue\n");
+        return FAIL;
+    }
+
+    int res;
+    switch (token) {
+        case 'c':
+            switch (sec_argument[0]) {
+                case 'f':
+                    res = create(name, T_FILE);
+                    break;
+                case 'd':
+                    res = create(name, T_DIRECTORY);
+                    break;
+                default:
+                    fprintf(stderr, "Error: invalid node type\n");
+                    return FAIL;
+            }
+            break;
+        case 'l': 
+            res = lookup(name);
+            break;
+        case 'd':
+            res = delete(name);
+            break;
+        case 'm':
+            res = move(name, sec_argument);
+            break;
+        case 'p':
+            res = printToPaths == TRUE ? print(name, TFS_PRINT_PLAIN) : FAIL;
+            break;
+        default: { /* error */
+            fprintf(stderr, "Error: command to apply\n");
+            return FAIL;
+        }
+    }
+    return res;
+}
+
+/* opcodes whose first argument is a path */
+static const char PATH_OPCODES[] = { TFS_OP_CREATE, TFS_OP_DELETE, TFS_OP_LOOKUP, TFS_OP_MOVE,
+                                     TFS_OP_PRINT, TFS_OP_OPEN, TFS_OP_BATCH, '\0' };
+
+/*
+ * Length of a binary request, from its header.
+ * Returns: the length or FAIL if the header is invalid
+ */
+static int requestLength(tfs_request *hdr) {
+    size_t max_len2 = MAX_FILE_NAME - 1;
+
+    if (hdr->opcode == TFS_OP_BATCH)
+        max_len2 = TFS_MAX_BATCH_PAYLOAD;
+    else if (hdr->opcode == TFS_OP_WRITE)
+        max_len2 = TFS_MAX_IO;
+
+    if (hdr->len1 >= MAX_FILE_NAME || hdr->len2 > max_len2)
+        return FAIL;
+
+    /* paths are never empty (the root is "/"), as in the text commands */
+    if (hdr->len1 == 0 && strchr(PATH_OPCODES, hdr->opcode))
+        return FAIL;
+    if (hdr->len2 == 0 && hdr->opcode == TFS_OP_MOVE)
+        return FAIL;
+    return sizeof(tfs_request) + hdr->len1 + hdr->len2;
+}
+
+/*
+ * Who owns the files a request opens: the connection or session it came
+ * through or, for a datagram, the name of the client's socket.
+ * Input:
+ *  - req: the request
+ *  - owner: set to the owner
+ */
+static void requestOwner(request_ctx *req, fd_owner *owner) {
+    size_t len = req->addrlen - offsetof(struct sockaddr_un, sun_path);
+
+    memset(owner, 0, sizeof(fd_owner));
+    owner->session = req->session;
+    if (!req->session && req->addrlen > offsetof(struct sockaddr_un, sun_path))
+        memcpy(owner->name, req->client_addr.sun_path, len < OWNER_NAME_SIZE ? len : OWNER_NAME_SIZE);
+}
+
+/*
+ * Applies a batch request.
+ * Input:
+ *  - dir: the directory the batch applies to
+ *  - payload: the tfs_batch_op entries and their names
+ *  - len: size of payload
+ *  - results: filled with the result of each operation
+ *  - n_results: set to the number of operations
+ * Returns: SUCCESS or FAIL
+ */
+static int applyBatch(char *dir, char *payload, size_t len, int results[], int *n_results) {
+    batch_op ops[TFS_MAX_BATCH];
+    char names[TFS_MAX_BATCH][MAX_FILE_NAME];
+    tfs_batch_op op;
+    size_t off = 0;
+    int n = 0;
+
+    while (off < len) {
+        if (n == TFS_MAX_BATCH || len - off < sizeof(tfs_batch_op))
+            return FAIL;
+        memcpy(&op, payload + off, sizeof(tfs_batch_op));
+        off += sizeof(tfs_batch_op);
+        if (op.len >= MAX_FILE_NAME || len - off < op.len)
+            return FAIL;
+        if (op.opcode != TFS_OP_CREATE && op.opcode != TFS_OP_DELETE && op.opcode != TFS_OP_LOOKUP)
+            return FAIL;
+
+        memcpy(names[n], payload + off, op.len);
+        names[n][op.len] = '\0';
+        off += op.len;
+        ops[n].op = op.opcode;
+        ops[n].nodeType = op.flags & TFS_FLAG_DIRECTORY ? T_DIRECTORY : T_FILE;
+        ops[n].name = names[n];
+        n++;
+    }
+
+    fs_error = 0;
+    if (batch(dir, ops, n, results) == FAIL)
+        return FAIL;
+    *n_results = n;
+    return SUCCESS;
+}
+
+/*
+ * Applies one binary request and builds its response.
+ * Malformed requests get TECNICOFS_ERROR_OTHER back instead of stopping
+ * the server.
+ * Input:
+ *  - req: the request, with command holding len bytes
+ */
+static void applyRequest(request_ctx *req) {
+    tfs_request hdr;
+    tfs_response reply;
+    tfs_io io;
+    fd_owner owner;
+    char name[MAX_FILE_NAME], sec_argument[MAX_FILE_NAME];
+    char *arg2 = req->command + sizeof(tfs_request);
+    char *data = req->reply + sizeof(tfs_response);
+    int results[TFS_MAX_BATCH];
+    int res = FAIL, data_len = 0;
+
+    memset(&reply, 0, sizeof(tfs_response));
+    reply.magic = TFS_PROTO_MAGIC;
+    reply.version = TFS_PROTO_VERSION;
+    fs_error = TECNICOFS_ERROR_OTHER;
+
+    if (req->len < sizeof(tfs_request))
+        goto out;
+    memcpy(&hdr, req->command, sizeof(tfs_request));
+    reply.req_id = hdr.req_id;
+    if (hdr.version != TFS_PROTO_VERSION || requestLength(&hdr) != req->len)
+        goto out;
+
+    memcpy(name, req->command + sizeof(tfs_request), hdr.len1);
+    name[hdr.len1] = '\0';
+    arg2 += hdr.len1;
+
+    if (hdr.opcode == TFS_OP_BATCH) {
+        int n_results = 0;
+        res = applyBatch(name, arg2, hdr.len2, results, &n_results);
+        data_len = sizeof(int) * n_results;
+        memcpy(data, results, data_len);
+        goto out;
+    }
+
+    /* operations on open files name them with a tfs_io */
+    if (hdr.opcode == TFS_OP_CLOSE || hdr.opcode == TFS_OP_READ || hdr.opcode == TFS_OP_WRITE) {
+        if (hdr.len1 != sizeof(tfs_io))
+            goto out;
+        memcpy(&io, name, sizeof(tfs_io));
+        if (io.count < 0 || io.count > TFS_MAX_IO || (hdr.opcode == TFS_OP_WRITE && io.count != hdr.len2))
+            goto out;
+    }
+
+    if (hdr.opcode != TFS_OP_WRITE) {
+        memcpy(sec_argument, arg2, hdr.len2);
+        sec_argument[hdr.len2] = '\0';
+    }
+
+    if (hdr.opcode == TFS_OP_OPEN || hdr.opcode == TFS_OP_CLOSE || hdr.opcode == TFS_OP_READ ||
+        hdr.opcode == TFS_OP_WRITE || hdr.opcode == TFS_OP_UNMOUNT)
+        requestOwner(req, &owner);
+
+    fs_error = 0;
+    switch (hdr.opcode) {
+        case TFS_OP_CREATE:
+            res = create(name, hdr.flags & TFS_FLAG_DIRECTORY ? T_DIRECTORY : T_FILE);
+            break;
+        case TFS_OP_LOOKUP:
+            res = lookup(name);
+            break;
+        case TFS_OP_DELETE:
+            res = delete(name);
+            break;
+        case TFS_OP_MOVE:
+            res = move(name, sec_argument);
+            break;
+        case TFS_OP_PRINT:
+            if (printToPaths == TRUE)
+                res = print(name, hdr.flags);
+            else
+                fs_error = TECNICOFS_ERROR_OTHER;
+            break;
+        case TFS_OP_OPEN:
+            res = open_file(name, hdr.flags, &owner);
+            break;
+        case TFS_OP_CLOSE:
+            res = close_file(io.fd, &owner);
+            break;
+        case TFS_OP_READ:
+            res = read_file(io.fd, &owner, io.offset, data, io.count);
+            data_len = res > 0 ? res : 0;
+            break;
+        case TFS_OP_WRITE:
+            res = write_file(io.fd, &owner, io.offset, arg2, io.count);
+            break;
+        case TFS_OP_UNMOUNT:
+            close_files(&owner);
+            fs_error = 0;
+            res = SUCCESS;
+            break;
+        case TFS_OP_ATTACH:
+            res = attachSession(req->request_fd);
+            req->request_fd = -1;
+            break;
+        case TFS_OP_DUMP:
+            if ((res = dump(hdr.flags)) >= 0) {
+                req->reply_fd = res;
+                res = SUCCESS;
+            }
+            break;
+        default:
+            fs_error = TECNICOFS_ERROR_OTHER;
+    }
+
+out:
+    reply.result = res;
+    reply.data_len = data_len;
+    if (res < 0)
+        reply.error = fs_error ? fs_error : TECNICOFS_ERROR_OTHER;
+    memcpy(req->reply, &reply, sizeof(tfs_response));
+    req->reply_len = sizeof(tfs_response) + data_len;
+}
+
+/*
+ * Applies one request, in whichever format it came.
+ * Input:
+ *  - req: the request
+ */
+static void handleRequest(request_ctx *req) {
+    req->reply_fd = -1;
+    if (req->len > 0 && (unsigned char) req->command[0] == TFS_PROTO_MAGIC) {
+        applyRequest(req);
+    } else {
+        int res = applyCommand(req->command);
+        memcpy(req->reply, &res, sizeof(int));
+        req->reply_len = sizeof(int);
+    }
+
+    /* a descriptor the request had no use for */
+    if (req->request_fd >= 0) {
+        close(req->request_fd);
+        req->request_fd = -1;
+    }
+}
+
+/*
+ * Takes the descriptor passed in a received message.
+ * Input:
+ *  - msg: the message
+ * Returns: the first descriptor, or -1; any others are closed
+ */
+static int takeFd(struct msghdr *msg) {
+    struct cmsghdr *cmsg;
+    int fd, taken = -1;
+
+    if (msg->msg_controllen == 0)
+        return -1;
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        for (size_t i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++) {
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (taken < 0)
+                taken = fd;
+            else
+                close(fd);
+        }
+    }
+    return taken;
+}
+
+static long futex(uint32_t *addr, int op, uint32_t val, struct timespec *timeout) {
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+/*
+ * Waits until a ring has a slot to consume: polls for a while, then
+ * sleeps until the producer wakes us up.
+ * Input:
+ *  - shm: the session
+ *  - ring: the ring, of which we are the consumer
+ * Returns: SUCCESS, or FAIL once the client unmounted or went away
+ */
+static int ringWait(tfs_shm *shm, tfs_ring *ring) {
+    struct timespec timeout = { 1, 0 };
+    uint32_t tail = ring->tail;
+
+    for (int spins = 0; ; spins++) {
+        if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != tail)
+            return SUCCESS;
+        if (__atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE))
+            return FAIL;
+        if (spins < shmSpins) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+            continue;
+        }
+
+        /* the producer checks waiting after publishing, so no wakeup is lost */
+        __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail &&
+            !__atomic_load_n(&shm->closed, __ATOMIC_SEQ_CST) &&
+            futex(&ring->head, FUTEX_WAIT, tail, &timeout) < 0 && errno == ETIMEDOUT &&
+            kill(shm->client_pid, 0) < 0 && errno == ESRCH)
+            return FAIL;
+        __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+        spins = 0;
+    }
+}
+
+/*
+ * Publishes the next slot of a ring and wakes its consumer if it sleeps.
+ * Input:
+ *  - ring: the ring, of which we are the producer
+ */
+static void ringPublish(tfs_ring *ring) {
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST))
+        futex(&ring->head, FUTEX_WAKE, 1, NULL);
+}
+
+/*
+ * Serves one client through its rings, until it unmounts or goes away.
+ * The client never has more requests outstanding than a ring has slots,
+ * so there is always room for the responses. The files it left open are
+ * closed when it is done.
+ */
+static void * serveShm(void *arg) {
+    tfs_shm *shm = arg;
+    tfs_ring *in = &shm->requests, *out = &shm->responses;
+    fd_owner owner = { .session = shm };
+    request_ctx *req;
+
+    if (!(req = malloc(sizeof(request_ctx)))) {
+        fprintf(stderr, "Error: No memory allocated for requests.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (ringWait(shm, in) == SUCCESS) {
+        tfs_ring_slot *slot = &in->slots[in->tail % TFS_RING_SLOTS];
+        req->len = slot->len < TFS_MAX_MESSAGE ? slot->len : TFS_MAX_MESSAGE;
+        memcpy(req->command, slot->data, req->len);
+        req->command[req->len] = '\0';
+        req->request_fd = -1;
+        req->session = shm;
+        __atomic_store_n(&in->tail, in->tail + 1, __ATOMIC_RELEASE);
+
+        handleRequest(req);
+        /* descriptors don't go through memory (the client doesn't ask for them) */
+        if (req->reply_fd >= 0)
+            close(req->reply_fd);
+
+        /* a client that doesn't respect the window only stalls itself */
+        while (out->head - __atomic_load_n(&out->tail, __ATOMIC_ACQUIRE) == TFS_RING_SLOTS) {
+            if (__atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE))
+                goto out;
+            usleep(100);
+        }
+        slot = &out->slots[out->head % TFS_RING_SLOTS];
+        slot->len = req->reply_len;
+        memcpy(slot->data, req->reply, req->reply_len);
+        ringPublish(out);
+    }
+
+out:
+    free(req);
+    close_files(&owner);
+    munmap(shm, sizeof(tfs_shm));
+    __atomic_fetch_sub(&shmSessions, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/*
+ * Starts serving a client through the shared-memory rings it passed.
+ * Input:
+ *  - fd: the memory file holding the client's tfs_shm, sealed against
+ *    shrinking, which we close
+ * Returns: SUCCESS or FAIL
+ */
+static int attachSession(int fd) {
+    struct stat st;
+    tfs_shm *shm = MAP_FAILED;
+    pthread_t tid;
+    pthread_attr_t attr;
+    int seals;
+
+    fs_error = TECNICOFS_ERROR_OTHER;
+    if (fd < 0)
+        return FAIL;
+    /* a file that could shrink under the mapping would kill us with SIGBUS */
+    seals = fcntl(fd, F_GET_SEALS);
+    if (seals >= 0 && (seals & F_SEAL_SHRINK) && fstat(fd, &st) == 0 && st.st_size >= sizeof(tfs_shm))
+        shm = mmap(NULL, sizeof(tfs_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+        return FAIL;
+
+    if (__atomic_add_fetch(&shmSessions, 1, __ATOMIC_RELAXED) > MAX_SHM_SESSIONS) {
+        fprintf(stderr, "Error: too many shared-memory sessions\n");
+        __atomic_fetch_sub(&shmSessions, 1, __ATOMIC_RELAXED);
+        munmap(shm, sizeof(tfs_shm));
+        return FAIL;
+    }
+
+    shm->server_pid = getpid();
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, serveShm, shm) != 0) {
+        fprintf(stderr, "Error: Unable to create session thread.\n");
+        __atomic_fetch_sub(&shmSessions, 1, __ATOMIC_RELAXED);
+        munmap(shm, sizeof(tfs_shm));
+        pthread_attr_destroy(&attr);
+        return FAIL;
+    }
+    pthread_attr_destroy(&attr);
+    return SUCCESS;
+}
+
+/*
+ * Microseconds left until a deadline.
+ */
+static long usecs_until(struct timespec *deadline) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (deadline->tv_sec - now.tv_sec) * 1000000L + (deadline->tv_nsec - now.tv_nsec) / 1000;
+}
+
+/*
+ * Receives a batch of commands: blocks for the first one, takes whatever
+ * else is already queued and, if batchLatency allows it, waits a little
+ * for more until the batch is full.
+ * Input:
+ *  - b: this thread's batch
+ * Returns: number of commands received
+ */
+static int receiveBatch(request_batch *b) {
+    int n = 0, c, flags = MSG_WAITFORONE;
+    struct timespec deadline;
+
+    for (int i = 0; i < batchSize; i++) {
+        b->iovs[i].iov_base = b->reqs[i].command;
+        b->iovs[i].iov_len = TFS_MAX_MESSAGE;
+        memset(&b->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        b->msgs[i].msg_hdr.msg_name = &b->reqs[i].client_addr;
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+        b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+        b->msgs[i].msg_hdr.msg_control = b->reqs[i].control;
+        b->msgs[i].msg_hdr.msg_controllen = sizeof(b->reqs[i].control);
+    }
+
+    while (n < batchSize) {
+        c = recvmmsg(sockfd, &b->msgs[n], batchSize - n, flags | MSG_CMSG_CLOEXEC, NULL);
+        if (c < 0 && n > 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            c = 0;
+        else if (c <= 0) {
+            perror("server: recvmmsg error");
             exit(EXIT_FAILURE);
         }
-        command[c] = '\0'; 
 
-        char token/*, type*/;
-        char name[MAX_INPUT_SIZE], sec_argument[MAX_INPUT_SIZE];
-        int numTokens = sscanf(command, "%c %s %s", &token, name, sec_argument);
-        if (numTokens < 2) {
-            fprintf(stderr, "Error: invalid command in Queue\n");
+        if (n == 0 && batchLatency > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += (batchLatency % 1000000) * 1000;
+            deadline.tv_sec += batchLatency / 1000000 + deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+        }
+        n += c;
+
+        /* wait for more only while the latency cap allows it */
+        long left;
+        if (n == batchSize || batchLatency == 0 || (left = usecs_until(&deadline)) <= 0)
+            break;
+        struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+        struct timespec timeout = { left / 1000000, (left % 1000000) * 1000 };
+        if (ppoll(&pfd, 1, &timeout, NULL) <= 0)
+            break;
+        flags = MSG_DONTWAIT;
+    }
+
+    for (int i = 0; i < n; i++) {
+        b->reqs[i].command[b->msgs[i].msg_len] = '\0';
+        b->reqs[i].len = b->msgs[i].msg_len;
+        b->reqs[i].addrlen = b->msgs[i].msg_hdr.msg_namelen;
+        b->reqs[i].session = NULL;
+        b->reqs[i].request_fd = takeFd(&b->msgs[i].msg_hdr);
+    }
+    return n;
+}
+
+/*
+ * Attaches a descriptor to a message, as SCM_RIGHTS.
+ * Input:
+ *  - msg: the message
+ *  - control: room for the control message, CMSG_SPACE(sizeof(int))
+ *  - fd: the descriptor, or -1 for none
+ */
+static void attachFd(struct msghdr *msg, char *control, int fd) {
+    struct cmsghdr *cmsg;
+
+    if (fd < 0) {
+        msg->msg_control = NULL;
+        msg->msg_controllen = 0;
+        return;
+    }
+    msg->msg_control = control;
+    msg->msg_controllen = CMSG_SPACE(sizeof(int));
+    cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+}
+
+/*
+ * Sends the results of a batch, each to the client that sent the command.
+ * Input:
+ *  - b: this thread's batch
+ *  - n: number of commands in the batch
+ */
+static void replyBatch(request_batch *b, int n) {
+    for (int i = 0; i < n; i++) {
+        b->iovs[i].iov_base = b->reqs[i].reply;
+        b->iovs[i].iov_len = b->reqs[i].reply_len;
+        memset(&b->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        b->msgs[i].msg_hdr.msg_name = &b->reqs[i].client_addr;
+        b->msgs[i].msg_hdr.msg_namelen = b->reqs[i].addrlen;
+        b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+        attachFd(&b->msgs[i].msg_hdr, b->reqs[i].control, b->reqs[i].reply_fd);
+    }
+
+    for (int sent = 0; sent < n; ) {
+        int c = sendmmsg(sockfd, &b->msgs[sent], n - sent, 0);
+        if (c < 0 && (errno == ECONNREFUSED || errno == ENOENT)) {
+            /* the client went away without unmounting */
+            fd_owner owner;
+            requestOwner(&b->reqs[sent], &owner);
+            close_files(&owner);
+            c = 1;
+        } else if (c < 0) {
+            perror("server: sendmmsg error");
             exit(EXIT_FAILURE);
         }
+        sent += c;
+    }
 
-        int res;
-        switch (token) {
-            case 'c':
-                switch (sec_argument[0]) {
-                    case 'f':
-                        res = create(name, T_FILE);
-                        break;
-                    case 'd':
-                        res = create(name, T_DIRECTORY);
-                        break;
-                    default:
-                        fprintf(stderr, "Error: invalid node type\n");
-                        exit(EXIT_FAILURE);
-                }
-                break;
-            case 'l': 
-                res = lookup(name);
-                break;
-            case 'd':
-                res = delete(name);
-                break;
-            case 'm':
-                res = move(name, sec_argument);
-                break;
-            case 'p':
-                res = print(name);
-                break;
-            default: { /* error */
-                fprintf(stderr, "Error: command to apply\n");
-                exit(EXIT_FAILURE);
-            }
+    /* the clients have their own copies of the descriptors now */
+    for (int i = 0; i < n; i++)
+        if (b->reqs[i].reply_fd >= 0)
+            close(b->reqs[i].reply_fd);
+}
+
+/*
+ * Receives commands in batches, applies them and replies to whoever sent
+ * them, with one system call per batch in each direction.
+ * Input:
+ *  - b: this thread's batch
+ */
+void applyCommands(request_batch *b) {
+    while (1){
+        /* receiving the commands to apply */
+        int n = receiveBatch(b);
+
+        for (int i = 0; i < n; i++)
+            handleRequest(&b->reqs[i]);
+
+        /* sending the results of applying the commands */
+        replyBatch(b, n);
+    }
+}
+
+/*
+ * Registers (or re-arms) a connection in epoll for one event.
+ * Input:
+ *  - c: the connection, NULL for the listening socket
+ *  - op: EPOLL_CTL_ADD or EPOLL_CTL_MOD
+ *  - events: the events to wait for
+ */
+static void armConnection(connection *c, int op, uint32_t events) {
+    struct epoll_event ev = { .events = events | EPOLLONESHOT, .data.ptr = c };
+
+    if (epoll_ctl(epfd, op, c ? c->fd : sockfd, &ev) < 0) {
+        perror("server: epoll_ctl error");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Closes a connection and frees it, with the files its client left open.
+ */
+static void closeConnection(connection *c) {
+    fd_owner owner = { .session = c };
+
+    close_files(&owner);
+    for (int i = 0; i < c->n_out; i++)
+        if (c->out[i].fd >= 0)
+            close(c->out[i].fd);
+    if (c->in_fd >= 0)
+        close(c->in_fd);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c);
+}
+
+/*
+ * Accepts every pending connection and registers it.
+ */
+static void acceptConnections() {
+    int fd;
+    connection *c;
+
+    while ((fd = accept4(sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if (!(c = malloc(sizeof(connection)))) {
+            fprintf(stderr, "Error: No memory allocated for connection.\n");
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->in_len = 0;
+        c->n_out = 0;
+        c->out_off = 0;
+        c->in_fd = -1;
+        armConnection(c, EPOLL_CTL_ADD, EPOLLIN);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR)
+        perror("server: accept error");
+
+    armConnection(NULL, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+/*
+ * Length of the first complete request in a connection's input.
+ * With SOCK_SEQPACKET the input is always exactly one message; with
+ * SOCK_STREAM binary requests are delimited by their header and text
+ * commands by their terminating '\0'.
+ * Returns: the length, 0 if the request is still incomplete, or FAIL
+ *  if the input is malformed
+ */
+static int frameLength(connection *c) {
+    tfs_request hdr;
+    char *end;
+
+    if (c->in_len == 0 || transport == SOCK_SEQPACKET)
+        return c->in_len;
+
+    if ((unsigned char) c->in[0] == TFS_PROTO_MAGIC) {
+        if (c->in_len < sizeof(tfs_request))
+            return 0;
+        memcpy(&hdr, c->in, sizeof(tfs_request));
+        int len = requestLength(&hdr);
+        if (len == FAIL)
+            return FAIL;
+        return c->in_len >= len ? len : 0;
+    }
+
+    if ((end = memchr(c->in, '\0', c->in_len)))
+        return end - c->in + 1;
+    return c->in_len >= MAX_INPUT_SIZE ? FAIL : 0;
+}
+
+/*
+ * Sends as many of a connection's pending replies as the socket takes.
+ * On a stream, a reply that passes a descriptor goes out in a sendmsg of
+ * its own, so the descriptor arrives with the start of that reply.
+ * Returns: SUCCESS or FAIL if the connection is broken
+ */
+static int flushReplies(connection *c) {
+    struct iovec iovs[CONN_MAX_REPLIES] = {{ 0 }};
+    struct mmsghdr msgs[CONN_MAX_REPLIES];
+    char control[CONN_MAX_REPLIES][CMSG_SPACE(sizeof(int))];
+    int sent = 0;
+
+    /* bounded, so that the compiler sees the arrays can hold them */
+    if (c->n_out <= 0 || c->n_out > CONN_MAX_REPLIES)
+        return SUCCESS;
+
+    for (int i = 0; i < c->n_out; i++) {
+        iovs[i].iov_base = c->out[i].data;
+        iovs[i].iov_len = c->out[i].len;
+    }
+    iovs[0].iov_base = (char *) iovs[0].iov_base + c->out_off;
+    iovs[0].iov_len -= c->out_off;
+
+    if (transport == SOCK_SEQPACKET) {
+        /* one message per reply */
+        memset(msgs, 0, sizeof(struct mmsghdr) * c->n_out);
+        for (int i = 0; i < c->n_out; i++) {
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            attachFd(&msgs[i].msg_hdr, control[i], c->out[i].fd);
+        }
+        sent = sendmmsg(c->fd, msgs, c->n_out, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? SUCCESS : FAIL;
+        for (int i = 0; i < sent; i++)
+            if (c->out[i].fd >= 0)
+                close(c->out[i].fd);
+    } else {
+        struct msghdr msg = { .msg_iov = iovs, .msg_iovlen = 1 };
+
+        if (c->out[0].fd >= 0)
+            attachFd(&msg, control[0], c->out[0].fd);
+        else
+            while (msg.msg_iovlen < c->n_out && c->out[msg.msg_iovlen].fd < 0)
+                msg.msg_iovlen++;
+
+        ssize_t n = sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? SUCCESS : FAIL;
+        if (n > 0 && c->out[0].fd >= 0) {
+            close(c->out[0].fd);
+            c->out[0].fd = -1;
+        }
+
+        /* a reply may have gone out only in part */
+        n += c->out_off;
+        while (sent < c->n_out && n >= c->out[sent].len)
+            n -= c->out[sent++].len;
+        c->out_off = n;
+    }
+
+    c->n_out -= sent;
+    memmove(c->out, c->out + sent, sizeof(reply_slot) * c->n_out);
+    return SUCCESS;
+}
+
+/*
+ * Serves a connection that epoll reported ready: applies up to batchSize
+ * of its requests, in order, and sends back what the socket takes.
+ * Reading stops while too many replies are pending, so a client that
+ * does not read its replies only slows itself down.
+ * Input:
+ *  - c: the connection
+ *  - req: this thread's request context
+ */
+static void serveConnection(connection *c, request_ctx *req) {
+    int handled = 0, len;
+    ssize_t n;
+
+    if (flushReplies(c) == FAIL) {
+        closeConnection(c);
+        return;
+    }
+
+    while (handled < batchSize && c->n_out < CONN_MAX_REPLIES) {
+        if ((len = frameLength(c)) == FAIL) {
+            fprintf(stderr, "Error: invalid request on connection, closing it\n");
+            closeConnection(c);
+            return;
+        }
+
+        if (len > 0) {
+            memcpy(req->command, c->in, len);
+            req->command[len] = '\0';
+            req->len = len;
+            req->request_fd = c->in_fd;
+            req->session = c;
+            c->in_fd = -1;
+            c->in_len -= len;
+            memmove(c->in, c->in + len, c->in_len);
+
+            handleRequest(req);
+
+            reply_slot *slot = &c->out[c->n_out++];
+            slot->len = req->reply_len;
+            slot->fd = req->reply_fd;
+            memcpy(slot->data, req->reply, req->reply_len);
+            handled++;
+            continue;
+        }
+
+        /* need more input; a descriptor goes with the next request framed */
+        struct iovec iov = { c->in + c->in_len, CONN_BUF_SIZE - c->in_len };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                              .msg_control = req->control, .msg_controllen = sizeof(req->control) };
+        n = recvmsg(c->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) { /* the client went away */
+            closeConnection(c);
+            return;
         }
-        
-        /* sending the result of applying the command */
-        if (sendto(sockfd, &res, sizeof(int), 0, (struct sockaddr *)&client_addr, addrlen) < 0) {
-            perror("server: sendto error");
+        int fd = takeFd(&msg);
+        if (fd >= 0) {
+            if (c->in_fd >= 0)
+                close(c->in_fd);
+            c->in_fd = fd;
+        }
+        c->in_len += n;
+    }
+
+    if (flushReplies(c) == FAIL) {
+        closeConnection(c);
+        return;
+    }
+
+    /*
+     * Pending replies wait for the socket to become writable. Requests
+     * already buffered don't make the socket readable again, so they also
+     * ask for EPOLLOUT, which fires right away.
+     */
+    uint32_t events = 0;
+    if (c->n_out < CONN_MAX_REPLIES)
+        events |= EPOLLIN;
+    if (c->n_out > 0 || frameLength(c) > 0)
+        events |= EPOLLOUT;
+    armConnection(c, EPOLL_CTL_MOD, events);
+}
+
+/*
+ * Waits for connections that have work and serves them, one at a time.
+ * Input:
+ *  - req: this thread's request context
+ */
+void serveConnections(request_ctx *req) {
+    struct epoll_event ev;
+
+    while (1) {
+        if (epoll_wait(epfd, &ev, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("server: epoll_wait error");
             exit(EXIT_FAILURE);
         }
+
+        if (ev.data.ptr == NULL)
+            acceptConnections();
+        else
+            serveConnection(ev.data.ptr, req);
     }
 }
 
@@ -145,7 +1133,23 @@ void applyCommands() {
  * Auxiliary function for using applyCommands with threads.
  */
 void * fnThread(void * arg) {
-    applyCommands();
+    request_batch *b;
+
+    if (!(b = malloc(sizeof(request_batch))) ||
+        !(b->reqs = malloc(sizeof(request_ctx) * batchSize)) ||
+        !(b->iovs = malloc(sizeof(struct iovec) * batchSize)) ||
+        !(b->msgs = malloc(sizeof(struct mmsghdr) * batchSize))) {
+        fprintf(stderr, "Error: No memory allocated for requests.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (transport == SOCK_DGRAM)
+        applyCommands(b);
+    else
+        serveConnections(&b->reqs[0]);
+    free(b->reqs);
+    free(b->iovs);
+    free(b->msgs);
+    free(b);
     return NULL;
 }
 
@@ -170,8 +1174,10 @@ int setSockAddrUn(char * path, struct sockaddr_un * addr) {
  * Returns: SUCCESS or FAIL
  */
 int mount() {
-    /* create the unix datagram socket */
-    if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    socklen_t addrlen;
+
+    /* create the unix socket */
+    if ((sockfd = socket(AF_UNIX, transport, 0)) < 0) {
         perror("server: can't open socket");
         return FAIL;
     }
@@ -188,13 +1194,41 @@ int mount() {
         perror("client: can't change permissions of socket");
         return FAIL;
     } 
+    if (transport == SOCK_DGRAM)
+        return SUCCESS;
+
+    /* connections are accepted by whichever worker epoll wakes up */
+    if (listen(sockfd, SOMAXCONN) < 0) {
+        perror("server: listen error");
+        return FAIL;
+    }
+    int flags = 1;
+    if (ioctl(sockfd, FIONBIO, &flags) < 0 || (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("server: can't set up epoll");
+        return FAIL;
+    }
+    armConnection(NULL, EPOLL_CTL_ADD, EPOLLIN);
     return SUCCESS;
 }
 
+/**
+ * Takes a checkpoint every checkpointInterval seconds
+ */
+void *fnCheckpoint(void *arg) {
+    while (1) {
+        sleep(checkpointInterval);
+        if (checkpoint_save() == FAIL)
+            fprintf(stderr, "Error: unable to take a checkpoint\n");
+    }
+    return NULL;
+}
+
 /**
  * Disassembles the server socket
  */ 
 void unmount() {
+    if (transport != SOCK_DGRAM)
+        close(epfd);
     close(sockfd);
     unlink(serverName);
 }
@@ -204,6 +1238,9 @@ int main(int argc, char* argv[]) {
     pthread_t * tid;
 
     parseArgs(argc, argv); 
+    shmSpins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPINS : 0;
+    inode_print_threads(printThreads ? printThreads : sysconf(_SC_NPROCESSORS_ONLN));
+    inode_bias_levels(biasLevels);
     
     /* assemble server socket */
     if (mount() == SUCCESS)
@@ -215,8 +1252,20 @@ int main(int argc, char* argv[]) {
 
     tid = create_threads_vec(numberThreads); 
 
+    /* init_fs loads the checkpoint and replays the log after it */
+    if (logPath && wal_open(logPath, logMode) == FAIL)
+        exit(EXIT_FAILURE);
+    if (checkpointPath && checkpoint_open(checkpointPath) == FAIL)
+        exit(EXIT_FAILURE);
     init_fs();
 
+    if (checkpointPath) {
+        pthread_t ckpt;
+        if (pthread_create(&ckpt, NULL, fnCheckpoint, NULL) != 0 || pthread_detach(ckpt) != 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
     /* create the execution threads */
     for (numT = 0; numT < numberThreads; numT++) {
         if (pthread_create(&tid[numT], NULL, fnThread, NULL) != 0) {
@@ -234,7 +1283,6 @@ int main(int argc, char* argv[]) {
     destroy_fs();
     unmount();
 
-    free(serverName);
     free(tid);
 
     exit(EXIT_SUCCESS);